@@ -15,9 +15,24 @@
  */
 
 #include "pin.H"
+#include "control_manager.H"
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <cstddef>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <deque>
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
 using std::string;
 using std::hex;
 using std::ios;
@@ -25,6 +40,10 @@ using std::setw;
 using std::cerr;
 using std::dec;
 using std::endl;
+using CONTROLLER::CONTROL_MANAGER;
+using CONTROLLER::EVENT_TYPE;
+using CONTROLLER::EVENT_START;
+using CONTROLLER::EVENT_STOP;
 
 #define DEBUG 0
 
@@ -34,56 +53,568 @@ using std::endl;
  * 4 MSBs in addr are used for the signitures
  *
  * 0000: memory ref
+ * 0001: range of a string instruction, gather or scatter
+ * 0111: filter hits
  * 1000: malloc
  * 1001: calloc
  * 1010: realloc
  * 1011: free
- * 1100: mmap?
+ * 1100: mmap, munmap, mremap, brk and madvise
+ * 1101: chunk header
+ * 1110: sampling phase
  * 1111: icount
  */
 #define ClearSign(_addr)			((_addr) & ((0x1UL << 60) - 1))
 #define SetSign(_addr, _sign)		(ClearSign(_addr) | ((_sign) << 60))
 
-#define SignRef(_addr)				SetSign(_addr, 0x0UL);
-#define SignMalloc(_addr)			SetSign(_addr, 0x8UL);
-#define SignCalloc(_addr)			SetSign(_addr, 0x9UL);
-#define SignRealloc(_addr)			SetSign(_addr, 0xaUL);
-#define SignFree(_addr)				SetSign(_addr, 0xbUL);
-#define SignMmap(_addr)				SetSign(_addr, 0xcUL);
-#define SignIcount(_addr)			SetSign(_addr, 0xfUL);
+#define SignRef(_addr)				SetSign(_addr, 0x0UL)
+#define SignRange(_addr)			SetSign(_addr, 0x1UL)
+#define SignHits(_addr)				SetSign(_addr, 0x7UL)
+#define SignMalloc(_addr)			SetSign(_addr, 0x8UL)
+#define SignCalloc(_addr)			SetSign(_addr, 0x9UL)
+#define SignRealloc(_addr)			SetSign(_addr, 0xaUL)
+#define SignFree(_addr)				SetSign(_addr, 0xbUL)
+#define SignMmap(_addr)				SetSign(_addr, 0xcUL)
+#define SignChunk(_tid)				SetSign(_tid, 0xdUL)
+#define SignPhase(_icount)			SetSign(_icount, 0xeUL)
+#define SignIcount(_addr)			SetSign(_addr, 0xfUL)
+
+/*
+ * The allocator entries carry the tag of the allocator function at bits
+ * 48-55 of the address (0 for the C allocator).
+ */
+#define ALLOC_TAG_SHIFT				48
+#define TagAddr(_addr, _tag)		((_addr) | ((ADDRINT)(_tag) << ALLOC_TAG_SHIFT))
+
+/*
+ * Ops of the mmap entries; MMAP_IN_ALLOC is set for the calls made inside
+ * the allocator functions.
+ */
+#define MMAP_OP_MMAP				0x0UL
+#define MMAP_OP_MUNMAP				0x1UL
+#define MMAP_OP_MREMAP				0x2UL
+#define MMAP_OP_BRK					0x3UL
+#define MMAP_OP_MADVISE				0x4UL
+#define MMAP_IN_ALLOC				0x100UL
 
 /* ===================================================================== */
-/* Names of malloc and free */
+/* Allocator functions
+ *
+ * Each function is recorded by its role; the arguments are given by their
+ * positions. memalign_out stores the object into the pointer of the first
+ * argument, as posix_memalign().
+ */
 /* ===================================================================== */
 #if defined(TARGET_MAC)
-#define MALLOC "_malloc"
-#define CALLOC "_calloc"
-#define REALLOC "_realloc"
-#define FREE "_free"
+#define SYM_PREFIX "_"
 #else
-#define MALLOC "malloc"
-#define CALLOC "calloc"
-#define REALLOC "realloc"
-#define FREE "free"
+#define SYM_PREFIX ""
 #endif
 
+enum alloc_role {
+	ROLE_MALLOC = 0,				/* (size) */
+	ROLE_CALLOC,					/* (nmemb, size) */
+	ROLE_REALLOC,					/* (ptr, size) */
+	ROLE_FREE,						/* (ptr) */
+	ROLE_MEMALIGN_OUT,				/* (memptr, size) */
+	NR_ROLES,
+};
+
+enum alloc_tag {
+	ALLOC_TAG_C = 0,
+	ALLOC_TAG_NEW,					/* operator new / delete */
+	ALLOC_TAG_NEW_ARRAY,			/* operator new[] / delete[] */
+	ALLOC_TAG_ALIGNED,				/* memalign() and the family */
+	ALLOC_TAG_EXT,					/* extensions of jemalloc */
+	ALLOC_TAG_CUSTOM,				/* -alloc_sym */
+};
+
+struct AllocSym {
+	string name;
+	UINT32 role;
+	UINT32 arg0;
+	UINT32 arg1;
+	UINT32 tag;
+};
+
+struct AllocProfileSym {
+	const char *name;
+	UINT32 role;
+	UINT32 arg0;
+	UINT32 arg1;
+	UINT32 tag;
+};
+
+static const char * const RoleNames[NR_ROLES] = {
+	"malloc", "calloc", "realloc", "free", "memalign_out",
+};
+
+static const struct AllocProfileSym GlibcSyms[] = {
+	{ "malloc",			ROLE_MALLOC,		0, 0, ALLOC_TAG_C },
+	{ "calloc",			ROLE_CALLOC,		0, 1, ALLOC_TAG_C },
+	{ "realloc",		ROLE_REALLOC,		0, 1, ALLOC_TAG_C },
+	{ "free",			ROLE_FREE,			0, 0, ALLOC_TAG_C },
+	{ "cfree",			ROLE_FREE,			0, 0, ALLOC_TAG_C },
+	{ "memalign",		ROLE_MALLOC,		1, 0, ALLOC_TAG_ALIGNED },
+	{ "aligned_alloc",	ROLE_MALLOC,		1, 0, ALLOC_TAG_ALIGNED },
+	{ "valloc",			ROLE_MALLOC,		0, 0, ALLOC_TAG_ALIGNED },
+	{ "pvalloc",		ROLE_MALLOC,		0, 0, ALLOC_TAG_ALIGNED },
+	{ "posix_memalign",	ROLE_MEMALIGN_OUT,	0, 2, ALLOC_TAG_ALIGNED },
+
+	/* operator new / delete of LP64 */
+	{ "_Znwm",							ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZnwmRKSt9nothrow_t",			ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZnwmSt11align_val_t",			ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZnwmSt11align_val_tRKSt9nothrow_t", ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZdlPv",							ROLE_FREE, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZdlPvm",						ROLE_FREE, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZdlPvRKSt9nothrow_t",			ROLE_FREE, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZdlPvSt11align_val_t",			ROLE_FREE, 0, 0, ALLOC_TAG_NEW },
+	{ "_ZdlPvmSt11align_val_t",			ROLE_FREE, 0, 0, ALLOC_TAG_NEW },
+	{ "_Znam",							ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZnamRKSt9nothrow_t",			ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZnamSt11align_val_t",			ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZnamSt11align_val_tRKSt9nothrow_t", ROLE_MALLOC, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZdaPv",							ROLE_FREE, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZdaPvm",						ROLE_FREE, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZdaPvRKSt9nothrow_t",			ROLE_FREE, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZdaPvSt11align_val_t",			ROLE_FREE, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "_ZdaPvmSt11align_val_t",			ROLE_FREE, 0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ NULL },
+};
+
+/* in addition to the glibc symbols, which jemalloc also exports */
+static const struct AllocProfileSym JemallocSyms[] = {
+	{ "mallocx",		ROLE_MALLOC,		0, 0, ALLOC_TAG_EXT },
+	{ "rallocx",		ROLE_REALLOC,		0, 1, ALLOC_TAG_EXT },
+	{ "dallocx",		ROLE_FREE,			0, 0, ALLOC_TAG_EXT },
+	{ "sdallocx",		ROLE_FREE,			0, 0, ALLOC_TAG_EXT },
+	{ NULL },
+};
+
+/*
+ * in addition to the glibc symbols; the standard names are aliases of these
+ * in tcmalloc, so the aliases found first are recorded by their tags
+ */
+static const struct AllocProfileSym TcmallocSyms[] = {
+	{ "tc_malloc",				ROLE_MALLOC,		0, 0, ALLOC_TAG_C },
+	{ "tc_calloc",				ROLE_CALLOC,		0, 1, ALLOC_TAG_C },
+	{ "tc_realloc",				ROLE_REALLOC,		0, 1, ALLOC_TAG_C },
+	{ "tc_free",				ROLE_FREE,			0, 0, ALLOC_TAG_C },
+	{ "tc_free_sized",			ROLE_FREE,			0, 0, ALLOC_TAG_C },
+	{ "tc_cfree",				ROLE_FREE,			0, 0, ALLOC_TAG_C },
+	{ "tc_memalign",			ROLE_MALLOC,		1, 0, ALLOC_TAG_ALIGNED },
+	{ "tc_valloc",				ROLE_MALLOC,		0, 0, ALLOC_TAG_ALIGNED },
+	{ "tc_pvalloc",				ROLE_MALLOC,		0, 0, ALLOC_TAG_ALIGNED },
+	{ "tc_posix_memalign",		ROLE_MEMALIGN_OUT,	0, 2, ALLOC_TAG_ALIGNED },
+	{ "tc_new",					ROLE_MALLOC,		0, 0, ALLOC_TAG_NEW },
+	{ "tc_new_nothrow",			ROLE_MALLOC,		0, 0, ALLOC_TAG_NEW },
+	{ "tc_delete",				ROLE_FREE,			0, 0, ALLOC_TAG_NEW },
+	{ "tc_delete_sized",		ROLE_FREE,			0, 0, ALLOC_TAG_NEW },
+	{ "tc_delete_nothrow",		ROLE_FREE,			0, 0, ALLOC_TAG_NEW },
+	{ "tc_newarray",			ROLE_MALLOC,		0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "tc_newarray_nothrow",	ROLE_MALLOC,		0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "tc_deletearray",			ROLE_FREE,			0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "tc_deletearray_sized",	ROLE_FREE,			0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ "tc_deletearray_nothrow",	ROLE_FREE,			0, 0, ALLOC_TAG_NEW_ARRAY },
+	{ NULL },
+};
+
+/* ===================================================================== */
+/* Per-thread trace buffer
+ *
+ * Analysis code only appends fixed-size records into the buffer of the
+ * executing thread (INS_InsertFillBuffer). Records are encoded into the trace
+ * format and written to the trace file when the buffer gets full.
+ */
+
+enum rec_type {
+	REC_REF = 0,
+	REC_ALLOC_SP,					/* stack pointer at the entry */
+	REC_MALLOC_ARGS,				/* size, -, tag */
+	REC_CALLOC_ARGS,				/* nmemb, size, tag */
+	REC_REALLOC_ARGS,				/* ptr, size, tag */
+	REC_FREE,						/* ptr, -, tag */
+	REC_ALLOC_RET,					/* return value, stack pointer */
+	REC_PHASE,
+	REC_SYSCALL_ARGS0,				/* number, arg 0 */
+	REC_SYSCALL_ARGS1,				/* arg 1, arg 2 */
+	REC_SYSCALL_ARGS2,				/* arg 3, stack pointer */
+	REC_SYSCALL_RET,
+	REC_RANGE_COUNT,				/* count, flags register */
+	REC_RANGE,						/* ea, -, element size | REC_RANGE_WRITE */
+};
+
+#define REC_RANGE_WRITE				0x80000000U
+#define RANGE_WRITE					(0x1UL << 63)	/* in the length word */
+#define FLAGS_DF					0x400UL			/* direction flag */
+
+struct TraceRecord {
+	ADDRINT val;					/* ea, return value or the 1st arg */
+	ADDRINT arg;					/* the 2nd arg */
+	UINT32 size;					/* ref size or alloc tag */
+	UINT32 type;					/* enum rec_type */
+};
+
+/* Largest encoded entry: an mmap entry with a raw token */
+#define MAX_ENTRY_SIZE				(5 * sizeof(ADDRINT) + 1)
+#define HITS_ENTRY_SIZE				(2 * sizeof(ADDRINT) + 1)
+
+/*
+ * Each buffer is written as a chunk tagged with the OS thread id and
+ * a global sequence number taken when the buffer started filling. sim merges
+ * the per-thread streams of chunks by the sequence number.
+ *
+ * word 0: SignChunk(tid) | flags << 32
+ * word 1: sequence number
+ * word 2: payload length (bytes)
+ */
+#define CHUNK_HDR_SIZE				(3 * sizeof(ADDRINT))
+#define CHUNK_FLAGS_SHIFT			32
+
+/* ===================================================================== */
+/* Trace format v2
+ *
+ * header:  struct TraceHeader + the command line of the tool (NUL-padded
+ *          to 8B)
+ * chunks:  as above, and CHUNK_SNAPSHOT chunks of the live objects and areas
+ * index:   a CHUNK_INDEX chunk of struct IndexEntry, one per chunk other
+ *          than the snapshots, in the order of the file
+ * trailer: offset of the index chunk + TRACE_INDEX_MAGIC
+ *
+ * The ref of an entry is the number of references recorded before the
+ * chunk in order of seq. A snapshot holds the areas mapped by the program
+ * and the objects live after the chunks written before it, as mmap and malloc
+ * entries; every -snapshot_chunks chunks, one is written before the next
+ * chunk.
+ */
+#define TRACE_MAGIC					0x3243525445534f50UL	/* "POSETRC2" */
+#define TRACE_INDEX_MAGIC			0x3258444945534f50UL	/* "POSEIDX2" */
+#define TRACE_VERSION				2
+#define TRACE_ADDR_BITS				48
+#define TRACE_FILTERED				0x100UL	/* the low bits are CHUNK_* */
+#define TRACE_SAMPLED				0x200UL
+
+#define CHUNK_SNAPSHOT				0x4UL
+#define CHUNK_INDEX					0x8UL
+
+struct TraceHeader {
+	UINT64 magic;
+	UINT32 version;
+	UINT32 size;					/* including the command line */
+	UINT32 page_size;
+	UINT32 addr_bits;
+	UINT64 flags;					/* CHUNK_* of the chunks + TRACE_* */
+	UINT64 block_records;			/* records of a trace buffer */
+};
+
+struct IndexEntry {
+	UINT64 off;						/* of the chunk header */
+	UINT64 len;						/* of the payload */
+	UINT64 seq;
+	UINT64 tid;
+	UINT64 flags;
+	UINT64 ref;
+	UINT64 icount;					/* of the thread at the start */
+	UINT64 snapshot;				/* offset of the last snapshot, or 0 */
+};
+
+struct LiveObject {
+	ADDRINT size;
+	UINT32 tag;
+};
+
+/* ===================================================================== */
+/* Shared-memory ring of -ring
+ *
+ * A single-producer single-consumer byte ring in /dev/shm/<name>, the same
+ * as struct ring_hdr of sim/ring.h. The chunks are copied into the ring
+ * instead of the trace file, and sim reads them concurrently. Pin's CRT has
+ * no shm_open(), so the file is opened in /dev/shm directly, which is where
+ * glibc's shm_open() puts it.
+ *
+ * head and tail are the numbers of bytes written and read, on their own
+ * cache lines. The writer waits while the ring is full, and sets eof after
+ * the last chunk.
+ */
+#define RING_MAGIC					0x474e495245534f50UL	/* "POSERING" */
+#define RING_CACHELINE				64
+#define RING_DATA_OFF				4096
+#define RING_POLL_NS				50000
+#define RING_CHECK_POLLS			20000	/* ~1 s between liveness checks */
+
+struct RingHdr {
+	UINT64 magic;
+	UINT64 size;					/* of the data; power of two */
+	UINT64 producer;				/* pid */
+	UINT64 consumer;				/* pid; 0 until attached */
+	UINT64 eof;
+	char pad0[RING_CACHELINE - 5 * sizeof(UINT64)];
+
+	UINT64 head;
+	char pad1[RING_CACHELINE - sizeof(UINT64)];
+
+	UINT64 tail;
+	char pad2[RING_CACHELINE - sizeof(UINT64)];
+};
+
+/* ===================================================================== */
+/* Compression
+ *
+ * CHUNK_DELTA: each reference is encoded as a token byte predicted by one of
+ * NR_PRED predictors (last address and stride) of the chunk. The predictors
+ * are reset at every chunk, so chunks are decoded independently.
+ *
+ * The bits of the token are:
+ *   bit 7:     0 (reference)
+ *   bit 6:     stride hit, no delta follows
+ *   bits 5-3:  predictor
+ *   bits 2-0:  log2 of the ref size, or 7 if a varint size follows
+ * followed by the zigzag varint delta from the last address of the
+ * predictor, unless hit. Other entries are a DELTA_RAW token followed by
+ * the entry in the plain format.
+ *
+ * The writer picks the predictor whose stride hits, or whose last address
+ * is the nearest within DELTA_NEAR; otherwise the predictors are replaced in
+ * round-robin, so that interleaved access streams settle in different ones.
+ *
+ * CHUNK_LZ: the payload is the length of the uncompressed payload (8B)
+ * followed by an LZ4 block of it.
+ */
+#define CHUNK_DELTA					0x1UL
+#define CHUNK_LZ					0x2UL
+
+#define NR_PRED						4
+#define DELTA_RAW					0x80
+#define DELTA_HIT					0x40
+#define DELTA_PRED_SHIFT			3
+#define DELTA_SIZE_VARINT			0x7
+#define DELTA_NEAR					4096	/* else a new predictor is used */
+
+#define LZ_HASH_BITS				12
+#define LZ_MIN_MATCH				4
+#define LZ_LAST_LITERALS			5
+#define LZ_MFLIMIT					12
+#define LZ_MAX_OFFSET				65535
+#define LZ_BOUND(_len)				((_len) + (_len) / 255 + 16)
+
+struct Predictor {
+	ADDRINT last;
+	ADDRINT stride;
+};
+
+/* ===================================================================== */
+/* Cache filter of -filter_kb
+ *
+ * A set-associative LRU cache per thread, modeled in the writer as the
+ * buffer is encoded (as dcache.H of SimpleExamples, but without its
+ * statistics). Only the references missing the filter are recorded. The
+ * references hitting it are counted in the line, and the count is recorded
+ * as a hits entry (address of the line + count) when the line is evicted,
+ * before a phase entry and at the exit of the thread, so that sim counts
+ * them as page hits in the right phase.
+ *
+ * A hits entry zeroes a count made by a hit of the buffer or left by the
+ * previous buffers, so a buffer emits at most BufRecords + FilterLines of
+ * them.
+ */
+struct FilterLine {
+	ADDRINT line;					/* line number + 1; 0 if invalid */
+	UINT64 last;					/* LRU stamp */
+	UINT64 hits;
+};
+
+/*
+ * Arguments of the allocator functions are recorded at the entry and paired
+ * with the return value at the exit by the stack pointer, which is the same
+ * at both. Allocator functions called inside another (e.g., malloc() by
+ * operator new) are not recorded, and a frame left without a return (e.g.,
+ * by a tail call) is dropped once a deeper or the same stack pointer is seen.
+ */
+#define MAX_ALLOC_FRAMES			8
+
+struct AllocFrame {
+	ADDRINT sp;
+	ADDRINT arg0;
+	ADDRINT arg1;
+	UINT32 type;					/* REC_*_ARGS or REC_FREE */
+	UINT32 tag;
+};
+
+/*
+ * Arguments of the system calls are likewise kept per thread until the
+ * result.
+ *
+ * Each thread owns a bounded pool of buffers. A full buffer is handed off to
+ * the writer thread, and the thread keeps running on a free buffer of its
+ * pool; it stalls only when the pool is exhausted.
+ */
+struct ThreadData {
+	struct AllocFrame frames[MAX_ALLOC_FRAMES];	/* outermost first */
+	UINT32 nr_frames;
+	ADDRINT entry_sp;				/* of the allocator function entered */
+	ADDRINT sys_nr;					/* of the last system call entered */
+	ADDRINT sys_args[4];
+	ADDRINT sys_sp;
+	ADDRINT range_count;			/* of the range recorded next */
+	ADDRINT range_flags;
+
+	OS_THREAD_ID os_tid;
+	UINT64 seq;						/* of the current buffer */
+	char *out;						/* encoded entries of a buffer */
+	char *lz;						/* compressed chunk */
+	struct Predictor pred[NR_PRED];
+	UINT32 pred_victim;
+	struct FilterLine *filter;		/* FilterSets x FilterWays */
+	UINT64 filter_clock;
+	UINT64 nr_refs;					/* recorded in the buffer encoded */
+	UINT64 icount;					/* at the start of the current buffer */
+
+	VOID **free_bufs;				/* protected by BufMutex */
+	UINT32 nr_free;
+	UINT32 nr_bufs;					/* allocated, including the current one */
+	VOID *cur_buf;
+	PIN_SEMAPHORE free_sem;			/* set when a buffer is returned */
+
+	UINT64 nr_handoff;
+	UINT64 nr_stall;
+	UINT64 stall_ns;
+};
+
+struct FullBuffer {
+	struct ThreadData *td;
+	VOID *buf;
+	UINT64 nr;
+	UINT64 seq;
+	UINT64 icount;
+};
+
+/*
+ * Sampling phases
+ *
+ * Each thread cycles through the phases by its own instruction count. Memory
+ * references are recorded only in PHASE_WARMUP and PHASE_MEASURE, while
+ * icount and the allocator functions are recorded all the time. A phase
+ * record (icount of the thread + the phase starting) is put at every
+ * boundary.
+ */
+enum phase {
+	PHASE_FF = 0,
+	PHASE_WARMUP,
+	PHASE_MEASURE,
+	NR_PHASES,
+};
+#define NEXT_PHASE(_phase)			(((_phase) + 1) % NR_PHASES)
+
 /* ===================================================================== */
 /* Global Variables */
 /* ===================================================================== */
 
 std::ofstream TraceFile;
+struct RingHdr *Ring;				/* instead of TraceFile with -ring */
+char *RingData;
+size_t RingMapSize;
+UINT64 RingWaits;					/* writes waiting for sim */
+UINT64 TraceOff;					/* bytes written */
+
+/* Index, live objects and mapped areas of the trace; protected by TraceLock */
+std::vector<struct IndexEntry> Index;
+std::map<ADDRINT, struct LiveObject> Live;
+std::map<ADDRINT, ADDRINT> LiveMaps;	/* start -> length, as the map areas of sim */
+ADDRINT BrkEnd;						/* 0 before the first brk() */
+UINT64 SnapshotOff;
+UINT64 NrUnsnapped;					/* chunks since the last snapshot */
 #if DEBUG
 std::ofstream DebugTraceFile;
 #endif
 
+BUFFER_ID BufId;
+TLS_KEY ThreadDataKey;
+PIN_LOCK TraceLock;
+UINT64 BufRecords;
+size_t OutSize;						/* of the encoded entries of a buffer */
+UINT64 GlobalSeq;
+UINT64 Compress;					/* CHUNK_* flags of the buffer chunks */
+UINT32 LzTable[1 << LZ_HASH_BITS];	/* protected by TraceLock */
+
+/* Per-thread state kept in tool registers */
+REG IcountReg;
+REG PhaseReg;
+REG PhaseEndReg;					/* icount at the end of the phase */
+REG MemptrReg;						/* memptr of memalign_out functions */
+REG RangeReg;						/* span of a gather or scatter */
+REG RangeLenReg;
+BOOL Sampling;
+UINT64 PhaseLength[NR_PHASES];
+
+/* Writer thread and the queue of full buffers */
+PIN_THREAD_UID WriterUid;
+PIN_MUTEX BufMutex;
+PIN_SEMAPHORE FullSem;				/* set when a buffer is queued */
+std::deque<struct FullBuffer> FullQueue;
+BOOL WriterExiting;
+BOOL WriterExited;
+
+/*
+ * Region of interest, driven by the controller knobs (-skip, -length,
+ * -start_address, -stop_address, ...). Memory references and the sampling
+ * phases are instrumented only inside the region; icount is counted all the
+ * time, so that the instructions of sim cover the whole run.
+ */
+CONTROL_MANAGER Control;
+volatile BOOL InRegion;
+
+/* Cache filter; disabled if FilterLines is 0 */
+UINT32 FilterLines;
+UINT32 FilterSets;
+UINT32 FilterWays;
+UINT32 FilterLineShift;
+
+/* Allocator functions recorded, of -alloc_profile and -alloc_sym */
+std::vector<struct AllocSym> AllocSyms;
+
+/* Stall statistics of exited threads */
+UINT64 TotalHandoff;
+UINT64 TotalStall;
+UINT64 TotalStallNs;
+
 /* ===================================================================== */
 /* Commandline Switches */
 /* ===================================================================== */
 
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
 		"o", "posetrace.out", "specify trace file name");
+KNOB<string> KnobRing(KNOB_MODE_WRITEONCE, "pintool",
+		"ring", "", "stream the trace into sim over the shared-memory ring /dev/shm/<name> instead of -o");
+KNOB<UINT32> KnobRingMB(KNOB_MODE_WRITEONCE, "pintool",
+		"ring_mb", "64", "size of the ring in MB (power of two)");
 KNOB<BOOL> KnobValues(KNOB_MODE_WRITEONCE, "pintool",
 		"values", "1", "Output memory values reads and written");
+KNOB<UINT32> KnobBufPages(KNOB_MODE_WRITEONCE, "pintool",
+		"buf_pages", "1024", "number of pages of each per-thread trace buffer");
+KNOB<UINT32> KnobNrBufs(KNOB_MODE_WRITEONCE, "pintool",
+		"nr_bufs", "4", "number of trace buffers per thread handed off to the writer");
+KNOB<string> KnobCompress(KNOB_MODE_WRITEONCE, "pintool",
+		"compress", "none", "compression of the trace: none, delta or lz (delta + LZ4)");
+KNOB<string> KnobAllocProfile(KNOB_MODE_WRITEONCE, "pintool",
+		"alloc_profile", "glibc", "allocator functions to record: glibc, jemalloc, tcmalloc or none");
+KNOB<string> KnobAllocSym(KNOB_MODE_APPEND, "pintool",
+		"alloc_sym", "", "additional allocator function as <symbol>=<role>(<arg>[,<arg>]); "
+		"roles: malloc(size), calloc(nmemb,size), realloc(ptr,size), free(ptr), memalign_out(memptr,size)");
+KNOB<UINT32> KnobSnapshotChunks(KNOB_MODE_WRITEONCE, "pintool",
+		"snapshot_chunks", "256", "chunks between the snapshots of the live objects and areas (0: no snapshot)");
+KNOB<UINT32> KnobFilterKB(KNOB_MODE_WRITEONCE, "pintool",
+		"filter_kb", "0", "size in KB of the cache filter; record only the references missing it (0: no filter)");
+KNOB<UINT32> KnobFilterWays(KNOB_MODE_WRITEONCE, "pintool",
+		"filter_ways", "8", "associativity of the cache filter");
+KNOB<UINT32> KnobFilterLine(KNOB_MODE_WRITEONCE, "pintool",
+		"filter_line", "64", "line size in bytes of the cache filter");
+KNOB<UINT64> KnobSampleFF(KNOB_MODE_WRITEONCE, "pintool",
+		"sample_ff", "0", "instructions to fast-forward between sampled intervals (0: no sampling)");
+KNOB<UINT64> KnobSampleWarmup(KNOB_MODE_WRITEONCE, "pintool",
+		"sample_warmup", "0", "instructions of warm-up at the head of each sampled interval");
+KNOB<UINT64> KnobSampleLength(KNOB_MODE_WRITEONCE, "pintool",
+		"sample_length", "10000000", "instructions measured in each sampled interval");
 
 /* ===================================================================== */
 /* Print Help Message                                                    */
@@ -103,244 +634,1553 @@ static INT32 Usage()
 	return -1;
 }
 
-static VOID RecordMem(VOID * addr, INT32 size)
+/* ===================================================================== */
+
+static inline char *EmitWord(char *out, ADDRINT word)
 {
-	ADDRINT address = SignRef((ADDRINT) addr);
+	memcpy(out, &word, sizeof(ADDRINT));
+	return out + sizeof(ADDRINT);
+}
 
+static inline char *EmitRef(char *out, ADDRINT addr, INT32 size)
+{
 #if DEBUG
 	DebugTraceFile << addr << " " << size << endl;
 #endif
-	TraceFile.write((char *)&address, sizeof(ADDRINT));
-	TraceFile.write((char *)&size, sizeof(INT32));
+	out = EmitWord(out, SignRef(addr));
+	memcpy(out, &size, sizeof(INT32));
+	return out + sizeof(INT32);
 }
 
-static VOID * WriteAddr;
-static INT32 WriteSize;
+static inline char *EmitVarint(char *out, UINT64 val)
+{
+	while (val >= 0x80) {
+		*out++ = (char)(val | 0x80);
+		val >>= 7;
+	}
+	*out++ = (char)val;
+	return out;
+}
 
-static VOID RecordWriteAddrSize(VOID * addr, INT32 size)
+static inline UINT32 SizeCode(UINT32 size)
 {
-	WriteAddr = addr;
-	WriteSize = size;
+	UINT32 code;
+
+	for (code = 0; code < DELTA_SIZE_VARINT; code++) {
+		if (size == (1U << code))
+			return code;
+	}
+	return DELTA_SIZE_VARINT;
+}
+
+static inline char *EmitDeltaRef(struct ThreadData *td, char *out,
+		ADDRINT addr, UINT32 size)
+{
+	struct Predictor *pred;
+	UINT32 code = SizeCode(size);
+	UINT32 token;
+	UINT64 dist, best_dist = ~0UL;
+	INT64 delta;
+	int i, best = 0;
+
+#if DEBUG
+	DebugTraceFile << addr << " " << size << endl;
+#endif
+	for (i = 0; i < NR_PRED; i++) {
+		pred = &td->pred[i];
+		if (addr == pred->last + pred->stride) {
+			best = i;
+			break;
+		}
+
+		delta = (INT64)(addr - pred->last);
+		dist = delta < 0 ? -(UINT64)delta : (UINT64)delta;
+		if (dist < best_dist) {
+			best = i;
+			best_dist = dist;
+		}
+	}
+
+	if (i == NR_PRED && best_dist >= DELTA_NEAR) {
+		best = td->pred_victim;
+		td->pred_victim = (td->pred_victim + 1) % NR_PRED;
+	}
+
+	pred = &td->pred[best];
+	delta = (INT64)(addr - pred->last);
+	token = (best << DELTA_PRED_SHIFT) | code;
+
+	if (i < NR_PRED) {
+		*out++ = (char)(token | DELTA_HIT);
+	} else {
+		*out++ = (char)token;
+		out = EmitVarint(out, ((UINT64)delta << 1) ^ (UINT64)(delta >> 63));
+	}
+	if (code == DELTA_SIZE_VARINT)
+		out = EmitVarint(out, size);
+
+	pred->stride = addr - pred->last;
+	pred->last = addr;
+
+	return out;
 }
 
+/* Prefix of the entries other than the references */
+static inline char *EmitRaw(char *out)
+{
+	if (Compress & CHUNK_DELTA)
+		*out++ = (char)DELTA_RAW;
+	return out;
+}
 
-static VOID RecordMemWrite(VOID)
+/*
+ * A range of count elements from ea; a string instruction goes down from ea
+ * with the direction flag set
+ */
+static char *EmitRange(char *out, ADDRINT ea, UINT64 count, ADDRINT flags,
+		UINT32 size)
 {
-	RecordMem(WriteAddr, WriteSize);
+	UINT64 elem = size & ~REC_RANGE_WRITE;
+	UINT64 len = count * elem;
+	ADDRINT start = (flags & FLAGS_DF) ? ea - len + elem : ea;
+
+	if (!len)
+		return out;
+
+#if DEBUG
+	DebugTraceFile << start << " range " << len << endl;
+#endif
+	out = EmitRaw(out);
+	out = EmitWord(out, SignRange(start));
+	out = EmitWord(out, len | ((size & REC_RANGE_WRITE) ? RANGE_WRITE : 0));
+
+	return out;
 }
 
-VOID Instruction(INS ins, VOID *v)
+static char *EmitHits(char *out, struct FilterLine *fl)
 {
+	ADDRINT addr = (fl->line - 1) << FilterLineShift;
 
-	// instruments loads using a predicated call, i.e.
-	// the call happens iff the load will be actually executed
+#if DEBUG
+	DebugTraceFile << addr << " hits " << fl->hits << endl;
+#endif
+	out = EmitRaw(out);
+	out = EmitWord(out, SignHits(addr));
+	out = EmitWord(out, fl->hits);
+	fl->hits = 0;
 
-	if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins))
-	{
-		INS_InsertPredicatedCall(
-				ins, IPOINT_BEFORE, (AFUNPTR)RecordMem,
-				IARG_MEMORYREAD_EA,
-				IARG_MEMORYREAD_SIZE,
-				IARG_END);
+	return out;
+}
+
+/* Returns the line if it hits; otherwise the line is filled in the LRU way */
+static inline struct FilterLine *FilterLookup(struct ThreadData *td,
+		ADDRINT line, char **out)
+{
+	struct FilterLine *set = &td->filter[(line & (FilterSets - 1)) * FilterWays];
+	struct FilterLine *victim = set;
+	UINT32 i;
+
+	td->filter_clock++;
+	for (i = 0; i < FilterWays; i++) {
+		if (set[i].line == line + 1) {
+			set[i].last = td->filter_clock;
+			return &set[i];
+		}
+		if (set[i].last < victim->last)
+			victim = &set[i];
 	}
 
-	if (INS_HasMemoryRead2(ins) && INS_IsStandardMemop(ins))
-	{
-		INS_InsertPredicatedCall(
-				ins, IPOINT_BEFORE, (AFUNPTR)RecordMem,
-				IARG_MEMORYREAD2_EA,
-				IARG_MEMORYREAD_SIZE,
-				IARG_END);
+	if (victim->hits)
+		*out = EmitHits(*out, victim);
+	victim->line = line + 1;
+	victim->last = td->filter_clock;
+
+	return NULL;
+}
+
+/* Returns TRUE if the reference hits the filter and is not recorded */
+static inline BOOL FilterRef(struct ThreadData *td, ADDRINT addr,
+		UINT32 size, char **out)
+{
+	ADDRINT first = addr >> FilterLineShift;
+	ADDRINT last = (addr + (size ? size - 1 : 0)) >> FilterLineShift;
+	struct FilterLine *fl, *fl_last;
+
+	/* a reference across two lines hits only if both do */
+	fl = FilterLookup(td, first, out);
+	fl_last = last != first ? FilterLookup(td, last, out) : fl;
+	if (!fl || !fl_last)
+		return FALSE;
+
+	fl->hits++;
+	return TRUE;
+}
+
+static char *FilterFlush(struct ThreadData *td, char *out)
+{
+	UINT32 i;
+
+	for (i = 0; i < FilterLines; i++) {
+		if (td->filter[i].hits)
+			out = EmitHits(out, &td->filter[i]);
 	}
 
-	// instruments stores using a predicated call, i.e.
-	// the call happens iff the store will be actually executed
-	if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins))
-	{
-		INS_InsertPredicatedCall(
-				ins, IPOINT_BEFORE, (AFUNPTR)RecordWriteAddrSize,
-				IARG_MEMORYWRITE_EA,
-				IARG_MEMORYWRITE_SIZE,
-				IARG_END);
+	return out;
+}
 
-		if (INS_IsValidForIpointAfter(ins))
-		{
-			INS_InsertCall(
-					ins, IPOINT_AFTER, (AFUNPTR)RecordMemWrite,
-					IARG_END);
-		}
-		if (INS_IsValidForIpointTakenBranch(ins))
-		{
-			INS_InsertCall(
-					ins, IPOINT_TAKEN_BRANCH, (AFUNPTR)RecordMemWrite,
-					IARG_END);
+static inline UINT32 Read32(const UINT8 *p)
+{
+	UINT32 val;
+
+	memcpy(&val, p, sizeof(UINT32));
+	return val;
+}
+
+static inline UINT8 *EmitLzLength(UINT8 *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (UINT8)len;
+	return op;
+}
+
+/* Compress src into an LZ4 block; dst must hold LZ_BOUND(len) bytes */
+static size_t LzCompress(const char *src, size_t len, char *dst)
+{
+	const UINT8 *base = (const UINT8 *)src;
+	const UINT8 *ip = base, *anchor = base;
+	const UINT8 *end = base + len;
+	const UINT8 *mflimit = end - LZ_MFLIMIT;
+	const UINT8 *matchlimit = end - LZ_LAST_LITERALS;
+	const UINT8 *match;
+	UINT8 *op = (UINT8 *)dst, *token;
+	size_t lit, mlen;
+	UINT32 seq, h, ref;
+
+	memset(LzTable, 0, sizeof(LzTable));
+
+	while (len > LZ_MFLIMIT && ip < mflimit) {
+		seq = Read32(ip);
+		h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		ref = LzTable[h];
+		LzTable[h] = ip - base + 1;
+
+		match = base + ref - 1;
+		if (!ref || ip - match > LZ_MAX_OFFSET || Read32(match) != seq) {
+			ip++;
+			continue;
 		}
 
+		for (mlen = LZ_MIN_MATCH;
+				ip + mlen < matchlimit && ip[mlen] == match[mlen]; mlen++)
+			;
+
+		lit = ip - anchor;
+		token = op++;
+		*token = (UINT8)(((lit < 15 ? lit : 15) << 4) |
+				(mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15));
+		if (lit >= 15)
+			op = EmitLzLength(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		*op++ = (UINT8)(ip - match);
+		*op++ = (UINT8)((ip - match) >> 8);
+		if (mlen - LZ_MIN_MATCH >= 15)
+			op = EmitLzLength(op, mlen - LZ_MIN_MATCH - 15);
+
+		ip += mlen;
+		anchor = ip;
 	}
-}
 
-/* ===================================================================== */
+	/* last literals */
+	lit = end - anchor;
+	token = op++;
+	*token = (UINT8)((lit < 15 ? lit : 15) << 4);
+	if (lit >= 15)
+		op = EmitLzLength(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
 
-static ADDRINT malloc_size;
-static ADDRINT calloc_nmemb;
-static ADDRINT calloc_size;
-static ADDRINT realloc_ptr;
-static ADDRINT realloc_size;
+	return op - (UINT8 *)dst;
+}
 
-VOID MallocBefore(ADDRINT size)
+/*
+ * Push the frame of an allocator function entered; returns TRUE if it is the
+ * outermost one, which is recorded.
+ */
+static BOOL PushFrame(struct ThreadData *td, struct TraceRecord *rec)
 {
-	malloc_size = size;
+	struct AllocFrame *frame;
+	BOOL outer;
+
+	/* frames at or below the entry have returned without a record */
+	while (td->nr_frames &&
+			td->frames[td->nr_frames - 1].sp <= td->entry_sp)
+		td->nr_frames--;
+
+	outer = !td->nr_frames;
+	if (td->nr_frames == MAX_ALLOC_FRAMES)
+		return outer;
+
+	frame = &td->frames[td->nr_frames++];
+	frame->sp = td->entry_sp;
+	frame->arg0 = rec->val;
+	frame->arg1 = rec->arg;
+	frame->type = rec->type;
+	frame->tag = rec->size;
+
+	return outer;
 }
 
-/* ===================================================================== */
+/* Pop the frame returning with sp; returns it only if it is the outermost */
+static struct AllocFrame *PopFrame(struct ThreadData *td, ADDRINT sp)
+{
+	while (td->nr_frames && td->frames[td->nr_frames - 1].sp < sp)
+		td->nr_frames--;
+
+	if (!td->nr_frames || td->frames[td->nr_frames - 1].sp != sp)
+		return NULL;
 
-VOID MallocAfter(ADDRINT ret)
+	td->nr_frames--;
+	return td->nr_frames ? NULL : &td->frames[0];
+}
+
+/* Pair an allocator function with its return value */
+static char *EmitAlloc(char *out, struct AllocFrame *frame, ADDRINT ret)
 {
+	ADDRINT addr = TagAddr(ret, frame->tag);
+
+	switch (frame->type) {
+		case REC_MALLOC_ARGS:
 #if DEBUG
-	DebugTraceFile << ret << " = malloc(" << malloc_size << ")" << endl;
+			DebugTraceFile << ret << " = malloc(" << frame->arg0 << ") tag "
+				<< frame->tag << endl;
 #endif
-	ret = SignMalloc(ret);
-	TraceFile.write((char *)&ret, sizeof(ADDRINT));
-	TraceFile.write((char *)&malloc_size, sizeof(ADDRINT));
+			out = EmitRaw(out);
+			out = EmitWord(out, SignMalloc(addr));
+			out = EmitWord(out, frame->arg0);
+			break;
+
+		case REC_CALLOC_ARGS:
+#if DEBUG
+			DebugTraceFile << ret << " = calloc(" << frame->arg0 << ", "
+				<< frame->arg1 << ") tag " << frame->tag << endl;
+#endif
+			out = EmitRaw(out);
+			out = EmitWord(out, SignCalloc(addr));
+			out = EmitWord(out, frame->arg0);
+			out = EmitWord(out, frame->arg1);
+			break;
+
+		case REC_REALLOC_ARGS:
+#if DEBUG
+			DebugTraceFile << ret << " = realloc(" << frame->arg0 << ", "
+				<< frame->arg1 << ") tag " << frame->tag << endl;
+#endif
+			out = EmitRaw(out);
+			out = EmitWord(out, SignRealloc(addr));
+			out = EmitWord(out, frame->arg0);
+			out = EmitWord(out, frame->arg1);
+			break;
+
+		default:
+			/* free() is recorded at the entry */
+			return out;
+	}
+
+	if (frame->type == REC_REALLOC_ARGS)
+		Live.erase(frame->arg0);
+	if (ret) {
+		struct LiveObject &obj = Live[ret];
+
+		obj.size = frame->type == REC_CALLOC_ARGS ?
+			frame->arg0 * frame->arg1 : frame->type == REC_REALLOC_ARGS ?
+			frame->arg1 : frame->arg0;
+		obj.tag = frame->tag;
+	}
+
+	return out;
 }
 
-/* ===================================================================== */
+/* Drop the areas starting in [addr, addr + len); returns true if any */
+static BOOL UnmapAreas(ADDRINT addr, ADDRINT len)
+{
+	std::map<ADDRINT, ADDRINT>::iterator it = LiveMaps.lower_bound(addr);
+	BOOL found = FALSE;
+
+	while (it != LiveMaps.end() && it->first < addr + len) {
+		LiveMaps.erase(it++);
+		found = TRUE;
+	}
+
+	return found;
+}
 
-VOID CallocBefore(ADDRINT nmemb, ADDRINT size)
+/* Follow the areas mapped by the program itself for the snapshots */
+static VOID TrackAreas(ADDRINT op, ADDRINT addr, ADDRINT len, ADDRINT aux1)
 {
-	calloc_nmemb = nmemb;
-	calloc_size = size;
+	BOOL in_alloc = op & MMAP_IN_ALLOC;
+
+	switch (op & ~MMAP_IN_ALLOC) {
+		case MMAP_OP_MMAP:
+			if (!in_alloc && !(aux1 & MAP_FIXED) && (aux1 & MAP_ANONYMOUS))
+				LiveMaps[addr] = len;
+			break;
+
+		case MMAP_OP_MUNMAP:
+			UnmapAreas(addr, len);
+			break;
+
+		case MMAP_OP_MREMAP:
+			if (UnmapAreas(aux1, 1))
+				LiveMaps[addr] = len;
+			break;
+
+		case MMAP_OP_BRK:
+			if (BrkEnd && addr > BrkEnd && !in_alloc)
+				LiveMaps[BrkEnd] = addr - BrkEnd;
+			BrkEnd = addr;
+			break;
+	}
 }
 
-/* ===================================================================== */
+/* Pair a system call with its result; only the memory mappings are kept */
+static char *EmitSyscall(struct ThreadData *td, char *out, ADDRINT ret)
+{
+	ADDRINT *args = td->sys_args;
+	ADDRINT addr, op, len, aux1 = 0, aux2 = 0;
+
+	/* failed */
+	if (ret >= (ADDRINT)-4095)
+		return out;
+
+	switch (td->sys_nr) {
+		case SYS_mmap:
+			addr = ret;
+			op = MMAP_OP_MMAP;
+			len = args[1];
+			aux1 = args[3];				/* flags */
+			aux2 = args[2];				/* prot */
+			break;
+
+		case SYS_munmap:
+			addr = args[0];
+			op = MMAP_OP_MUNMAP;
+			len = args[1];
+			break;
+
+		case SYS_mremap:
+			addr = ret;
+			op = MMAP_OP_MREMAP;
+			len = args[2];
+			aux1 = args[0];				/* old address */
+			aux2 = args[1];				/* old length */
+			break;
+
+		case SYS_brk:
+			addr = ret;
+			op = MMAP_OP_BRK;
+			len = 0;
+			aux1 = args[0];				/* requested */
+			break;
+
+		case SYS_madvise:
+			addr = args[0];
+			op = MMAP_OP_MADVISE;
+			len = args[1];
+			aux1 = args[2];				/* advice */
+			break;
+
+		default:
+			return out;
+	}
+
+	/* frames above the stack pointer of the call are live */
+	if (td->nr_frames && td->frames[0].sp > td->sys_sp)
+		op |= MMAP_IN_ALLOC;
+	TrackAreas(op, addr, len, aux1);
+
+#if DEBUG
+	DebugTraceFile << "syscall " << td->sys_nr << ": " << addr << " " << op
+		<< " " << len << " " << aux1 << " " << aux2 << endl;
+#endif
+	out = EmitRaw(out);
+	out = EmitWord(out, SignMmap(addr));
+	out = EmitWord(out, op);
+	out = EmitWord(out, len);
+	out = EmitWord(out, aux1);
+	out = EmitWord(out, aux2);
+
+	return out;
+}
 
-VOID CallocAfter(ADDRINT ret)
+/* Encode a filled buffer into the trace format */
+static size_t EncodeBuffer(struct ThreadData *td, struct TraceRecord *rec,
+		UINT64 nr)
 {
+	struct AllocFrame *frame;
+	char *out = td->out;
+	UINT64 i;
+
+	memset(td->pred, 0, sizeof(td->pred));
+	td->pred_victim = 0;
+	td->nr_refs = 0;
+
+	for (i = 0; i < nr; i++, rec++) {
+		switch (rec->type) {
+			case REC_REF:
+				if (FilterLines && FilterRef(td, rec->val, rec->size, &out))
+					break;
+				if (Compress & CHUNK_DELTA)
+					out = EmitDeltaRef(td, out, rec->val, rec->size);
+				else
+					out = EmitRef(out, rec->val, rec->size);
+				td->nr_refs++;
+				break;
+
+			case REC_ALLOC_SP:
+				td->entry_sp = rec->val;
+				break;
+
+			case REC_MALLOC_ARGS:
+			case REC_CALLOC_ARGS:
+			case REC_REALLOC_ARGS:
+				PushFrame(td, rec);
+				break;
+
+			case REC_FREE:
+				if (!PushFrame(td, rec))
+					break;
+#if DEBUG
+				DebugTraceFile << "free(" << rec->val << ") tag " << rec->size
+					<< endl;
+#endif
+				out = EmitRaw(out);
+				out = EmitWord(out, SignFree(TagAddr(rec->val, rec->size)));
+				Live.erase(rec->val);
+				break;
+
+			case REC_ALLOC_RET:
+				frame = PopFrame(td, rec->arg);
+				if (frame)
+					out = EmitAlloc(out, frame, rec->val);
+				break;
+
+			case REC_PHASE:
+				/* recorded before switching from the phase in arg */
 #if DEBUG
-	DebugTraceFile << ret << " = calloc(" << calloc_nmemb << ", "
-		<< calloc_size << ")" << endl;
+				DebugTraceFile << "phase " << NEXT_PHASE(rec->arg) << " at "
+					<< rec->val << endl;
 #endif
-	ret = SignCalloc(ret);
-	TraceFile.write((char *)&ret, sizeof(ADDRINT));
-	TraceFile.write((char *)&calloc_nmemb, sizeof(ADDRINT));
-	TraceFile.write((char *)&calloc_size, sizeof(ADDRINT));
+				if (FilterLines)
+					out = FilterFlush(td, out);
+				out = EmitRaw(out);
+				out = EmitWord(out, SignPhase(rec->val));
+				out = EmitWord(out, NEXT_PHASE(rec->arg));
+				break;
+
+			case REC_SYSCALL_ARGS0:
+				td->sys_nr = rec->val;
+				td->sys_args[0] = rec->arg;
+				break;
+
+			case REC_SYSCALL_ARGS1:
+				td->sys_args[1] = rec->val;
+				td->sys_args[2] = rec->arg;
+				break;
+
+			case REC_SYSCALL_ARGS2:
+				td->sys_args[3] = rec->val;
+				td->sys_sp = rec->arg;
+				break;
+
+			case REC_SYSCALL_RET:
+				out = EmitSyscall(td, out, rec->val);
+				td->sys_nr = (ADDRINT)-1;
+				break;
+
+			case REC_RANGE_COUNT:
+				td->range_count = rec->val;
+				td->range_flags = rec->arg;
+				break;
+
+			/* not passed through the cache filter */
+			case REC_RANGE:
+				out = EmitRange(out, rec->val, td->range_count,
+						td->range_flags, rec->size);
+				break;
+		}
+	}
+
+	return out - td->out;
 }
 
-/* ===================================================================== */
+static inline UINT64 NowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-VOID ReallocBefore(ADDRINT ptr, ADDRINT size)
+static inline UINT64 NextSeq(void)
 {
-	realloc_ptr = ptr;
-	realloc_size = size;
+	return __sync_fetch_and_add(&GlobalSeq, 1);
 }
 
-/* ===================================================================== */
+static VOID RingWait(void)
+{
+	struct timespec ts = { 0, RING_POLL_NS };
 
-VOID ReallocAfter(ADDRINT ret)
+	nanosleep(&ts, NULL);
+}
+
+static inline BOOL IsPow2(UINT64 val)
 {
-#if DEBUG
-	DebugTraceFile << ret << " = realloc(" << realloc_ptr << ", "
-		<< realloc_size << ")" << endl;
-#endif
-	ret = SignRealloc(ret);
-	TraceFile.write((char *)&ret, sizeof(ADDRINT));
-	TraceFile.write((char *)&realloc_ptr, sizeof(ADDRINT));
-	TraceFile.write((char *)&realloc_size, sizeof(ADDRINT));
+	return val && !(val & (val - 1));
 }
 
-/* ===================================================================== */
+static BOOL RingOpen(const string &name)
+{
+	string path = "/dev/shm/" + (name[0] == '/' ? name.substr(1) : name);
+	UINT64 size = (UINT64)KnobRingMB.Value() << 20;
+	int fd;
+
+	if (!IsPow2(size))
+		return FALSE;
 
-VOID FreeBefore(ADDRINT ptr)
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return FALSE;
+
+	RingMapSize = RING_DATA_OFF + size;
+	if (ftruncate(fd, RingMapSize)) {
+		close(fd);
+		return FALSE;
+	}
+
+	Ring = (struct RingHdr *)mmap(NULL, RingMapSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (Ring == MAP_FAILED) {
+		Ring = NULL;
+		return FALSE;
+	}
+
+	RingData = (char *)Ring + RING_DATA_OFF;
+	Ring->size = size;
+	Ring->producer = getpid();
+	Ring->consumer = 0;
+	Ring->eof = 0;
+	Ring->head = 0;
+	Ring->tail = 0;
+	/* sim maps the ring once it sees the magic */
+	__atomic_store_n(&Ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+	return TRUE;
+}
+
+static VOID RingWrite(const char *buf, size_t len)
 {
+	UINT64 head = Ring->head, tail, off, n;
+	UINT32 polls = 0;
+
+	while (len) {
+		tail = __atomic_load_n(&Ring->tail, __ATOMIC_ACQUIRE);
+		if (head - tail == Ring->size) {
+			/* back-pressure: wait for sim, unless it has gone */
+			if (++polls % RING_CHECK_POLLS == 0 && Ring->consumer &&
+					kill(Ring->consumer, 0) && errno == ESRCH) {
+				cerr << "posetrace: sim exited while reading the ring" << endl;
+				PIN_ExitProcess(1);
+			}
+			if (polls == 1)
+				RingWaits++;
+			RingWait();
+			continue;
+		}
+		polls = 0;
+
+		off = head & (Ring->size - 1);
+		n = Ring->size - (head - tail);
+		if (n > Ring->size - off)
+			n = Ring->size - off;
+		if (n > len)
+			n = len;
+
+		memcpy(RingData + off, buf, n);
+		buf += n;
+		len -= n;
+		head += n;
+		__atomic_store_n(&Ring->head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static VOID RingClose(void)
+{
+	__atomic_store_n(&Ring->eof, 1, __ATOMIC_RELEASE);
+	munmap(Ring, RingMapSize);
+}
+
+/* Called with TraceLock held */
+static inline VOID TraceWrite(const char *buf, size_t len)
+{
+	if (Ring)
+		RingWrite(buf, len);
+	else
+		TraceFile.write(buf, len);
+	TraceOff += len;
+}
+
+static VOID WriteHeader(int argc, char *argv[])
+{
+	struct TraceHeader hdr;
+	string cmd;
+	int i;
+
+	for (i = 0; i < argc && strcmp(argv[i], "--"); i++)
+		cmd += string(i ? " " : "") + argv[i];
+	/* NUL-terminated and padded to 8B */
+	cmd.resize((cmd.size() + sizeof(UINT64)) & ~(sizeof(UINT64) - 1), '\0');
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.size = sizeof(hdr) + cmd.size();
+	hdr.page_size = getpagesize();
+	hdr.addr_bits = TRACE_ADDR_BITS;
+	hdr.flags = Compress;
+	if (FilterLines)
+		hdr.flags |= TRACE_FILTERED;
+	if (Sampling)
+		hdr.flags |= TRACE_SAMPLED;
+	hdr.block_records = BufRecords;
+
+	TraceWrite((const char *)&hdr, sizeof(hdr));
+	TraceWrite(cmd.data(), cmd.size());
+}
+
+/*
+ * Called with TraceLock held. The areas are written as anonymous mmap()s and
+ * the break as a brk() inside the allocator, which only sets it.
+ */
+static VOID WriteSnapshot(void)
+{
+	std::map<ADDRINT, struct LiveObject>::iterator it;
+	std::map<ADDRINT, ADDRINT>::iterator area;
+	size_t len = (Live.size() * 2 + (LiveMaps.size() + 1) * 5) *
+		sizeof(ADDRINT);
+	char *payload = new char[len + 1];
+	char hdr[CHUNK_HDR_SIZE];
+	char *p = payload;
+
+	for (area = LiveMaps.begin(); area != LiveMaps.end(); ++area) {
+		p = EmitWord(p, SignMmap(area->first));
+		p = EmitWord(p, MMAP_OP_MMAP);
+		p = EmitWord(p, area->second);
+		p = EmitWord(p, MAP_ANONYMOUS);
+		p = EmitWord(p, 0);
+	}
+	if (BrkEnd) {
+		p = EmitWord(p, SignMmap(BrkEnd));
+		p = EmitWord(p, MMAP_OP_BRK | MMAP_IN_ALLOC);
+		p = EmitWord(p, 0);
+		p = EmitWord(p, BrkEnd);
+		p = EmitWord(p, 0);
+	}
+	for (it = Live.begin(); it != Live.end(); ++it) {
+		p = EmitWord(p, SignMalloc(TagAddr(it->first, it->second.tag)));
+		p = EmitWord(p, it->second.size);
+	}
+	len = p - payload;
+
+	p = hdr;
+	p = EmitWord(p, SignChunk(CHUNK_SNAPSHOT << CHUNK_FLAGS_SHIFT));
+	p = EmitWord(p, NextSeq());
+	p = EmitWord(p, len);
+
+	SnapshotOff = TraceOff;
+	NrUnsnapped = 0;
+	TraceWrite(hdr, CHUNK_HDR_SIZE);
+	TraceWrite(payload, len);
+	delete [] payload;
+}
+
+struct IndexSeqLess {
+	bool operator()(UINT32 a, UINT32 b) const
+	{
+		return Index[a].seq < Index[b].seq;
+	}
+};
+
+/* Called after all the chunks */
+static VOID WriteIndex(void)
+{
+	std::vector<UINT32> order(Index.size());
+	UINT64 ref = 0, nr, off = TraceOff;
+	char hdr[CHUNK_HDR_SIZE];
+	char *p = hdr;
+	UINT32 i;
+
+	/* the refs are counted in order of seq */
+	for (i = 0; i < Index.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), IndexSeqLess());
+	for (i = 0; i < order.size(); i++) {
+		nr = Index[order[i]].ref;
+		Index[order[i]].ref = ref;
+		ref += nr;
+	}
+
+	p = EmitWord(p, SignChunk(CHUNK_INDEX << CHUNK_FLAGS_SHIFT));
+	p = EmitWord(p, Index.size());
+	p = EmitWord(p, Index.size() * sizeof(struct IndexEntry));
+	TraceWrite(hdr, CHUNK_HDR_SIZE);
+	if (!Index.empty())
+		TraceWrite((const char *)&Index[0],
+				Index.size() * sizeof(struct IndexEntry));
+
+	p = hdr;
+	p = EmitWord(p, off);
+	p = EmitWord(p, TRACE_INDEX_MAGIC);
+	TraceWrite(hdr, 2 * sizeof(UINT64));
+}
+
+static VOID WriteChunk(struct ThreadData *td, UINT64 seq, UINT64 flags,
+		const char *payload, size_t len, UINT64 icount)
+{
+	struct IndexEntry ent = { TraceOff, len, seq, td->os_tid, flags,
+		td->nr_refs, icount, SnapshotOff };
+	char hdr[CHUNK_HDR_SIZE];
+	char *p = hdr;
+
+	Index.push_back(ent);
+	NrUnsnapped++;
+
+	p = EmitWord(p, SignChunk((ADDRINT)td->os_tid |
+				(flags << CHUNK_FLAGS_SHIFT)));
+	p = EmitWord(p, seq);
+	p = EmitWord(p, len);
+
+	TraceWrite(hdr, CHUNK_HDR_SIZE);
+	TraceWrite(payload, len);
+}
+
+static VOID WriteBuffer(struct ThreadData *td, VOID *buf, UINT64 nr,
+		UINT64 seq, UINT64 icount, THREADID tid)
+{
+	size_t len;
+
+	PIN_GetLock(&TraceLock, tid + 1);
+	/* before the objects of the buffer are added */
+	if (KnobSnapshotChunks.Value() && NrUnsnapped >= KnobSnapshotChunks.Value())
+		WriteSnapshot();
+
+	len = EncodeBuffer(td, (struct TraceRecord *)buf, nr);
+	if (Compress & CHUNK_LZ) {
+		EmitWord(td->lz, len);
+		len = sizeof(UINT64) +
+			LzCompress(td->out, len, td->lz + sizeof(UINT64));
+		WriteChunk(td, seq, Compress, td->lz, len, icount);
+	} else {
+		WriteChunk(td, seq, Compress, td->out, len, icount);
+	}
+	PIN_ReleaseLock(&TraceLock);
+}
+
+/* Writer thread; owns the trace file while the application runs */
+static VOID Writer(VOID *arg)
+{
+	THREADID tid = PIN_ThreadId();
+	struct FullBuffer fb;
+
+	for (;;) {
+		PIN_MutexLock(&BufMutex);
+		while (FullQueue.empty()) {
+			if (WriterExiting) {
+				WriterExited = TRUE;
+				PIN_MutexUnlock(&BufMutex);
+				return;
+			}
+			PIN_SemaphoreClear(&FullSem);
+			PIN_MutexUnlock(&BufMutex);
+			PIN_SemaphoreWait(&FullSem);
+			PIN_MutexLock(&BufMutex);
+		}
+		fb = FullQueue.front();
+		FullQueue.pop_front();
+		PIN_MutexUnlock(&BufMutex);
+
+		WriteBuffer(fb.td, fb.buf, fb.nr, fb.seq, fb.icount, tid);
+
+		/* return the buffer to the pool of its thread */
+		PIN_MutexLock(&BufMutex);
+		fb.td->free_bufs[fb.td->nr_free++] = fb.buf;
+		PIN_SemaphoreSet(&fb.td->free_sem);
+		PIN_MutexUnlock(&BufMutex);
+	}
+}
+
+static VOID *BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt,
+		VOID *buf, UINT64 nr, VOID *v)
+{
+	struct ThreadData *td =
+		static_cast<struct ThreadData *>(PIN_GetThreadData(ThreadDataKey, tid));
+	struct FullBuffer fb = { td, buf, nr, td->seq, td->icount };
+	UINT64 start;
+
+	/* the next buffer starts here */
+	if (ctxt)
+		td->icount = PIN_GetContextReg(ctxt, IcountReg);
+
+	PIN_MutexLock(&BufMutex);
+	if (WriterExited) {
+		/* process is exiting; write it by ourselves */
+		PIN_MutexUnlock(&BufMutex);
+		WriteBuffer(td, buf, nr, fb.seq, fb.icount, tid);
+		td->seq = NextSeq();
+		return buf;
+	}
+
+	/* buffers of the pool are allocated on the first hand-off */
+	while (td->nr_bufs < KnobNrBufs.Value()) {
+		td->free_bufs[td->nr_free++] = PIN_AllocateBuffer(BufId);
+		td->nr_bufs++;
+	}
+
+	FullQueue.push_back(fb);
+	PIN_SemaphoreSet(&FullSem);
+	td->nr_handoff++;
+
+	if (!td->nr_free) {
+		start = NowNs();
+		while (!td->nr_free) {
+			PIN_SemaphoreClear(&td->free_sem);
+			PIN_MutexUnlock(&BufMutex);
+			PIN_SemaphoreWait(&td->free_sem);
+			PIN_MutexLock(&BufMutex);
+		}
+		td->nr_stall++;
+		td->stall_ns += NowNs() - start;
+	}
+	td->cur_buf = td->free_bufs[--td->nr_free];
+	PIN_MutexUnlock(&BufMutex);
+
+	td->seq = NextSeq();
+
+	return td->cur_buf;
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+	struct ThreadData *td = new struct ThreadData;
+
+	td->nr_frames = 0;
+	td->entry_sp = 0;
+	td->sys_nr = (ADDRINT)-1;
+	td->sys_sp = 0;
+	td->os_tid = PIN_GetTid();
+	td->seq = NextSeq();
+	td->out = new char[OutSize];
+	td->lz = (Compress & CHUNK_LZ) ?
+		new char[sizeof(UINT64) + LZ_BOUND(OutSize)] : NULL;
+	td->filter = FilterLines ? new struct FilterLine[FilterLines]() : NULL;
+	td->filter_clock = 0;
+	td->icount = 0;
+
+	td->free_bufs = new VOID *[KnobNrBufs.Value()];
+	td->nr_free = 0;
+	td->nr_bufs = 1;				/* implicit initial buffer */
+	td->cur_buf = NULL;
+	PIN_SemaphoreInit(&td->free_sem);
+
+	td->nr_handoff = 0;
+	td->nr_stall = 0;
+	td->stall_ns = 0;
+
+	/* the first phase begins at the first basic block */
+	PIN_SetContextReg(ctxt, IcountReg, 0);
+	PIN_SetContextReg(ctxt, PhaseReg, PHASE_FF);
+	PIN_SetContextReg(ctxt, PhaseEndReg, 0);
+
+	PIN_SetThreadData(ThreadDataKey, td, tid);
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+	struct ThreadData *td =
+		static_cast<struct ThreadData *>(PIN_GetThreadData(ThreadDataKey, tid));
+	char *out;
+	UINT64 icount = PIN_GetContextReg(ctxt, IcountReg);
+	UINT32 i;
+
+	/* wait for the writer to consume all the handed-off buffers */
+	PIN_MutexLock(&BufMutex);
+	while (td->nr_free + 1 < td->nr_bufs) {
+		PIN_SemaphoreClear(&td->free_sem);
+		PIN_MutexUnlock(&BufMutex);
+		PIN_SemaphoreWait(&td->free_sem);
+		PIN_MutexLock(&BufMutex);
+	}
+	TotalHandoff += td->nr_handoff;
+	TotalStall += td->nr_stall;
+	TotalStallNs += td->stall_ns;
+	PIN_MutexUnlock(&BufMutex);
+
+	/* the last chunk of the thread carries the filter hits and its icount */
 #if DEBUG
-	DebugTraceFile << "free(" << ptr << ")" << endl;
+	DebugTraceFile << "icount: " << icount << endl;
 #endif
-	ptr = SignFree(ptr);
-	TraceFile.write((char *)&ptr, sizeof(ADDRINT));
+	PIN_GetLock(&TraceLock, tid + 1);
+	out = td->out;
+	if (FilterLines)
+		out = FilterFlush(td, out);
+	out = EmitRaw(out);
+	out = EmitWord(out, SignIcount(icount));
+	td->nr_refs = 0;
+	WriteChunk(td, NextSeq(), Compress & CHUNK_DELTA, td->out, out - td->out,
+			icount);
+	PIN_ReleaseLock(&TraceLock);
+
+	for (i = 0; i < td->nr_free; i++)
+		PIN_DeallocateBuffer(BufId, td->free_bufs[i]);
+	if (td->cur_buf)
+		PIN_DeallocateBuffer(BufId, td->cur_buf);
+
+	PIN_SemaphoreFini(&td->free_sem);
+	delete [] td->free_bufs;
+	delete [] td->filter;
+	delete [] td->lz;
+	delete [] td->out;
+	delete td;
+	PIN_SetThreadData(ThreadDataKey, 0, tid);
 }
 
 /* ===================================================================== */
 
-VOID Image(IMG img, VOID *v)
+static ADDRINT PIN_FAST_ANALYSIS_CALL InSample(ADDRINT phase)
 {
-	RTN mallocRtn = RTN_FindByName(img, MALLOC);
-	RTN callocRtn = RTN_FindByName(img, CALLOC);
-	RTN reallocRtn = RTN_FindByName(img, REALLOC);
-	RTN freeRtn = RTN_FindByName(img, FREE);
+	return phase != PHASE_FF;
+}
 
-	if (RTN_Valid(mallocRtn))
-	{
-		RTN_Open(mallocRtn);
-		RTN_InsertCall(mallocRtn, IPOINT_BEFORE, (AFUNPTR)MallocBefore,
-				IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
-		RTN_InsertCall(mallocRtn, IPOINT_AFTER, (AFUNPTR)MallocAfter,
-				IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
-		RTN_Close(mallocRtn);
+static VOID InsertRefRecord(INS ins, IARG_TYPE ea, IARG_TYPE size)
+{
+	if (!Sampling) {
+		INS_InsertFillBufferPredicated(
+				ins, IPOINT_BEFORE, BufId,
+				ea, offsetof(struct TraceRecord, val),
+				size, offsetof(struct TraceRecord, size),
+				IARG_UINT32, REC_REF, offsetof(struct TraceRecord, type),
+				IARG_END);
+		return;
 	}
 
-	if (RTN_Valid(callocRtn))
-	{
-		RTN_Open(callocRtn);
-		RTN_InsertCall(callocRtn, IPOINT_BEFORE, (AFUNPTR)CallocBefore,
-				IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
-				IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
-		RTN_InsertCall(callocRtn, IPOINT_AFTER, (AFUNPTR)CallocAfter,
-				IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
-		RTN_Close(callocRtn);
+	/* skipped while fast-forwarding */
+	INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)InSample,
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, PhaseReg, IARG_END);
+	INS_InsertFillBufferThen(
+			ins, IPOINT_BEFORE, BufId,
+			ea, offsetof(struct TraceRecord, val),
+			size, offsetof(struct TraceRecord, size),
+			IARG_UINT32, REC_REF, offsetof(struct TraceRecord, type),
+			IARG_END);
+}
+
+/*
+ * Record the arguments and the result of a system call; the mappings are
+ * picked up when the buffer is encoded. The instruction is instrumented
+ * rather than using PIN_AddSyscallEntryFunction(), so that the record is
+ * ordered with the references of the thread in its buffer.
+ */
+static VOID InsertSyscallRecord(INS ins)
+{
+	if (!INS_IsValidForIpointAfter(ins))
+		return;
+
+	INS_InsertFillBuffer(ins, IPOINT_BEFORE, BufId,
+			IARG_SYSCALL_NUMBER, offsetof(struct TraceRecord, val),
+			IARG_SYSARG_VALUE, 0, offsetof(struct TraceRecord, arg),
+			IARG_UINT32, REC_SYSCALL_ARGS0, offsetof(struct TraceRecord, type),
+			IARG_END);
+	INS_InsertFillBuffer(ins, IPOINT_BEFORE, BufId,
+			IARG_SYSARG_VALUE, 1, offsetof(struct TraceRecord, val),
+			IARG_SYSARG_VALUE, 2, offsetof(struct TraceRecord, arg),
+			IARG_UINT32, REC_SYSCALL_ARGS1, offsetof(struct TraceRecord, type),
+			IARG_END);
+	INS_InsertFillBuffer(ins, IPOINT_BEFORE, BufId,
+			IARG_SYSARG_VALUE, 3, offsetof(struct TraceRecord, val),
+			IARG_REG_VALUE, REG_STACK_PTR, offsetof(struct TraceRecord, arg),
+			IARG_UINT32, REC_SYSCALL_ARGS2, offsetof(struct TraceRecord, type),
+			IARG_END);
+	INS_InsertFillBuffer(ins, IPOINT_AFTER, BufId,
+			IARG_SYSRET_VALUE, offsetof(struct TraceRecord, val),
+			IARG_UINT32, REC_SYSCALL_RET, offsetof(struct TraceRecord, type),
+			IARG_END);
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL FirstRep(BOOL first)
+{
+	return first;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL FirstRepInSample(BOOL first, ADDRINT phase)
+{
+	return first && phase != PHASE_FF;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL HasRange(ADDRINT len)
+{
+	return len != 0;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL HasRangeInSample(ADDRINT len, ADDRINT phase)
+{
+	return len && phase != PHASE_FF;
+}
+
+/* Start of the elements of a gather or scatter accessed (mask on) */
+static ADDRINT PIN_FAST_ANALYSIS_CALL MultiStart(PIN_MULTI_MEM_ACCESS_INFO *info)
+{
+	ADDRINT start = (ADDRINT)-1;
+	UINT32 i;
+
+	for (i = 0; i < info->numberOfMemops; i++) {
+		if (info->memop[i].maskOn && info->memop[i].memoryAddress < start)
+			start = info->memop[i].memoryAddress;
 	}
 
-	if (RTN_Valid(reallocRtn))
-	{
-		RTN_Open(reallocRtn);
-		RTN_InsertCall(reallocRtn, IPOINT_BEFORE, (AFUNPTR)ReallocBefore,
-				IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
-				IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_END);
-		RTN_InsertCall(reallocRtn, IPOINT_AFTER, (AFUNPTR)ReallocAfter,
-				IARG_FUNCRET_EXITPOINT_VALUE, IARG_END);
-		RTN_Close(reallocRtn);
+	return start;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL MultiLen(PIN_MULTI_MEM_ACCESS_INFO *info,
+		ADDRINT start)
+{
+	ADDRINT end = 0, cur;
+	UINT32 i;
+
+	for (i = 0; i < info->numberOfMemops; i++) {
+		cur = info->memop[i].memoryAddress + info->memop[i].bytesAccessed;
+		if (info->memop[i].maskOn && cur > end)
+			end = cur;
 	}
 
-	if (RTN_Valid(freeRtn))
-	{
-		RTN_Open(freeRtn);
-		RTN_InsertCall(freeRtn, IPOINT_BEFORE, (AFUNPTR)FreeBefore,
-				IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+	return end > start ? end - start : 0;
+}
+
+static VOID InsertIfFirstRep(INS ins)
+{
+	if (Sampling)
+		INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)FirstRepInSample,
+				IARG_FAST_ANALYSIS_CALL, IARG_FIRST_REP_ITERATION,
+				IARG_REG_VALUE, PhaseReg, IARG_END);
+	else
+		INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)FirstRep,
+				IARG_FAST_ANALYSIS_CALL, IARG_FIRST_REP_ITERATION, IARG_END);
+}
+
+/*
+ * A memory operand of a REP string instruction is recorded as a range at the
+ * first iteration, from the count register, instead of a reference at each
+ * iteration. REPE/REPNE CMPS and SCAS stop early, so they keep the latter.
+ */
+static BOOL IsRangeRep(INS ins)
+{
+	std::string mnemonic = INS_Mnemonic(ins);
+
+	return INS_HasRealRep(ins) &&
+		mnemonic.find("CMPS") == std::string::npos &&
+		mnemonic.find("SCAS") == std::string::npos;
+}
+
+static VOID InsertRepRange(INS ins, UINT32 memop)
+{
+	UINT32 size = INS_MemoryOperandSize(ins, memop);
+
+	if (INS_MemoryOperandIsWritten(ins, memop))
+		size |= REC_RANGE_WRITE;
+
+	InsertIfFirstRep(ins);
+	INS_InsertFillBufferThen(ins, IPOINT_BEFORE, BufId,
+			IARG_REG_VALUE, INS_RepCountRegister(ins), offsetof(struct TraceRecord, val),
+			IARG_REG_VALUE, REG_GFLAGS, offsetof(struct TraceRecord, arg),
+			IARG_UINT32, REC_RANGE_COUNT, offsetof(struct TraceRecord, type),
+			IARG_END);
+	InsertIfFirstRep(ins);
+	INS_InsertFillBufferThen(ins, IPOINT_BEFORE, BufId,
+			IARG_MEMORYOP_EA, memop, offsetof(struct TraceRecord, val),
+			IARG_UINT32, size, offsetof(struct TraceRecord, size),
+			IARG_UINT32, REC_RANGE, offsetof(struct TraceRecord, type),
+			IARG_END);
+}
+
+static VOID InsertIfHasRange(INS ins)
+{
+	if (Sampling)
+		INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)HasRangeInSample,
+				IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, RangeLenReg,
+				IARG_REG_VALUE, PhaseReg, IARG_END);
+	else
+		INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)HasRange,
+				IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, RangeLenReg, IARG_END);
+}
+
+/*
+ * A gather or scatter is recorded as the range spanning the elements it
+ * accesses, since a buffer record cannot be filled per element
+ */
+static VOID InsertMultiRange(INS ins)
+{
+	UINT32 size = 1 | (INS_IsVscatter(ins) ? REC_RANGE_WRITE : 0);
+
+	INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)MultiStart,
+			IARG_FAST_ANALYSIS_CALL, IARG_MULTI_MEMORYACCESS_EA,
+			IARG_RETURN_REGS, RangeReg, IARG_END);
+	INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)MultiLen,
+			IARG_FAST_ANALYSIS_CALL, IARG_MULTI_MEMORYACCESS_EA,
+			IARG_REG_VALUE, RangeReg, IARG_RETURN_REGS, RangeLenReg, IARG_END);
+
+	InsertIfHasRange(ins);
+	INS_InsertFillBufferThen(ins, IPOINT_BEFORE, BufId,
+			IARG_REG_VALUE, RangeLenReg, offsetof(struct TraceRecord, val),
+			IARG_ADDRINT, (ADDRINT)0, offsetof(struct TraceRecord, arg),
+			IARG_UINT32, REC_RANGE_COUNT, offsetof(struct TraceRecord, type),
+			IARG_END);
+	InsertIfHasRange(ins);
+	INS_InsertFillBufferThen(ins, IPOINT_BEFORE, BufId,
+			IARG_REG_VALUE, RangeReg, offsetof(struct TraceRecord, val),
+			IARG_UINT32, size, offsetof(struct TraceRecord, size),
+			IARG_UINT32, REC_RANGE, offsetof(struct TraceRecord, type),
+			IARG_END);
+}
+
+VOID Instruction(INS ins, VOID *v)
+{
+	UINT32 memop;
+
+	/* mappings are recorded all the time, as the allocator functions */
+	if (INS_IsSyscall(ins))
+		InsertSyscallRecord(ins);
+
+	if (!InRegion)
+		return;
+
+	if (IsRangeRep(ins)) {
+		for (memop = 0; memop < INS_MemoryOperandCount(ins); memop++)
+			InsertRepRange(ins, memop);
+		return;
+	}
+
+	if (INS_IsVgather(ins) || INS_IsVscatter(ins)) {
+		InsertMultiRange(ins);
+		return;
+	}
+
+	// instruments loads using a predicated call, i.e.
+	// the record is filled iff the load will be actually executed
+
+	if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins))
+		InsertRefRecord(ins, IARG_MEMORYREAD_EA, IARG_MEMORYREAD_SIZE);
+
+	if (INS_HasMemoryRead2(ins) && INS_IsStandardMemop(ins))
+		InsertRefRecord(ins, IARG_MEMORYREAD2_EA, IARG_MEMORYREAD_SIZE);
+
+	// instruments stores using a predicated call, i.e.
+	// the record is filled iff the store will be actually executed;
+	// it is filled after the reads of the same instruction
+	if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins))
+		InsertRefRecord(ins, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE);
+}
+
+/* ===================================================================== */
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL SaveMemptr(ADDRINT memptr)
+{
+	return memptr;
+}
+
+/* The object stored by a memalign_out function, or 0 if it failed */
+static ADDRINT PIN_FAST_ANALYSIS_CALL LoadMemptr(ADDRINT memptr, ADDRINT err)
+{
+	ADDRINT obj = 0;
+
+	if (!err)
+		PIN_SafeCopy(&obj, (VOID *)memptr, sizeof(ADDRINT));
+	return obj;
+}
+
+static const UINT32 RoleRecords[NR_ROLES] = {
+	REC_MALLOC_ARGS, REC_CALLOC_ARGS, REC_REALLOC_ARGS, REC_FREE,
+	REC_MALLOC_ARGS,
+};
+
+/* Record the arguments at the entry of an allocator function */
+static VOID InsertArgsRecord(RTN rtn, const struct AllocSym *sym)
+{
+	INS ins = RTN_InsHead(rtn);
+	UINT32 arg0 = sym->arg0, arg1 = sym->arg1;
+
+	if (sym->role == ROLE_MEMALIGN_OUT) {
+		INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)SaveMemptr,
+				IARG_FAST_ANALYSIS_CALL, IARG_FUNCARG_ENTRYPOINT_VALUE, arg0,
+				IARG_RETURN_REGS, MemptrReg, IARG_END);
+		arg0 = arg1;
+	}
+
+	INS_InsertFillBuffer(ins, IPOINT_BEFORE, BufId,
+			IARG_REG_VALUE, REG_STACK_PTR, offsetof(struct TraceRecord, val),
+			IARG_UINT32, REC_ALLOC_SP, offsetof(struct TraceRecord, type),
+			IARG_END);
+	INS_InsertFillBuffer(ins, IPOINT_BEFORE, BufId,
+			IARG_FUNCARG_ENTRYPOINT_VALUE, arg0, offsetof(struct TraceRecord, val),
+			IARG_FUNCARG_ENTRYPOINT_VALUE, arg1, offsetof(struct TraceRecord, arg),
+			IARG_UINT32, sym->tag, offsetof(struct TraceRecord, size),
+			IARG_UINT32, RoleRecords[sym->role], offsetof(struct TraceRecord, type),
+			IARG_END);
+}
+
+/* Record the return value at every exit of an allocator function */
+static VOID InsertRetRecord(RTN rtn, const struct AllocSym *sym)
+{
+	INS ins;
+
+	for (ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins)) {
+		if (!INS_IsRet(ins))
+			continue;
+
+		if (sym->role != ROLE_MEMALIGN_OUT) {
+			INS_InsertFillBuffer(ins, IPOINT_BEFORE, BufId,
+					IARG_FUNCRET_EXITPOINT_VALUE, offsetof(struct TraceRecord, val),
+					IARG_REG_VALUE, REG_STACK_PTR, offsetof(struct TraceRecord, arg),
+					IARG_UINT32, REC_ALLOC_RET, offsetof(struct TraceRecord, type),
+					IARG_END);
+			continue;
+		}
+
+		INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)LoadMemptr,
+				IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, MemptrReg,
+				IARG_FUNCRET_EXITPOINT_VALUE,
+				IARG_RETURN_REGS, MemptrReg, IARG_END);
+		INS_InsertFillBuffer(ins, IPOINT_BEFORE, BufId,
+				IARG_REG_VALUE, MemptrReg, offsetof(struct TraceRecord, val),
+				IARG_REG_VALUE, REG_STACK_PTR, offsetof(struct TraceRecord, arg),
+				IARG_UINT32, REC_ALLOC_RET, offsetof(struct TraceRecord, type),
 				IARG_END);
-		RTN_Close(freeRtn);
 	}
 }
 
-UINT64 icount = 0;
+VOID Image(IMG img, VOID *v)
+{
+	std::set<ADDRINT> done;
+	std::vector<struct AllocSym>::const_iterator sym;
+	RTN rtn;
+
+	for (sym = AllocSyms.begin(); sym != AllocSyms.end(); ++sym) {
+		rtn = RTN_FindByName(img, (SYM_PREFIX + sym->name).c_str());
+		if (!RTN_Valid(rtn))
+			continue;
+
+		/* aliases of a function are recorded once, by the first name */
+		if (!done.insert(RTN_Address(rtn)).second)
+			continue;
+
+		RTN_Open(rtn);
+		InsertArgsRecord(rtn, &*sym);
+		InsertRetRecord(rtn, &*sym);
+		RTN_Close(rtn);
+	}
+}
+
+/* ===================================================================== */
+
+static VOID AddAllocSyms(const struct AllocProfileSym *syms)
+{
+	struct AllocSym sym;
+
+	for (; syms->name; syms++) {
+		sym.name = syms->name;
+		sym.role = syms->role;
+		sym.arg0 = syms->arg0;
+		sym.arg1 = syms->arg1;
+		sym.tag = syms->tag;
+		AllocSyms.push_back(sym);
+	}
+}
+
+/* Parse <symbol>=<role>(<arg>[,<arg>]) of -alloc_sym */
+static BOOL ParseAllocSym(const string &spec)
+{
+	struct AllocSym sym;
+	size_t eq = spec.find('='), lp = spec.find('(', eq), rp = spec.find(')', lp);
+	string role;
+	UINT32 i;
+	int n;
+
+	if (eq == string::npos || !eq || lp == string::npos ||
+			rp == string::npos || rp != spec.size() - 1)
+		return FALSE;
+
+	sym.name = spec.substr(0, eq);
+	role = spec.substr(eq + 1, lp - eq - 1);
+	for (i = 0; i < NR_ROLES; i++) {
+		if (role == RoleNames[i])
+			break;
+	}
+	if (i == NR_ROLES)
+		return FALSE;
+
+	sym.role = i;
+	sym.arg0 = sym.arg1 = 0;
+	sym.tag = ALLOC_TAG_CUSTOM;
+
+	n = sscanf(spec.c_str() + lp, "(%u,%u)", &sym.arg0, &sym.arg1);
+	if (n != ((i == ROLE_MALLOC || i == ROLE_FREE) ? 1 : 2))
+		return FALSE;
+
+	AllocSyms.push_back(sym);
+	return TRUE;
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL docount(ADDRINT icount, UINT32 c)
+{
+	return icount + c;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL PhaseEnds(ADDRINT icount, ADDRINT end)
+{
+	return icount >= end;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL NextPhase(ADDRINT end,
+		PIN_REGISTER *phase)
+{
+	phase->qword[0] = NEXT_PHASE(phase->qword[0]);
+	return end + PhaseLength[phase->qword[0]];
+}
+
+/* The instructions counted outside the region passed a whole phase */
+static ADDRINT PIN_FAST_ANALYSIS_CALL PhasesPassed(ADDRINT icount,
+		ADDRINT end, ADDRINT phase)
+{
+	return icount >= end + PhaseLength[NEXT_PHASE(phase)];
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL SkipPhases(ADDRINT icount, ADDRINT end,
+		PIN_REGISTER *phase)
+{
+	while (icount >= end + PhaseLength[NEXT_PHASE(phase->qword[0])]) {
+		phase->qword[0] = NEXT_PHASE(phase->qword[0]);
+		end += PhaseLength[phase->qword[0]];
+	}
+	return end;
+}
 
-VOID PIN_FAST_ANALYSIS_CALL docount(INT32 c)
+/*
+ * Record the phase boundary and switch to the next phase. The phases passed
+ * outside the region are skipped first without records, so that the region
+ * starts with a single boundary.
+ */
+static VOID InsertPhaseCheck(BBL bbl)
 {
-	icount += c;
+	INS ins = BBL_InsHead(bbl);
+
+	INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)PhasesPassed,
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, IcountReg,
+			IARG_REG_VALUE, PhaseEndReg, IARG_REG_VALUE, PhaseReg, IARG_END);
+	INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)SkipPhases,
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, IcountReg,
+			IARG_REG_VALUE, PhaseEndReg, IARG_REG_REFERENCE, PhaseReg,
+			IARG_RETURN_REGS, PhaseEndReg, IARG_END);
+
+	INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)PhaseEnds,
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, IcountReg,
+			IARG_REG_VALUE, PhaseEndReg, IARG_END);
+	INS_InsertFillBufferThen(ins, IPOINT_BEFORE, BufId,
+			IARG_REG_VALUE, IcountReg, offsetof(struct TraceRecord, val),
+			IARG_REG_VALUE, PhaseReg, offsetof(struct TraceRecord, arg),
+			IARG_UINT32, REC_PHASE, offsetof(struct TraceRecord, type),
+			IARG_END);
+
+	INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)PhaseEnds,
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, IcountReg,
+			IARG_REG_VALUE, PhaseEndReg, IARG_END);
+	INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)NextPhase,
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, PhaseEndReg,
+			IARG_REG_REFERENCE, PhaseReg,
+			IARG_RETURN_REGS, PhaseEndReg, IARG_END);
 }
 
 VOID Trace(TRACE trace, void *v) {
-	for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+	for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+		if (Sampling && InRegion)
+			InsertPhaseCheck(bbl);
+
 		BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)docount,
-				IARG_FAST_ANALYSIS_CALL, IARG_UINT32, BBL_NumIns(bbl),
-				IARG_END);
+				IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, IcountReg,
+				IARG_UINT32, BBL_NumIns(bbl),
+				IARG_RETURN_REGS, IcountReg, IARG_END);
+	}
 }
 
-VOID RecordIcount(void)
+/* ===================================================================== */
+
+/*
+ * Called from the analysis code when the region starts or stops. The code
+ * cache is flushed so that the code is re-instrumented for the new state.
+ */
+static VOID ControlHandler(EVENT_TYPE ev, VOID *v, CONTEXT *ctxt, VOID *ip,
+		THREADID tid, BOOL bcast)
 {
-	UINT64 count;
+	BOOL in_region;
 
-#if DEBUG
-	DebugTraceFile << "icount: " << icount << endl;
-#endif
-	count = SignIcount(icount);
-	TraceFile.write((char *)&count, sizeof(UINT64));
+	switch (ev) {
+		case EVENT_START:
+			in_region = TRUE;
+			break;
+
+		case EVENT_STOP:
+			in_region = FALSE;
+			break;
+
+		default:
+			return;
+	}
+
+	if (in_region == InRegion)
+		return;
+
+	InRegion = in_region;
+	PIN_RemoveInstrumentation();
 }
 
 /* ===================================================================== */
 
+/* Internal threads must be terminated before Fini() */
+VOID PrepareForFini(VOID *v)
+{
+	PIN_MutexLock(&BufMutex);
+	WriterExiting = TRUE;
+	PIN_SemaphoreSet(&FullSem);
+	PIN_MutexUnlock(&BufMutex);
+
+	PIN_WaitForThreadTermination(WriterUid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
 VOID Fini(INT32 code, VOID *v)
 {
-	RecordIcount();
-	TraceFile.close();
+	/* Chunks of all threads are written before Fini() */
+	cerr << "posetrace: " << TotalStall << " of " << TotalHandoff
+		<< " buffer hand-offs stalled on the writer for "
+		<< TotalStallNs / 1000000 << " ms" << endl;
+
+	WriteIndex();
+	if (Ring) {
+		cerr << "posetrace: " << RingWaits
+			<< " writes waited for sim on the full ring" << endl;
+		RingClose();
+	} else {
+		TraceFile.close();
+	}
 #if DEBUG
 	DebugTraceFile.close();
 #endif
@@ -359,25 +2199,127 @@ int main(int argc, char *argv[])
 		return Usage();
 	}
 
-	TraceFile.open(KnobOutputFile.Value().c_str(), ios::out | ios::binary);
+	if (KnobCompress.Value() == "none")
+		Compress = 0;
+	else if (KnobCompress.Value() == "delta")
+		Compress = CHUNK_DELTA;
+	else if (KnobCompress.Value() == "lz")
+		Compress = CHUNK_DELTA | CHUNK_LZ;
+	else
+		return Usage();
+
+	/* the symbols of -alloc_sym take precedence over the profile */
+	for (UINT32 i = 0; i < KnobAllocSym.NumberOfValues(); i++) {
+		if (KnobAllocSym.Value(i).empty())
+			continue;
+		if (!ParseAllocSym(KnobAllocSym.Value(i))) {
+			cerr << "Error: invalid -alloc_sym " << KnobAllocSym.Value(i) << endl;
+			return Usage();
+		}
+	}
+
+	if (KnobAllocProfile.Value() == "glibc") {
+		AddAllocSyms(GlibcSyms);
+	} else if (KnobAllocProfile.Value() == "jemalloc") {
+		AddAllocSyms(GlibcSyms);
+		AddAllocSyms(JemallocSyms);
+	} else if (KnobAllocProfile.Value() == "tcmalloc") {
+		AddAllocSyms(GlibcSyms);
+		AddAllocSyms(TcmallocSyms);
+	} else if (KnobAllocProfile.Value() != "none") {
+		return Usage();
+	}
+
+	Sampling = KnobSampleFF.Value() > 0;
+	PhaseLength[PHASE_FF] = KnobSampleFF.Value();
+	PhaseLength[PHASE_WARMUP] = KnobSampleWarmup.Value();
+	PhaseLength[PHASE_MEASURE] = KnobSampleLength.Value();
+
+	if (KnobFilterKB.Value()) {
+		FilterWays = KnobFilterWays.Value();
+		if (!FilterWays || !IsPow2(KnobFilterLine.Value()))
+			return Usage();
+		FilterLines = (UINT64)KnobFilterKB.Value() * 1024 / KnobFilterLine.Value();
+		FilterSets = FilterLines / FilterWays;
+		if (!FilterSets || !IsPow2(FilterSets)) {
+			cerr << "Error: the number of sets of the cache filter must be a power of two"
+				<< endl;
+			return Usage();
+		}
+		FilterLines = FilterSets * FilterWays;
+		for (FilterLineShift = 0; (1U << FilterLineShift) < KnobFilterLine.Value();
+				FilterLineShift++)
+			;
+	}
+
+	IcountReg = PIN_ClaimToolRegister();
+	PhaseReg = PIN_ClaimToolRegister();
+	PhaseEndReg = PIN_ClaimToolRegister();
+	MemptrReg = PIN_ClaimToolRegister();
+	RangeReg = PIN_ClaimToolRegister();
+	RangeLenReg = PIN_ClaimToolRegister();
+	if (!REG_valid(IcountReg) || !REG_valid(PhaseReg) || !REG_valid(PhaseEndReg) ||
+			!REG_valid(MemptrReg) || !REG_valid(RangeReg) || !REG_valid(RangeLenReg))
+	{
+		cerr << "Error: could not claim the tool registers" << endl;
+		return 1;
+	}
+
+	if (!KnobRing.Value().empty()) {
+		if (!RingOpen(KnobRing.Value())) {
+			cerr << "Error: could not create the ring " << KnobRing.Value() << endl;
+			return 1;
+		}
+	} else {
+		TraceFile.open(KnobOutputFile.Value().c_str(), ios::out | ios::binary);
+	}
 #if DEBUG
 	DebugTraceFile.open("posetrace_debug.out");
 	DebugTraceFile << hex;
 	DebugTraceFile.setf(ios::showbase);
 #endif
 
+	BufId = PIN_DefineTraceBuffer(sizeof(struct TraceRecord),
+			KnobBufPages.Value(), BufferFull, 0);
+	if (BufId == BUFFER_ID_INVALID)
+	{
+		cerr << "Error: could not allocate the trace buffer" << endl;
+		return 1;
+	}
+	BufRecords = (UINT64)KnobBufPages.Value() * getpagesize() /
+		sizeof(struct TraceRecord);
+	OutSize = BufRecords * MAX_ENTRY_SIZE;
+	if (FilterLines)
+		OutSize += (BufRecords + FilterLines) * HITS_ENTRY_SIZE;
+	WriteHeader(argc, argv);
+
+	ThreadDataKey = PIN_CreateThreadDataKey(0);
+	PIN_InitLock(&TraceLock);
+	PIN_MutexInit(&BufMutex);
+	PIN_SemaphoreInit(&FullSem);
+
+	if (PIN_SpawnInternalThread(Writer, 0, 0, &WriterUid) == INVALID_THREADID)
+	{
+		cerr << "Error: could not spawn the writer thread" << endl;
+		return 1;
+	}
+
+	/* The region starts at the beginning unless a start event is given */
+	Control.RegisterHandler(ControlHandler, 0, FALSE);
+	Control.Activate();
+
 	TRACE_AddInstrumentFunction(Trace, 0);
 	INS_AddInstrumentFunction(Instruction, 0);
 	IMG_AddInstrumentFunction(Image, 0);
+	PIN_AddThreadStartFunction(ThreadStart, 0);
+	PIN_AddThreadFiniFunction(ThreadFini, 0);
+	PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
 	PIN_AddFiniFunction(Fini, 0);
 
 	// Never returns
 
 	PIN_StartProgram();
 
-	RecordMemWrite();
-	RecordWriteAddrSize(0, 0);
-
 	return 0;
 }
 
@@ -2,7 +2,7 @@
 
 #Description :
 
-#Runs the benchmark with native, multiprocessor 1
+#Runs the benchmark with native, multiprocessor NUMPROCS (default: 1)
 
 #Argument : [TARGET]
 
@@ -10,7 +10,7 @@ TARGET="$1"
 PARSECDIR="/home/dcslab/parsec-3.0"
 PARSECPLAT="amd64-linux.gcc"
 POSEDIR="/home/dcslab/.local/bin/posetrace"
-NUMPROCS="1"
+NUMPROCS="${NUMPROCS:-1}"
 #Determine Target
 case "${TARGET}" in
 	"cholesky" )
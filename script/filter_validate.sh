@@ -0,0 +1,55 @@
+#!/bin/bash
+
+#Description : Validates the cache filter of posetrace (-filter_kb) by
+#              comparing the results of sim on a filtered trace against
+#              a full trace of the same program
+
+#Argument : [FULL TRACE] [FILTERED TRACE] [POLICY...]
+#       or: -- [COMMAND...] to record both traces first (FILTER_OPTS)
+
+SIMDIR="${SIMDIR:-$(dirname $(realpath $0))/../sim}"
+PIN="${PIN:-$(dirname $(realpath $0))/../pin/pin-3.11-97998-g7ecce2dac-gcc-linux/pin}"
+POSETRACE="${POSETRACE:-$HOME/.local/lib/posetrace/posetrace.so}"
+FILTER_OPTS="${FILTER_OPTS:--filter_kb 32 -filter_ways 8 -filter_line 64}"
+SIZES="${SIZES:-1024 4096 16384 65536}"
+
+if [ "$1" == "--" ]; then
+	shift
+	FULL="full.trace"
+	FILTERED="filtered.trace"
+	$PIN -t $POSETRACE -o $FULL -- "$@" || exit 1
+	$PIN -t $POSETRACE -o $FILTERED $FILTER_OPTS -- "$@" || exit 1
+	POLICIES="lru"
+else
+	FULL="$1"
+	FILTERED="$2"
+	shift 2
+	POLICIES="${@:-lru}"
+fi
+
+if [ ! -f "$FULL" ] || [ ! -f "$FILTERED" ]; then
+	echo "usage: $0 <full trace> <filtered trace> [policy...]"
+	echo "       $0 -- <command...>"
+	exit 1
+fi
+
+FULL_BYTES=$(stat -c %s $FULL)
+FILTERED_BYTES=$(stat -c %s $FILTERED)
+echo "trace size: $FULL_BYTES -> $FILTERED_BYTES ($(awk "BEGIN { printf \"%.2f\", $FULL_BYTES / $FILTERED_BYTES }")x smaller)"
+
+# miss ratio in % of the report of sim
+miss_ratio() {
+	$SIMDIR/sim $1 $2 $3 | grep "miss ratio" | awk '{print $4}'
+}
+
+printf "%-10s %10s %10s %10s %10s\n" "policy" "size (kB)" "full" "filtered" "error"
+for POLICY in $POLICIES
+do
+	for SIZE in $SIZES
+	do
+		A=$(miss_ratio $POLICY $SIZE $FULL)
+		B=$(miss_ratio $POLICY $SIZE $FILTERED)
+		ERR=$(awk "BEGIN { printf \"%+.2f\", $B - $A }")
+		printf "%-10s %10s %9s%% %9s%% %9s%%\n" $POLICY $SIZE $A $B $ERR
+	done
+done
@@ -65,14 +65,32 @@ echo "$NAME"
 
 LOG=$INPUTDIR/$TARGET.$NAME.$DATE.log
 touch $LOG
+
+# convert once, then run every policy and size on the page trace
+if [ ! -f $INPUT.pages ] || [ $INPUT -nt $INPUT.pages ]; then
+	$SIMDIR convert $INPUT $INPUT.pages | tee -a $LOG || exit 1
+fi
+INPUT=$INPUT.pages
+POLICIES=""
 for pol_item in ${POLICY[*]}
 do
-	for size_item in ${SIZE[*]}
-	do
-		RUN="$SIMDIR $pol_item $size_item $INPUT"
+	# a stack algorithm is simulated once for all the sizes
+	if [ "$pol_item" == "lru" ] || [ "$pol_item" == "opt" ]; then
+		RUN="$SIMDIR mrc $pol_item $INPUT ${SIZE[*]}"
 		echo "$RUN" | tee -a $LOG
 		eval $RUN | tee -a $LOG
-	done
+		continue
+	fi
+
+	POLICIES="${POLICIES:+$POLICIES,}$pol_item"
 done
 
+# the other policies run every size over a single decoding of the trace
+if [ -n "$POLICIES" ]; then
+	SIZES=$(echo ${SIZE[*]} | tr ' ' ',')
+	RUN="$SIMDIR sweep $POLICIES $SIZES $INPUT"
+	echo "$RUN" | tee -a $LOG
+	eval $RUN | tee $INPUTDIR/$TARGET.$NAME.$DATE.csv | tee -a $LOG
+fi
+
 
@@ -73,17 +73,12 @@ echo "$NAME"
 
 LOG=$INPUTDIR/$TARGET.$NAME.$DATE.log
 touch $LOG
-for pol_item in ${POLICY[*]}
-do
-	for size_item in ${SIZE[*]}
-	do
-		RUN="$SIMDIR $pol_item $size_item $INPUT"
-		for ((i=0;i<=99;i++))
-		do
-			echo "$RUN" | tee -a $LOG
-			eval $RUN | tee -a $LOG
-		done
-	done
-done
+
+# every policy and size with 100 seeds, over a single decoding of the trace
+POLICIES=$(echo ${POLICY[*]} | tr ' ' ',')
+SIZES=$(echo ${SIZE[*]} | tr ' ' ',')
+RUN="$SIMDIR sweep $POLICIES $SIZES $INPUT -seeds 100"
+echo "$RUN" | tee -a $LOG
+eval $RUN | tee $INPUTDIR/$TARGET.$NAME.$DATE.csv | tee -a $LOG
 
 
@@ -12,6 +12,6 @@ do
 	echo $arr_item
 	eval $APP $arr_item >> $LOG 
 	eval $SIM $arr_item >> $LOG
-	rm $arr_item.out
+	rm -f $arr_item.out $arr_item.out.pages
 done
 
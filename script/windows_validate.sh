@@ -0,0 +1,74 @@
+#!/bin/bash
+
+#Description : Validates the sampling windows of sim (-windows) on a
+#              synthetic trace whose references all cross a page boundary
+#              and a range entry every 10 references, so that the windows
+#              must be counted in references rather than in pages
+
+#Argument : [POLICY...]
+
+SIMDIR="${SIMDIR:-$(dirname $(realpath $0))/../sim}"
+TRACE="${TRACE:-windows_validate.trace}"
+NR_REFS=10000
+PERIOD=1000
+WARMUP=200
+MEASURE=300
+POLICIES="${@:-lru clock}"
+
+# 8B references at the last 8 bytes of a page and 3-page ranges
+perl -e '
+my $base = 0x10000000;
+for my $i (0 .. '$NR_REFS' - 1) {
+	my $page = $base + ($i % 700) * 4096;
+	if ($i % 10 == 9) {
+		print pack("QQ", (1 << 60) | $page, 3 * 4096);
+	} else {
+		print pack("Ql", $page + 4088, 16);
+	}
+}' > $TRACE || exit 1
+
+# a count of the report of sim -v
+count() {
+	grep "^ *$1	" | awk '{print $2}'
+}
+
+FAIL=0
+check() {
+	if [ "$2" == "$3" ]; then
+		echo "ok   $1: $2"
+	else
+		echo "FAIL $1: $2 (expected $3)"
+		FAIL=1
+	fi
+}
+
+for POLICY in $POLICIES
+do
+	for OPT in "" "-p"
+	do
+		NAME="$POLICY${OPT:+ $OPT}"
+		FULL=$($SIMDIR/sim $POLICY 2000 $TRACE -v $OPT)
+		ALL=$($SIMDIR/sim $POLICY 2000 $TRACE -v $OPT \
+			-windows $PERIOD:0:$PERIOD)
+		SOME=$($SIMDIR/sim $POLICY 2000 $TRACE -v $OPT \
+			-windows $PERIOD:$WARMUP:$MEASURE)
+
+		# windows covering the trace measure all of it
+		check "$NAME nr_total" "$(echo "$ALL" | count nr_total)" \
+			"$(echo "$FULL" | count nr_total)"
+		check "$NAME nr_miss" "$(echo "$ALL" | count nr_miss)" \
+			"$(echo "$FULL" | count nr_miss)"
+
+		# a window per PERIOD references, not pages
+		check "$NAME windows" \
+			"$(echo "$SOME" | grep "windows:" | awk '{print $3}')" \
+			"$((NR_REFS / PERIOD))"
+		check "$NAME nr_measured" "$(echo "$SOME" | count nr_measured)" \
+			"$((NR_REFS / PERIOD * MEASURE))"
+		check "$NAME nr_total (scaled)" "$(echo "$SOME" | count nr_total)" \
+			"$(echo "$FULL" | count nr_total)"
+	done
+done
+
+rm -f $TRACE
+exit $FAIL
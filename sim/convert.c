@@ -0,0 +1,204 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "trace.h"
+#include "convert.h"
+
+/* vpn -> page id; open addressing */
+struct page_ids {
+	unsigned long *keys;			/* vpn + 1; 0 if empty */
+	unsigned int *ids;
+	unsigned long size;				/* power of two */
+	unsigned long *vpns;			/* by page id */
+	unsigned long nr_pages;
+};
+
+struct converter {
+	FILE *out;
+	struct page_ids map;
+	unsigned long nr_records;
+
+	/* run being collapsed */
+	unsigned long run_id;
+	unsigned long run_len;
+};
+
+static inline unsigned long hash_vpn(unsigned long vpn, unsigned long size)
+{
+	return (vpn * 0x9e3779b97f4a7c15UL) & (size - 1);
+}
+
+static void grow_page_ids(struct page_ids *map)
+{
+	unsigned long *keys = map->keys;
+	unsigned int *ids = map->ids;
+	unsigned long size = map->size, i, slot;
+
+	map->size = size ? size * 2 : 1UL << 16;
+	map->keys = calloc(map->size, sizeof(unsigned long));
+	map->ids = malloc(map->size * sizeof(unsigned int));
+	map->vpns = realloc(map->vpns, map->size / 2 * sizeof(unsigned long));
+	if (!map->keys || !map->ids || !map->vpns)
+		sim_error("Failed to allocate the page ids");
+
+	for (i = 0; i < size; i++) {
+		if (!keys[i])
+			continue;
+		slot = hash_vpn(keys[i] - 1, map->size);
+		while (map->keys[slot])
+			slot = (slot + 1) & (map->size - 1);
+		map->keys[slot] = keys[i];
+		map->ids[slot] = ids[i];
+	}
+
+	free(keys);
+	free(ids);
+}
+
+static unsigned long page_id(struct page_ids *map, unsigned long vpn)
+{
+	unsigned long slot;
+
+	/* at most half full */
+	if (map->nr_pages >= map->size / 2) {
+		if (map->nr_pages > PAGES_ID_MASK)
+			sim_error("Too many pages");
+		grow_page_ids(map);
+	}
+
+	slot = hash_vpn(vpn, map->size);
+	while (map->keys[slot]) {
+		if (map->keys[slot] == vpn + 1)
+			return map->ids[slot];
+		slot = (slot + 1) & (map->size - 1);
+	}
+
+	map->keys[slot] = vpn + 1;
+	map->ids[slot] = map->nr_pages;
+	map->vpns[map->nr_pages] = vpn;
+
+	return map->nr_pages++;
+}
+
+static void emit(struct converter *conv, const void *ptr, size_t size)
+{
+	if (fwrite(ptr, size, 1, conv->out) != 1)
+		sim_error("Failed to write the page trace");
+}
+
+static void flush_run(struct converter *conv)
+{
+	unsigned long word;
+
+	if (!conv->run_len)
+		return;
+
+	word = conv->run_id | (conv->run_len << PAGES_RUN_SHIFT);
+	emit(conv, &word, sizeof(word));
+	conv->nr_records++;
+	conv->run_len = 0;
+}
+
+static void convert_page(struct converter *conv, unsigned long vpn)
+{
+	unsigned long id = page_id(&conv->map, vpn);
+
+	if (conv->run_len && (id != conv->run_id ||
+				conv->run_len == PAGES_MAX_RUN))
+		flush_run(conv);
+
+	conv->run_id = id;
+	conv->run_len++;
+}
+
+static void convert_entry(struct converter *conv, struct trace_entry *ent)
+{
+	unsigned long word = PAGES_ENTRY;
+
+	flush_run(conv);
+	emit(conv, &word, sizeof(word));
+	emit(conv, ent, sizeof(*ent));
+	conv->nr_records++;
+}
+
+/* sim convert <trace file> <page trace> */
+int convert_main(int argc, char **argv)
+{
+	struct converter conv;
+	struct pages_header hdr;
+	struct trace_entry ent;
+	struct trace *trace;
+	unsigned long vpn, last;
+
+	if (argc != 4) {
+		printf("usage: %s convert <trace file> <page trace>\n", argv[0]);
+		exit(1);
+	}
+
+	memset(&conv, 0, sizeof(conv));
+	memset(&hdr, 0, sizeof(hdr));
+
+	trace = trace_open(argv[2]);
+	conv.out = fopen(argv[3], "wb");
+	if (!conv.out) {
+		perror(argv[3]);
+		exit(1);
+	}
+
+	/* the header is completed at the end */
+	emit(&conv, &hdr, sizeof(hdr));
+
+	while (trace_next(trace, &ent)) {
+		switch (ent.type) {
+			case TYPE_REF:
+				/* the pages of sim_ref() */
+				last = addr_to_vpn(ent.addr + (int)ent.arg1 - 1);
+				for (vpn = addr_to_vpn(ent.addr); vpn <= last; vpn++)
+					convert_page(&conv, vpn);
+				break;
+
+			case TYPE_RANGE:
+				if (!ent.arg1)
+					break;
+				last = addr_to_vpn(ent.addr + ent.arg1 - 1);
+				for (vpn = addr_to_vpn(ent.addr); vpn <= last; vpn++)
+					convert_page(&conv, vpn);
+				break;
+
+			case ENTRY_PAGE_RUN:
+				for (; ent.arg1; ent.arg1--)
+					convert_page(&conv, ent.addr);
+				break;
+
+			default:
+				convert_entry(&conv, &ent);
+				break;
+		}
+	}
+	flush_run(&conv);
+
+	hdr.magic = PAGES_MAGIC;
+	hdr.version = PAGES_VERSION;
+	hdr.nr_pages = conv.map.nr_pages;
+	hdr.nr_records = conv.nr_records;
+	hdr.table_off = ftell(conv.out);
+
+	emit(&conv, conv.map.vpns, conv.map.nr_pages * sizeof(unsigned long));
+	if (fseek(conv.out, 0, SEEK_SET))
+		sim_error("Failed to write the page trace");
+	emit(&conv, &hdr, sizeof(hdr));
+
+	if (fclose(conv.out))
+		sim_error("Failed to write the page trace");
+	trace_close(trace);
+
+	printf("%lu pages, %lu records\n", hdr.nr_pages, hdr.nr_records);
+
+	free(conv.map.keys);
+	free(conv.map.ids);
+	free(conv.map.vpns);
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _CONVERT_H
+#define _CONVERT_H
+
+/*
+ * sim convert <trace file> <page trace>
+ *
+ * Converts a trace once into a page trace (see trace.h), which sim reads
+ * without splitting the references into pages again.
+ */
+int convert_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,151 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#include <string.h>
+#include "sim.h"
+#include "decode.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define DECODE_AVX2
+#endif
+
+/* Decode a reference; returns the number of vpns, or -1 without the room */
+static inline int decode_ref(const unsigned char *p, unsigned long *vpns,
+		int room)
+{
+	unsigned long addr, first, last;
+	int size, nr = 0;
+
+	memcpy(&addr, p, sizeof(unsigned long));
+	memcpy(&size, p + sizeof(unsigned long), sizeof(int));
+
+	/* the pages of sim_ref() */
+	first = addr_to_vpn(addr);
+	last = addr_to_vpn(addr + size - 1);
+	if (last < first)
+		return 0;
+	if (last - first >= (unsigned long)room)
+		return -1;
+
+	vpns[nr++] = first;
+	while (++first <= last)
+		vpns[nr++] = first | VPN_NEXT_PAGE;
+
+	return nr;
+}
+
+static inline bool is_ref(const unsigned char *p)
+{
+	unsigned long word;
+
+	memcpy(&word, p, sizeof(unsigned long));
+
+	return ENTRY_TYPE(word) == TYPE_REF;
+}
+
+static int decode_refs_scalar(const unsigned char **pos,
+		const unsigned char *end, unsigned long *vpns, int max)
+{
+	const unsigned char *p = *pos;
+	int nr = 0, n;
+
+	while ((unsigned long)(end - p) >= REF_ENTRY_SIZE && is_ref(p)) {
+		n = decode_ref(p, vpns + nr, max - nr);
+		if (n < 0)
+			break;
+		nr += n;
+		p += REF_ENTRY_SIZE;
+	}
+
+	*pos = p;
+	return nr;
+}
+
+#ifdef DECODE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i load_pair(const unsigned char *p)
+{
+	/* a record in each 128-bit lane: address in the low, size in the high */
+	return _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+			_mm_loadu_si128((const __m128i *)(p + REF_ENTRY_SIZE)), 1);
+}
+
+__attribute__((target("avx2")))
+static int decode_refs_avx2(const unsigned char **pos,
+		const unsigned char *end, unsigned long *vpns, int max)
+{
+	const __m256i type_mask = _mm256_set1_epi64x(TYPE_MASK);
+	const __m256i dwords = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	const __m256i one = _mm256_set1_epi64x(1);
+	const unsigned char *p = *pos;
+	__m256i a, b, addr, size, first, last;
+	int nr = 0, n, i;
+
+	/* the 16-byte load of record 3 reads 4 bytes past it */
+	while (max - nr >= 4 &&
+			(unsigned long)(end - p) >= 4 * REF_ENTRY_SIZE + 4) {
+		/* records 0 and 1 in a, 2 and 3 in b */
+		a = load_pair(p);
+		b = load_pair(p + 2 * REF_ENTRY_SIZE);
+
+		/* 0, 2, 1, 3 into 0, 1, 2, 3 */
+		addr = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b),
+				_MM_SHUFFLE(3, 1, 2, 0));
+		size = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b),
+				_MM_SHUFFLE(3, 1, 2, 0));
+		size = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(
+					_mm256_permutevar8x32_epi32(size, dwords)));
+
+		/* a later record is misplaced after an entry of another type */
+		if (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+							_mm256_and_si256(addr, type_mask),
+							_mm256_setzero_si256()))) != 0xf)
+			break;
+
+		first = _mm256_srli_epi64(addr, PAGE_SHIFT);
+		last = _mm256_srli_epi64(_mm256_sub_epi64(
+					_mm256_add_epi64(addr, size), one), PAGE_SHIFT);
+
+		if (_mm256_movemask_pd(_mm256_castsi256_pd(
+						_mm256_cmpeq_epi64(first, last))) == 0xf) {
+			_mm256_storeu_si256((__m256i *)(vpns + nr), first);
+			nr += 4;
+			p += 4 * REF_ENTRY_SIZE;
+			continue;
+		}
+
+		/* a reference across pages */
+		for (i = 0; i < 4; i++) {
+			n = decode_ref(p, vpns + nr, max - nr);
+			if (n < 0)
+				goto out;
+			nr += n;
+			p += REF_ENTRY_SIZE;
+		}
+	}
+
+	nr += decode_refs_scalar(&p, end, vpns + nr, max - nr);
+out:
+	*pos = p;
+	return nr;
+}
+#endif
+
+/*
+ * Decode the run of references at *pos into at most max vpns, and move *pos
+ * past the references decoded; a reference is not split across calls
+ */
+int decode_refs(const unsigned char **pos, const unsigned char *end,
+		unsigned long *vpns, int max)
+{
+#ifdef DECODE_AVX2
+	static int avx2 = -1;
+
+	/* the same in every thread */
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2");
+	if (avx2)
+		return decode_refs_avx2(pos, end, vpns, max);
+#endif
+	return decode_refs_scalar(pos, end, vpns, max);
+}
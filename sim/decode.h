@@ -0,0 +1,26 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _DECODE_H
+#define _DECODE_H
+
+/*
+ * Batch decoding of references
+ *
+ * A run of references in the legacy format (the address word followed by
+ * the int size, 12B packed) is decoded into the vpns of the pages they touch,
+ * in order. With AVX2, the records are loaded four at a time into the lanes
+ * of two vectors and shuffled into vectors of the addresses and the sizes,
+ * and the first and last vpns are computed in the lanes. A group with an
+ * entry other than a reference, or a reference across pages, is left to the
+ * scalar code.
+ *
+ * The pages of a reference after its first are marked with VPN_NEXT_PAGE, so
+ * that the references can be told apart.
+ */
+
+#define REF_ENTRY_SIZE			(sizeof(unsigned long) + sizeof(int))
+#define VPN_NEXT_PAGE			(1UL << 63)
+
+int decode_refs(const unsigned char **pos, const unsigned char *end,
+		unsigned long *vpns, int max);
+
+#endif
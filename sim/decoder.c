@@ -0,0 +1,159 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "sim.h"
+#include "decoder.h"
+#include "decode.h"
+
+#define DECODER_SPINS			256		/* before yielding the CPU */
+
+static void decoder_wait(int *spins)
+{
+	if (++*spins > DECODER_SPINS)
+		sched_yield();
+}
+
+/* Batches consumed by all the consumers */
+static unsigned long decoder_tail(struct decoder *dec)
+{
+	unsigned long tail, min = ~0UL;
+	int i;
+
+	for (i = 0; i < dec->nr_consumers; i++) {
+		tail = __atomic_load_n(&dec->tails[i].tail, __ATOMIC_ACQUIRE);
+		if (tail < min)
+			min = tail;
+	}
+
+	return min;
+}
+
+static void *decoder_main(void *arg)
+{
+	struct decoder *dec = arg;
+	struct sim_batch *batch;
+	struct sim_event *ev = NULL;
+	struct trace_entry ent;
+	unsigned long vpns[DECODER_BATCH_EVENTS];
+	unsigned long head = 0, first, last;
+	bool more = true;
+	int spins, i, nr;
+
+	while (more) {
+		spins = 0;
+		while (head - decoder_tail(dec) == DECODER_NR_BATCHES)
+			decoder_wait(&spins);
+
+		batch = &dec->batches[head & (DECODER_NR_BATCHES - 1)];
+		batch->nr_events = 0;
+		batch->nr_entries = 0;
+
+		while (batch->nr_events < DECODER_BATCH_EVENTS &&
+				batch->nr_entries < DECODER_BATCH_ENTRIES) {
+			/* a run of references, whose next pages are marked */
+			nr = trace_next_vpns(dec->trace, vpns,
+					DECODER_BATCH_EVENTS - batch->nr_events);
+			if (nr) {
+				for (i = 0; i < nr; i++) {
+					if (vpns[i] & VPN_NEXT_PAGE) {
+						ev->nr_pages++;
+						continue;
+					}
+					ev = &batch->events[batch->nr_events++];
+					ev->type = EVENT_REF;
+					ev->vpn = vpns[i];
+					ev->nr_pages = 1;
+				}
+				continue;
+			}
+
+			if (!trace_next(dec->trace, &ent)) {
+				more = false;
+				break;
+			}
+
+			ev = &batch->events[batch->nr_events++];
+			if (ent.type == TYPE_REF) {
+				/* the pages of sim_ref() */
+				first = addr_to_vpn(ent.addr);
+				last = addr_to_vpn(ent.addr + (int)ent.arg1 - 1);
+				ev->type = EVENT_REF;
+				ev->vpn = first;
+				ev->nr_pages = last >= first ? last - first + 1 : 0;
+			} else if (ent.type == ENTRY_PAGE_RUN) {
+				ev->type = EVENT_RUN;
+				ev->vpn = ent.addr;
+				ev->nr_pages = ent.arg1;
+			} else {
+				ev->type = EVENT_ENTRY;
+				ev->vpn = batch->nr_entries;
+				batch->entries[batch->nr_entries++] = ent;
+			}
+		}
+
+		__atomic_store_n(&dec->head, ++head, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&dec->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+struct decoder *decoder_start(struct trace *trace, int nr_consumers)
+{
+	struct decoder *dec;
+
+	if (nr_consumers < 1 || nr_consumers > DECODER_MAX_CONSUMERS)
+		sim_error("Too many consumers of the decoder");
+
+	if (posix_memalign((void **)&dec, DECODER_CACHELINE, sizeof(*dec)))
+		sim_error("Failed to start the decoder");
+	memset(dec, 0, sizeof(*dec));
+
+	dec->trace = trace;
+	dec->nr_consumers = nr_consumers;
+	dec->batches = malloc(DECODER_NR_BATCHES * sizeof(struct sim_batch));
+	if (!dec->batches)
+		sim_error("Failed to start the decoder");
+
+	if (pthread_create(&dec->thread, NULL, decoder_main, dec))
+		sim_error("Failed to start the decoder");
+
+	return dec;
+}
+
+/* Wait for the next batch; returns NULL at the end of the trace */
+struct sim_batch *decoder_next(struct decoder *dec, int consumer)
+{
+	unsigned long tail = dec->tails[consumer].tail;
+	int spins = 0;
+
+	while (__atomic_load_n(&dec->head, __ATOMIC_ACQUIRE) == tail) {
+		/* done is set after the last head, so check head again */
+		if (__atomic_load_n(&dec->done, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&dec->head, __ATOMIC_ACQUIRE) == tail)
+				return NULL;
+			break;
+		}
+		decoder_wait(&spins);
+	}
+
+	return &dec->batches[tail & (DECODER_NR_BATCHES - 1)];
+}
+
+/* Return the batch of decoder_next() */
+void decoder_release(struct decoder *dec, int consumer)
+{
+	struct decoder_tail *tail = &dec->tails[consumer];
+
+	__atomic_store_n(&tail->tail, tail->tail + 1, __ATOMIC_RELEASE);
+}
+
+void decoder_stop(struct decoder *dec)
+{
+	pthread_join(dec->thread, NULL);
+	free(dec->batches);
+	free(dec);
+}
@@ -0,0 +1,72 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _DECODER_H
+#define _DECODER_H
+
+#include <pthread.h>
+#include "trace.h"
+
+/*
+ * Pipelined trace decoding (sim -p and sim multi)
+ *
+ * A decoder thread reads the trace and turns the entries into batches of
+ * events, which the simulation threads consume through a single-producer
+ * ring of DECODER_NR_BATCHES batches. A reference becomes a run of the pages
+ * it touches, and a run of a converted trace a number of accesses to a page;
+ * the other entries are passed as they are.
+ *
+ * Every batch is broadcast to all the consumers, which read it in place: head
+ * is the number of batches produced, and the tail of each consumer the number
+ * it consumed, each on its own cache line. A batch is filled before head is
+ * released, and consumed before the tail is released; it is refilled once
+ * the slowest consumer has released it. done is set after the last head.
+ */
+
+#define DECODER_NR_BATCHES		8			/* power of two */
+#define DECODER_BATCH_EVENTS	4096
+#define DECODER_BATCH_ENTRIES	256
+#define DECODER_CACHELINE		64
+#define DECODER_MAX_CONSUMERS	64
+
+#define EVENT_REF				0
+#define EVENT_ENTRY				1
+#define EVENT_RUN				2
+
+struct sim_event {
+	unsigned long vpn;				/* first page, or the index of the entry */
+	unsigned int type;				/* EVENT_* */
+	unsigned int nr_pages;			/* or the run length */
+};
+
+struct sim_batch {
+	struct sim_event events[DECODER_BATCH_EVENTS];
+	struct trace_entry entries[DECODER_BATCH_ENTRIES];
+	int nr_events;
+	int nr_entries;
+};
+
+struct decoder_tail {
+	unsigned long tail;
+	char pad[DECODER_CACHELINE - sizeof(unsigned long)];
+};
+
+struct decoder {
+	struct trace *trace;
+	pthread_t thread;
+	struct sim_batch *batches;
+	int nr_consumers;
+	char pad0[DECODER_CACHELINE - sizeof(struct trace *) -
+		sizeof(pthread_t) - sizeof(struct sim_batch *) - sizeof(int)];
+
+	unsigned long head;
+	unsigned long done;
+	char pad1[DECODER_CACHELINE - 2 * sizeof(unsigned long)];
+
+	struct decoder_tail tails[DECODER_MAX_CONSUMERS];
+};
+
+struct decoder *decoder_start(struct trace *trace, int nr_consumers);
+struct sim_batch *decoder_next(struct decoder *dec, int consumer);
+void decoder_release(struct decoder *dec, int consumer);
+void decoder_stop(struct decoder *dec);
+
+#endif
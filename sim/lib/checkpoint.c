@@ -0,0 +1,180 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#include <stdio.h>
+#include <stdlib.h>
+#include "checkpoint.h"
+
+void ckpt_ids_add(struct ckpt_ids *ids, const void *ptr)
+{
+	ids->ents = realloc(ids->ents, (ids->nr + 1) * sizeof(struct ckpt_id));
+	ids->ptrs = realloc(ids->ptrs, (ids->nr + 1) * sizeof(void *));
+	if (!ids->ents || !ids->ptrs) {
+		fprintf(stderr, "Failed to allocate the checkpoint ids\n");
+		exit(1);
+	}
+
+	ids->ptrs[ids->nr] = ptr;
+	ids->ents[ids->nr].ptr = ptr;
+	ids->ents[ids->nr].id = ids->nr;
+	ids->nr++;
+	ids->sorted = false;
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+	const struct ckpt_id *ia = a, *ib = b;
+
+	if (ia->ptr != ib->ptr)
+		return ia->ptr < ib->ptr ? -1 : 1;
+	return 0;
+}
+
+/* Returns -1 if ptr has not been added */
+long ckpt_id(struct ckpt_ids *ids, const void *ptr)
+{
+	struct ckpt_id key = { .ptr = ptr }, *ent;
+
+	if (!ids->sorted) {
+		qsort(ids->ents, ids->nr, sizeof(struct ckpt_id), cmp_id);
+		ids->sorted = true;
+	}
+
+	ent = bsearch(&key, ids->ents, ids->nr, sizeof(struct ckpt_id), cmp_id);
+
+	return ent ? ent->id : -1;
+}
+
+void ckpt_ids_free(struct ckpt_ids *ids)
+{
+	free(ids->ents);
+	free(ids->ptrs);
+	ids->ents = NULL;
+	ids->ptrs = NULL;
+	ids->nr = 0;
+}
+
+void ckpt_write(FILE *file, const void *ptr, size_t size)
+{
+	if (size && fwrite(ptr, size, 1, file) != 1) {
+		fprintf(stderr, "Failed to write the checkpoint\n");
+		exit(1);
+	}
+}
+
+void ckpt_read(FILE *file, void *ptr, size_t size)
+{
+	if (size && fread(ptr, size, 1, file) != 1) {
+		fprintf(stderr, "Invalid checkpoint\n");
+		exit(1);
+	}
+}
+
+/* The page of addr, which must have been restored */
+struct page *ckpt_page(pt_t *pt, unsigned long addr)
+{
+	struct page *page = pt_walk(pt, addr);
+
+	if (!page) {
+		fprintf(stderr, "Invalid checkpoint\n");
+		exit(1);
+	}
+
+	return page;
+}
+
+static inline struct page *list_page(struct list_head *pos, size_t offset)
+{
+	return (struct page *)((char *)pos - offset);
+}
+
+void __ckpt_write_pages(FILE *file, struct list_head *head, size_t offset)
+{
+	struct list_head *pos;
+	struct page *page;
+	unsigned long nr = 0, rec[2];
+
+	list_for_each(pos, head)
+		nr++;
+	ckpt_write(file, &nr, sizeof(nr));
+
+	list_for_each(pos, head) {
+		page = list_page(pos, offset);
+		rec[0] = page->addr;
+		rec[1] = page->referenced;
+		ckpt_write(file, rec, sizeof(rec));
+	}
+}
+
+/* Map the pages and link them in order at the tail of head */
+unsigned long __ckpt_read_pages(FILE *file, pt_t *pt, struct list_head *head,
+		size_t offset)
+{
+	struct page *page;
+	unsigned long nr, i, rec[2];
+
+	ckpt_read(file, &nr, sizeof(nr));
+	for (i = 0; i < nr; i++) {
+		ckpt_read(file, rec, sizeof(rec));
+		if (pt_walk(pt, rec[0])) {
+			fprintf(stderr, "Invalid checkpoint\n");
+			exit(1);
+		}
+
+		page = map_alloc_page(pt, rec[0]);
+		page->referenced = rec[1];
+		list_add_tail((struct list_head *)((char *)page + offset), head);
+	}
+
+	return nr;
+}
+
+void __ckpt_write_list(FILE *file, struct list_head *head, size_t offset)
+{
+	struct list_head *pos;
+	unsigned long nr = 0;
+
+	list_for_each(pos, head)
+		nr++;
+	ckpt_write(file, &nr, sizeof(nr));
+
+	list_for_each(pos, head)
+		ckpt_write(file, &list_page(pos, offset)->addr, sizeof(unsigned long));
+}
+
+/* Link the pages in order at the tail of head */
+void __ckpt_read_list(FILE *file, pt_t *pt, struct list_head *head,
+		size_t offset)
+{
+	struct page *page;
+	unsigned long nr, addr;
+
+	ckpt_read(file, &nr, sizeof(nr));
+	for (; nr; nr--) {
+		ckpt_read(file, &addr, sizeof(addr));
+		page = ckpt_page(pt, addr);
+		list_add_tail((struct list_head *)((char *)page + offset), head);
+	}
+}
+
+void __ckpt_write_hand(FILE *file, struct list_head *head,
+		struct list_head *hand, size_t offset)
+{
+	unsigned long rec[2] = { 0, 0 };
+
+	if (hand != head) {
+		rec[0] = 1;
+		rec[1] = list_page(hand, offset)->addr;
+	}
+	ckpt_write(file, rec, sizeof(rec));
+}
+
+struct list_head *__ckpt_read_hand(FILE *file, pt_t *pt,
+		struct list_head *head, size_t offset)
+{
+	unsigned long rec[2];
+
+	ckpt_read(file, rec, sizeof(rec));
+	if (!rec[0])
+		return head;
+
+	return (struct list_head *)((char *)ckpt_page(pt, rec[1]) + offset);
+}
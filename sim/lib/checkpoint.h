@@ -0,0 +1,72 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _LIB_CHECKPOINT_H
+#define _LIB_CHECKPOINT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "pgtable.h"
+
+/*
+ * Checkpoints of the policies
+ *
+ * A page is named by its address. The pages of a policy are written once
+ * from a list holding all of them (with the referenced bit), and mapped
+ * again in the page table when restored; its other lists are written as the
+ * addresses of their pages in order, and linked again through the page
+ * table. A hand is written as the page it points to, or the head of the list.
+ */
+
+/*
+ * Ids of the objects the pages point to (e.g., their memory areas), in the
+ * order added; an object freed while its pages remain is added when found
+ */
+struct ckpt_id {
+	const void *ptr;
+	long id;
+};
+
+struct ckpt_ids {
+	struct ckpt_id *ents;			/* sorted by ptr when looked up */
+	const void **ptrs;				/* by id */
+	long nr;
+	bool sorted;
+};
+
+#define CKPT_IDS_INIT			{ NULL, NULL, 0, false }
+
+extern void ckpt_ids_add(struct ckpt_ids *ids, const void *ptr);
+extern long ckpt_id(struct ckpt_ids *ids, const void *ptr);
+extern void ckpt_ids_free(struct ckpt_ids *ids);
+
+extern void ckpt_write(FILE *file, const void *ptr, size_t size);
+extern void ckpt_read(FILE *file, void *ptr, size_t size);
+
+extern void __ckpt_write_pages(FILE *file, struct list_head *head,
+		size_t offset);
+extern unsigned long __ckpt_read_pages(FILE *file, pt_t *pt,
+		struct list_head *head, size_t offset);
+extern void __ckpt_write_list(FILE *file, struct list_head *head,
+		size_t offset);
+extern void __ckpt_read_list(FILE *file, pt_t *pt, struct list_head *head,
+		size_t offset);
+extern void __ckpt_write_hand(FILE *file, struct list_head *head,
+		struct list_head *hand, size_t offset);
+extern struct list_head *__ckpt_read_hand(FILE *file, pt_t *pt,
+		struct list_head *head, size_t offset);
+
+#define ckpt_write_pages(_file, _head, _member)		\
+	__ckpt_write_pages(_file, _head, offsetof(struct page, _member))
+#define ckpt_read_pages(_file, _pt, _head, _member)	\
+	__ckpt_read_pages(_file, _pt, _head, offsetof(struct page, _member))
+#define ckpt_write_list(_file, _head, _member)		\
+	__ckpt_write_list(_file, _head, offsetof(struct page, _member))
+#define ckpt_read_list(_file, _pt, _head, _member)	\
+	__ckpt_read_list(_file, _pt, _head, offsetof(struct page, _member))
+#define ckpt_write_hand(_file, _head, _hand, _member)	\
+	__ckpt_write_hand(_file, _head, _hand, offsetof(struct page, _member))
+#define ckpt_read_hand(_file, _pt, _head, _member)	\
+	__ckpt_read_hand(_file, _pt, _head, offsetof(struct page, _member))
+
+extern struct page *ckpt_page(pt_t *pt, unsigned long addr);
+
+#endif
@@ -102,6 +102,23 @@ struct page *pt_walk(pt_t *pt, unsigned long addr)
 	return page;
 }
 
+/* The PMD mapping addr, whose PTEs follow one another; NULL if none */
+pmd_t *pt_walk_pmd(pt_t *pt, unsigned long addr)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+
+	pgd = pgd_offset(pt, addr);
+	if (!pgd)
+		return NULL;
+
+	pud = pud_offset(pgd, addr);
+	if (!pud)
+		return NULL;
+
+	return pmd_offset(pud, addr);
+}
+
 int map_page(pt_t *pt, unsigned long addr, struct page *page)
 {
 	pgd_t *pgd;
@@ -198,3 +215,56 @@ int unmap_free_page(struct page *page)
 
 	return 0;
 }
+
+/*
+ * Unmap and free the present pages in [addr, addr + size); the tables absent
+ * are skipped at once, so that huge reservations are cheap to walk.
+ */
+unsigned long unmap_free_range(pt_t *pt, unsigned long addr,
+		unsigned long size)
+{
+	return __unmap_free_range(pt, addr, size, NULL, NULL);
+}
+
+/* As unmap_free_range(), passing each page to release() before it is freed */
+unsigned long __unmap_free_range(pt_t *pt, unsigned long addr,
+		unsigned long size, void (*release)(struct page *page, void *arg),
+		void *arg)
+{
+	unsigned long end = addr + size;
+	unsigned long nr_freed = 0;
+	unsigned long next;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	for (addr &= ~((1UL << PTE_SHIFT) - 1); addr < end; addr = next) {
+		next = (addr | ((1UL << PGD_SHIFT) - 1)) + 1;
+		pgd = pgd_offset(pt, addr);
+		if (!pgd)
+			continue;
+
+		next = (addr | ((1UL << PUD_SHIFT) - 1)) + 1;
+		pud = pud_offset(pgd, addr);
+		if (!pud)
+			continue;
+
+		next = (addr | ((1UL << PMD_SHIFT) - 1)) + 1;
+		pmd = pmd_offset(pud, addr);
+		if (!pmd)
+			continue;
+
+		next = addr + (1UL << PTE_SHIFT);
+		pte = pte_offset(pmd, addr);
+		if (!pte || !pte->page)
+			continue;
+
+		if (release)
+			release(pte->page, arg);
+		unmap_free_page(pte->page);
+		nr_freed++;
+	}
+
+	return nr_freed;
+}
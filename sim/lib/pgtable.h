@@ -124,10 +124,16 @@ static inline bool test_and_clear_page_young(struct page *page)
 
 extern void pt_init(pt_t **pt);
 extern struct page *pt_walk(pt_t *pt, unsigned long addr);
+extern pmd_t *pt_walk_pmd(pt_t *pt, unsigned long addr);
 int map_page(pt_t *pt, unsigned long addr, struct page *page);
 extern struct page *map_alloc_page(pt_t *pt, unsigned long addr);
 extern void unmap_addr(pt_t *pt, unsigned long addr);
 extern int unmap_free_page(struct page *page);
+extern unsigned long unmap_free_range(pt_t *pt, unsigned long addr,
+		unsigned long size);
+extern unsigned long __unmap_free_range(pt_t *pt, unsigned long addr,
+		unsigned long size, void (*release)(struct page *page, void *arg),
+		void *arg);
 
 extern struct page *alloc_page(pte_t *pte, unsigned long addr);
 extern void free_page(struct page *page);
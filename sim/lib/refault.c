@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "refault.h"
+#include "checkpoint.h"
 
 /* Data structures */
 typedef struct {
@@ -22,102 +23,169 @@ typedef struct {
 	pt_t *pt;
 } refault_table_t;
 
-/* Variables */
-static refault_stat_t refault_stat;
-static refault_table_t refault_table;
+/* Refaults of a policy instance */
+struct refault {
+	refault_stat_t stat;
+	refault_table_t table;
 
-static bool need_init = true;
-static bool done = false;
+	bool need_init;
+	bool done;
+};
 
 /* Handlers */
+struct refault *
+refault_alloc(void)
+{
+	struct refault *rf = calloc(1, sizeof(*rf));
+
+	if (!rf) {
+		fprintf(stderr, "Failed to allocate the refault stat\n");
+		exit(1);
+	}
+	rf->need_init = true;
+
+	return rf;
+}
+
 static void
-init_refault(void)
+init_refault(struct refault *rf)
 {
-	refault_stat.refault_dist_acc = 0;
-	refault_stat.nr_evict = 0;
-	refault_stat.nr_access = 0;
+	rf->stat.refault_dist_acc = 0;
+	rf->stat.nr_evict = 0;
+	rf->stat.nr_access = 0;
 
-	INIT_LIST_HEAD(&refault_table.list);
-	pt_init(&refault_table.pt);
+	INIT_LIST_HEAD(&rf->table.list);
+	pt_init(&rf->table.pt);
 
-	need_init = false;
+	rf->need_init = false;
 }
 
 static refault_data_t *
-new_data(unsigned long addr)
+new_data(struct refault *rf, unsigned long addr)
 {
 	refault_data_t *new = malloc(sizeof(*new));
 
 	new->addr = addr;
-	new->time_evict = refault_stat.nr_access;
+	new->time_evict = rf->stat.nr_access;
 
 	return new;
 }
 
-void reg_evict(unsigned long addr)
+void reg_evict(struct refault *rf, unsigned long addr)
 {
 	refault_data_t *data;
 
-	assert(!need_init);
-	assert(!done);
+	assert(!rf->need_init);
+	assert(!rf->done);
 
-	data = new_data(addr);
+	data = new_data(rf, addr);
 
-	list_add_tail(&data->entry, &refault_table.list);
+	list_add_tail(&data->entry, &rf->table.list);
 
 	/* obsolete page from OPT does not have addr */
 	if (addr)
-		assert(!map_page(refault_table.pt, addr, (struct page *)data));
+		assert(!map_page(rf->table.pt, addr, (struct page *)data));
 
-	refault_stat.nr_evict++;
+	rf->stat.nr_evict++;
 }
 
 static void
-__reg_fault(refault_data_t *data)
+__reg_fault(struct refault *rf, refault_data_t *data)
 {
-	refault_stat.refault_dist_acc +=
-		refault_stat.nr_access - data->time_evict;
+	rf->stat.refault_dist_acc +=
+		rf->stat.nr_access - data->time_evict;
 
 	/* obsolete page from OPT does not have addr */
 	if (data->addr)
-		unmap_addr(refault_table.pt, data->addr);
+		unmap_addr(rf->table.pt, data->addr);
 
 	list_del(&data->entry);
 	free(data);
 }
 
-void reg_fault(unsigned long addr)
+void reg_fault(struct refault *rf, unsigned long addr)
 {
 	refault_data_t *data;
 
-	assert(!done);
+	assert(!rf->done);
 
-	if (need_init)
-		init_refault();
+	if (rf->need_init)
+		init_refault(rf);
 
-	data = (refault_data_t *)pt_walk(refault_table.pt, addr);
+	data = (refault_data_t *)pt_walk(rf->table.pt, addr);
 	if (!data)
 		return;		/* not a refault */
 
-	__reg_fault(data);
+	__reg_fault(rf, data);
 }
 
-void cnt_access(unsigned long cnt)
+void cnt_access(struct refault *rf, unsigned long cnt)
 {
-	refault_stat.nr_access += cnt;
+	rf->stat.nr_access += cnt;
 }
 
 double
-avg_refault_dist(void)
+avg_refault_dist(struct refault *rf)
 {
 	refault_data_t *data, *n;
 	double avg;
 
-	list_for_each_entry_safe(data, n, &refault_table.list, entry)
-		__reg_fault(data);
+	list_for_each_entry_safe(data, n, &rf->table.list, entry)
+		__reg_fault(rf, data);
 
-	avg = (double) refault_stat.refault_dist_acc / refault_stat.nr_evict;
-	done = true;
+	avg = (double) rf->stat.refault_dist_acc / rf->stat.nr_evict;
+	rf->done = true;
 
 	return avg;
 }
+
+/* The evicted pages in order of eviction, for a checkpoint */
+void refault_save(struct refault *rf, FILE *file)
+{
+	refault_data_t *data;
+	unsigned long nr = 0;
+	bool state[2] = { rf->need_init, rf->done };
+
+	ckpt_write(file, state, sizeof(state));
+	ckpt_write(file, &rf->stat, sizeof(rf->stat));
+
+	if (rf->need_init)
+		return;
+
+	list_for_each_entry(data, &rf->table.list, entry)
+		nr++;
+	ckpt_write(file, &nr, sizeof(nr));
+
+	list_for_each_entry(data, &rf->table.list, entry) {
+		ckpt_write(file, &data->addr, sizeof(unsigned long));
+		ckpt_write(file, &data->time_evict, sizeof(unsigned long));
+	}
+}
+
+void refault_restore(struct refault *rf, FILE *file)
+{
+	refault_data_t *data;
+	unsigned long nr;
+	bool state[2];
+
+	ckpt_read(file, state, sizeof(state));
+	if (!state[0])
+		init_refault(rf);
+
+	ckpt_read(file, &rf->stat, sizeof(rf->stat));
+	rf->done = state[1];
+	if (state[0])
+		return;
+
+	ckpt_read(file, &nr, sizeof(nr));
+	for (; nr; nr--) {
+		data = malloc(sizeof(*data));
+		ckpt_read(file, &data->addr, sizeof(unsigned long));
+		ckpt_read(file, &data->time_evict, sizeof(unsigned long));
+
+		list_add_tail(&data->entry, &rf->table.list);
+		if (data->addr)
+			assert(!map_page(rf->table.pt, data->addr,
+						(struct page *)data));
+	}
+}
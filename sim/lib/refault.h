@@ -1,10 +1,17 @@
 /* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
 #ifndef _LIB_REFAULT_H
+#define _LIB_REFAULT_H
+#include <stdio.h>
 #include "pgtable.h"
 
-extern void reg_evict(unsigned long addr);
-extern void reg_fault(unsigned long addr);
-extern double avg_refault_dist(void);
-extern void cnt_access(unsigned long cnt);
+struct refault;
+
+extern struct refault *refault_alloc(void);
+extern void reg_evict(struct refault *rf, unsigned long addr);
+extern void reg_fault(struct refault *rf, unsigned long addr);
+extern double avg_refault_dist(struct refault *rf);
+extern void cnt_access(struct refault *rf, unsigned long cnt);
+extern void refault_save(struct refault *rf, FILE *file);
+extern void refault_restore(struct refault *rf, FILE *file);
 
 #endif
@@ -0,0 +1,21 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _LIB_RNG_H
+#define _LIB_RNG_H
+
+#include <stdint.h>
+
+/*
+ * xoshiro256** (Blackman and Vigna), a random stream per policy instance;
+ * the state is seeded through splitmix64, so that any seed (even 0) works,
+ * and the stream of a seed is the same in every run
+ */
+struct rng {
+	uint64_t s[4];
+};
+
+extern void rng_seed(struct rng *rng, uint64_t seed);
+extern uint64_t rng_next(struct rng *rng);
+/* uniform in [0, 1) */
+extern double rng_double(struct rng *rng);
+
+#endif
@@ -0,0 +1,930 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "trace.h"
+#include "mrc.h"
+#include "lib/pgtable.h"
+
+/*
+ * Miss-ratio curves
+ *
+ * A stack algorithm holds the top C pages of a single stack in a memory of
+ * C pages, so the hits of a reference are those of every size from its
+ * stack distance on. The distances are counted in a Fenwick tree, so that
+ * the misses of any size are taken in O(log n) while simulating.
+ *
+ * A policy leaves its cold state when its memory is filled first; the misses
+ * of a size at that moment are its cold misses.
+ */
+#define MRC_MIN_SIZE			(1UL << 16)
+
+struct mrc {
+	long *hist;						/* hits by stack distance */
+	long *tree;						/* Fenwick tree of hist */
+	unsigned long size;
+	long nr_ref;
+
+	long *cold;						/* misses of each size when filled */
+	unsigned long nr_full;			/* sizes filled so far */
+	unsigned long cold_size;
+	unsigned long max_pages;		/* the larger sizes never evict */
+};
+
+static inline void fen_add(long *tree, unsigned long size, unsigned long i,
+		long val)
+{
+	for (; i <= size; i += i & -i)
+		tree[i] += val;
+}
+
+/* Sum of [1, i] */
+static inline long fen_sum(long *tree, unsigned long i)
+{
+	long sum = 0;
+
+	for (; i; i -= i & -i)
+		sum += tree[i];
+
+	return sum;
+}
+
+/* Fenwick tree of cnt[1, size] in O(size) */
+static void fen_build(long *tree, long *cnt, unsigned long size)
+{
+	unsigned long i, j;
+
+	memcpy(tree, cnt, (size + 1) * sizeof(long));
+	for (i = 1; i <= size; i++) {
+		j = i + (i & -i);
+		if (j <= size)
+			tree[j] += tree[i];
+	}
+}
+
+static void mrc_init(struct mrc *mrc)
+{
+	memset(mrc, 0, sizeof(*mrc));
+}
+
+static void mrc_free(struct mrc *mrc)
+{
+	free(mrc->hist);
+	free(mrc->tree);
+	free(mrc->cold);
+}
+
+/* Hits at the stack distance (1 is the top) */
+static void mrc_hit(struct mrc *mrc, unsigned long dist, long nr)
+{
+	unsigned long size = mrc->size;
+
+	if (dist > size) {
+		while (size < dist)
+			size = size ? size * 2 : MRC_MIN_SIZE;
+
+		mrc->hist = realloc(mrc->hist, (size + 1) * sizeof(long));
+		mrc->tree = realloc(mrc->tree, (size + 1) * sizeof(long));
+		if (!mrc->hist || !mrc->tree)
+			sim_error("Failed to allocate the stack distances");
+		memset(mrc->hist + mrc->size + 1, 0,
+				(size - mrc->size) * sizeof(long));
+		if (!mrc->size)
+			mrc->hist[0] = 0;
+
+		mrc->size = size;
+		fen_build(mrc->tree, mrc->hist, size);
+	}
+
+	mrc->hist[dist] += nr;
+	fen_add(mrc->tree, mrc->size, dist, nr);
+}
+
+/* Hits of a memory of nr_pages so far */
+static long mrc_hits(struct mrc *mrc, unsigned long nr_pages)
+{
+	if (nr_pages > mrc->size)
+		nr_pages = mrc->size;
+
+	return fen_sum(mrc->tree, nr_pages);
+}
+
+/* The memories up to nr_pages are full; the new ones leave the cold state */
+static void mrc_fill(struct mrc *mrc, unsigned long nr_pages)
+{
+	if (nr_pages <= mrc->nr_full)
+		return;
+
+	if (nr_pages >= mrc->cold_size) {
+		mrc->cold_size = nr_pages * 2 + 1;
+		mrc->cold = realloc(mrc->cold, mrc->cold_size * sizeof(long));
+		if (!mrc->cold)
+			sim_error("Failed to allocate the cold misses");
+	}
+
+	while (mrc->nr_full < nr_pages) {
+		mrc->nr_full++;
+		mrc->cold[mrc->nr_full] = mrc->nr_ref -
+			mrc_hits(mrc, mrc->nr_full);
+	}
+}
+
+/*
+ * LRU stack
+ *
+ * The stack is ordered by the time of the last access: each access takes
+ * the next slot, and the stack distance of a page is the number of slots in
+ * use from its own on. The slots are renumbered when they run out.
+ *
+ * A page dropped by mem_discard() leaves a hole in its slot: the memories
+ * holding it have a free page there, and the others are not changed. A miss
+ * fills the most recent hole instead of evicting in the memories holding the
+ * hole, and a hit moves the most recent hole above the page down to the slot
+ * of the page, since the memories holding the page still have the hole.
+ */
+struct lru_stack {
+	pt_t *pt;
+	struct page **slots;			/* NULL if not in use */
+	long *tree;						/* Fenwick tree of the slots in use */
+	unsigned long nr_slots;
+	unsigned long now;				/* next slot */
+	unsigned long depth;			/* slots in use */
+
+	unsigned long *holes;			/* max-heap of the slots of the holes */
+	unsigned long nr_holes;
+	unsigned long holes_size;
+
+	struct mrc mrc;
+};
+
+static struct page hole_page;
+
+static inline unsigned long page_slot(struct page *page)
+{
+	return (unsigned long)page->private;
+}
+
+static void hole_down(struct lru_stack *st, unsigned long i)
+{
+	unsigned long child, slot = st->holes[i];
+
+	while ((child = 2 * i + 1) < st->nr_holes) {
+		if (child + 1 < st->nr_holes &&
+				st->holes[child + 1] > st->holes[child])
+			child++;
+		if (st->holes[child] <= slot)
+			break;
+		st->holes[i] = st->holes[child];
+		i = child;
+	}
+	st->holes[i] = slot;
+}
+
+static void push_hole(struct lru_stack *st, unsigned long slot)
+{
+	unsigned long i, parent;
+
+	if (st->nr_holes == st->holes_size) {
+		st->holes_size = st->holes_size ? st->holes_size * 2 : 1024;
+		st->holes = realloc(st->holes, st->holes_size * sizeof(unsigned long));
+		if (!st->holes)
+			sim_error("Failed to allocate the holes");
+	}
+
+	for (i = st->nr_holes++; i; i = parent) {
+		parent = (i - 1) / 2;
+		if (st->holes[parent] >= slot)
+			break;
+		st->holes[i] = st->holes[parent];
+	}
+	st->holes[i] = slot;
+}
+
+static unsigned long pop_hole(struct lru_stack *st)
+{
+	unsigned long slot = st->holes[0];
+
+	st->holes[0] = st->holes[--st->nr_holes];
+	if (st->nr_holes)
+		hole_down(st, 0);
+
+	return slot;
+}
+
+static void vacate_slot(struct lru_stack *st, unsigned long slot)
+{
+	st->slots[slot] = NULL;
+	fen_add(st->tree, st->nr_slots, slot, -1);
+	st->depth--;
+}
+
+/* Renumber the slots in use from 1, and grow them if half are in use */
+static void compact_stack(struct lru_stack *st)
+{
+	unsigned long i, j, nr_holes = 0;
+	long *ones;
+
+	if (st->depth * 2 > st->nr_slots) {
+		st->nr_slots *= 2;
+		st->slots = realloc(st->slots,
+				(st->nr_slots + 1) * sizeof(struct page *));
+		st->tree = realloc(st->tree, (st->nr_slots + 1) * sizeof(long));
+		if (!st->slots || !st->tree)
+			sim_error("Failed to allocate the LRU stack");
+	}
+
+	/* the holes in descending order are a max-heap as well */
+	for (i = 1, j = 0; i < st->now; i++) {
+		if (!st->slots[i])
+			continue;
+
+		st->slots[++j] = st->slots[i];
+		if (st->slots[j] == &hole_page)
+			st->holes[st->nr_holes - ++nr_holes] = j;
+		else
+			st->slots[j]->private = (void *)j;
+	}
+	st->now = j + 1;
+
+	ones = calloc(st->nr_slots + 1, sizeof(long));
+	if (!ones)
+		sim_error("Failed to allocate the LRU stack");
+	for (i = 1; i <= j; i++)
+		ones[i] = 1;
+	fen_build(st->tree, ones, st->nr_slots);
+	memset(st->slots + st->now, 0,
+			(st->nr_slots + 1 - st->now) * sizeof(struct page *));
+	free(ones);
+}
+
+static void init_mrc_LRU(policy_t *self, unsigned long memsz)
+{
+	struct lru_stack *st = self->data;
+
+	memset(st, 0, sizeof(*st));
+	pt_init(&st->pt);
+	mrc_init(&st->mrc);
+
+	st->nr_slots = MRC_MIN_SIZE;
+	st->now = 1;
+	st->slots = calloc(st->nr_slots + 1, sizeof(struct page *));
+	st->tree = calloc(st->nr_slots + 1, sizeof(long));
+	if (!st->slots || !st->tree)
+		sim_error("Failed to allocate the LRU stack");
+}
+
+static void fini_mrc_LRU(policy_t *self)
+{
+	struct lru_stack *st = self->data;
+
+	/* Let page table freed automatically at program termination */
+	free(st->slots);
+	free(st->tree);
+	free(st->holes);
+	mrc_free(&st->mrc);
+}
+
+static int malloc_mrc_LRU(policy_t *self, unsigned long addr,
+		unsigned long size)
+{
+	self->stats.cnt[NR_MEM_ALLOC]++;
+	return 0;
+}
+
+static int mfree_mrc_LRU(policy_t *self, unsigned long addr)
+{
+	self->stats.cnt[NR_MEM_FREE]++;
+	return 0;
+}
+
+static void make_hole(struct page *page, void *arg)
+{
+	struct lru_stack *st = arg;
+
+	st->slots[page_slot(page)] = &hole_page;
+	push_hole(st, page_slot(page));
+}
+
+static int discard_mrc_LRU(policy_t *self, unsigned long addr,
+		unsigned long size)
+{
+	struct lru_stack *st = self->data;
+
+	__unmap_free_range(st->pt, addr, size, make_hole, st);
+	return 0;
+}
+
+static int access_mrc_LRU(policy_t *self, unsigned long vpn)
+{
+	struct lru_stack *st = self->data;
+	unsigned long addr = vpn_to_addr(vpn);
+	unsigned long slot, hole, full;
+	struct page *page;
+
+	if (st->now > st->nr_slots)
+		compact_stack(st);
+
+	page = pt_walk(st->pt, addr);
+	if (!page) {
+		page = map_alloc_page(st->pt, addr);
+		if (st->nr_holes)
+			vacate_slot(st, pop_hole(st));
+	} else {
+		slot = page_slot(page);
+		mrc_hit(&st->mrc, st->depth - fen_sum(st->tree, slot - 1), 1);
+
+		if (st->nr_holes && st->holes[0] > slot) {
+			hole = st->holes[0];
+			st->holes[0] = slot;
+			hole_down(st, 0);
+			st->slots[slot] = &hole_page;
+			vacate_slot(st, hole);
+		} else {
+			vacate_slot(st, slot);
+		}
+	}
+
+	st->slots[st->now] = page;
+	page->private = (void *)st->now;
+	fen_add(st->tree, st->nr_slots, st->now++, 1);
+	st->depth++;
+	st->mrc.nr_ref++;
+	if (st->depth > st->mrc.max_pages)
+		st->mrc.max_pages = st->depth;
+
+	/* the memories above the most recent hole are full */
+	full = st->depth;
+	if (st->nr_holes)
+		full -= fen_sum(st->tree, st->holes[0] - 1) + 1;
+	mrc_fill(&st->mrc, full);
+
+	policy_count_stat(self, NR_TOTAL, 1);
+	return 0;
+}
+
+static struct lru_stack lru_stack;
+static policy_t mrc_LRU = {
+	.name = "lru",
+	.init = init_mrc_LRU,
+	.fini = fini_mrc_LRU,
+	.access = access_mrc_LRU,
+	.mem_alloc = malloc_mrc_LRU,
+	.mem_free = mfree_mrc_LRU,
+	.mem_discard = discard_mrc_LRU,
+	.data = &lru_stack,
+};
+
+/*
+ * OPT stack
+ *
+ * The references are recorded as page ids, and the time of the next
+ * reference to the page of each is found in a backward pass. The stack is
+ * then updated forward as by Mattson et al.: the page referenced moves to the
+ * top, and the pages above its old position that are referenced later than
+ * every page above them (the records) move down to the position of the next
+ * record, the last to that of the page referenced; the others stay. The top
+ * C pages are then those kept by OPT in C pages.
+ *
+ * The records come in runs of pages referenced in increasing order (the
+ * stack is nearly sorted deep down), so the stack is a treap by position,
+ * with the max next reference time and the descents (a page referenced
+ * later than the next one) of each subtree. A run is found and moved in
+ * O(log n), and so a reference takes O(log n) for each run.
+ *
+ * Consecutive references to a page hit at the top, and are only counted.
+ */
+#define NEVER					(~0UL)
+
+struct opt_run {
+	unsigned long first;
+	unsigned long last;
+};
+
+struct opt_stack {
+	pt_t *pt;
+	unsigned int *refs;				/* page ids */
+	unsigned long nr_refs;
+	unsigned long refs_size;
+	unsigned long nr_pages;
+	struct page *last;
+	long nr_repeat;					/* of the last page */
+	unsigned long *next;			/* next reference time of each reference */
+
+	/* treap of the pages in the stack; node n is page n - 1, 0 is none */
+	unsigned long *next_ref;
+	unsigned long *max_ref;
+	unsigned int *left;
+	unsigned int *right;
+	unsigned int *parent;
+	unsigned int *size;
+	unsigned int *nr_desc;
+	unsigned int *prio;
+	bool *desc;						/* referenced later than the next page */
+	unsigned int root;
+
+	struct opt_run *runs;
+	unsigned int *pieces;
+	unsigned long runs_size;
+
+	struct mrc mrc;
+};
+
+static void pull(struct opt_stack *st, unsigned int n)
+{
+	unsigned int l = st->left[n], r = st->right[n];
+
+	st->size[n] = 1 + st->size[l] + st->size[r];
+	st->nr_desc[n] = st->desc[n] + st->nr_desc[l] + st->nr_desc[r];
+	st->max_ref[n] = st->next_ref[n];
+	if (st->max_ref[l] > st->max_ref[n])
+		st->max_ref[n] = st->max_ref[l];
+	if (st->max_ref[r] > st->max_ref[n])
+		st->max_ref[n] = st->max_ref[r];
+	st->parent[l] = n;
+	st->parent[r] = n;
+}
+
+/* The first k pages of t to a, the others to b */
+static void split(struct opt_stack *st, unsigned int t, unsigned long k,
+		unsigned int *a, unsigned int *b)
+{
+	if (!t) {
+		*a = *b = 0;
+	} else if (st->size[st->left[t]] < k) {
+		split(st, st->right[t], k - st->size[st->left[t]] - 1,
+				&st->right[t], b);
+		pull(st, t);
+		*a = t;
+	} else {
+		split(st, st->left[t], k, a, &st->left[t]);
+		pull(st, t);
+		*b = t;
+	}
+}
+
+static unsigned int merge(struct opt_stack *st, unsigned int a,
+		unsigned int b)
+{
+	if (!a || !b)
+		return a ? a : b;
+
+	if (st->prio[a] > st->prio[b]) {
+		st->right[a] = merge(st, st->right[a], b);
+		pull(st, a);
+		return a;
+	}
+
+	st->left[b] = merge(st, a, st->left[b]);
+	pull(st, b);
+	return b;
+}
+
+static unsigned long position(struct opt_stack *st, unsigned int n)
+{
+	unsigned long pos = st->size[st->left[n]] + 1;
+
+	for (; st->parent[n]; n = st->parent[n]) {
+		if (st->right[st->parent[n]] == n)
+			pos += st->size[st->left[st->parent[n]]] + 1;
+	}
+
+	return pos;
+}
+
+static unsigned int page_at(struct opt_stack *st, unsigned long pos)
+{
+	unsigned int n = st->root;
+
+	while (pos != st->size[st->left[n]] + 1) {
+		if (pos <= st->size[st->left[n]]) {
+			n = st->left[n];
+		} else {
+			pos -= st->size[st->left[n]] + 1;
+			n = st->right[n];
+		}
+	}
+
+	return n;
+}
+
+/* The first position from pos in t referenced later than time, or 0 */
+static unsigned long find_later(struct opt_stack *st, unsigned int t,
+		unsigned long pos, unsigned long time)
+{
+	unsigned long nr_left, found;
+
+	if (!t || st->max_ref[t] <= time)
+		return 0;
+
+	nr_left = st->size[st->left[t]];
+	if (pos <= nr_left &&
+			(found = find_later(st, st->left[t], pos, time)))
+		return found;
+	if (pos <= nr_left + 1 && st->next_ref[t] > time)
+		return nr_left + 1;
+
+	found = find_later(st, st->right[t], pos > nr_left + 1 ?
+			pos - nr_left - 1 : 1, time);
+	return found ? found + nr_left + 1 : 0;
+}
+
+/* The first descent from pos in t, or 0 */
+static unsigned long find_desc(struct opt_stack *st, unsigned int t,
+		unsigned long pos)
+{
+	unsigned long nr_left, found;
+
+	if (!t || !st->nr_desc[t])
+		return 0;
+
+	nr_left = st->size[st->left[t]];
+	if (pos <= nr_left && (found = find_desc(st, st->left[t], pos)))
+		return found;
+	if (pos <= nr_left + 1 && st->desc[t])
+		return nr_left + 1;
+
+	found = find_desc(st, st->right[t], pos > nr_left + 1 ?
+			pos - nr_left - 1 : 1);
+	return found ? found + nr_left + 1 : 0;
+}
+
+/* Set the descent of the last page of t, which is followed by next */
+static void set_last_desc(struct opt_stack *st, unsigned int t,
+		unsigned int next)
+{
+	if (st->right[t])
+		set_last_desc(st, st->right[t], next);
+	else
+		st->desc[t] = next && st->next_ref[next] < st->next_ref[t];
+	pull(st, t);
+}
+
+static unsigned int first_page(struct opt_stack *st, unsigned int t)
+{
+	while (st->left[t])
+		t = st->left[t];
+
+	return t;
+}
+
+static void init_mrc_OPT(policy_t *self, unsigned long memsz)
+{
+	struct opt_stack *st = self->data;
+
+	memset(st, 0, sizeof(*st));
+	pt_init(&st->pt);
+	mrc_init(&st->mrc);
+}
+
+static void fini_mrc_OPT(policy_t *self)
+{
+	struct opt_stack *st = self->data;
+
+	/* Let page table freed automatically at program termination */
+	free(st->refs);
+	free(st->next);
+	free(st->next_ref);
+	free(st->max_ref);
+	free(st->left);
+	free(st->right);
+	free(st->parent);
+	free(st->size);
+	free(st->nr_desc);
+	free(st->prio);
+	free(st->desc);
+	free(st->runs);
+	free(st->pieces);
+	mrc_free(&st->mrc);
+}
+
+static int malloc_mrc_OPT(policy_t *self, unsigned long addr,
+		unsigned long size)
+{
+	self->stats.cnt[NR_MEM_ALLOC]++;
+	return 0;
+}
+
+static int mfree_mrc_OPT(policy_t *self, unsigned long addr)
+{
+	self->stats.cnt[NR_MEM_FREE]++;
+	return 0;
+}
+
+static int access_mrc_OPT(policy_t *self, unsigned long vpn)
+{
+	struct opt_stack *st = self->data;
+	unsigned long addr = vpn_to_addr(vpn);
+	struct page *page;
+
+	policy_count_stat(self, NR_TOTAL, 1);
+
+	page = pt_walk(st->pt, addr);
+	if (page && page == st->last) {
+		st->nr_repeat++;
+		return 0;
+	}
+
+	if (!page) {
+		if (st->nr_pages >= 0xffffffffUL)
+			sim_error("Too many pages");
+		page = map_alloc_page(st->pt, addr);
+		page->private = (void *)st->nr_pages++;
+	}
+
+	if (st->nr_refs == st->refs_size) {
+		st->refs_size = st->refs_size ? st->refs_size * 2 : MRC_MIN_SIZE;
+		st->refs = realloc(st->refs, st->refs_size * sizeof(unsigned int));
+		if (!st->refs)
+			sim_error("Failed to allocate the references");
+	}
+	st->refs[st->nr_refs++] = (unsigned long)page->private;
+	st->last = page;
+
+	return 0;
+}
+
+static void alloc_opt_stack(struct opt_stack *st)
+{
+	unsigned long nr = st->nr_pages + 1;
+	unsigned int seed = 1, n;
+
+	st->next = malloc(st->nr_refs * sizeof(unsigned long) + 1);
+	st->next_ref = calloc(nr, sizeof(unsigned long));
+	st->max_ref = calloc(nr, sizeof(unsigned long));
+	st->left = calloc(nr, sizeof(unsigned int));
+	st->right = calloc(nr, sizeof(unsigned int));
+	st->parent = calloc(nr, sizeof(unsigned int));
+	st->size = calloc(nr, sizeof(unsigned int));
+	st->nr_desc = calloc(nr, sizeof(unsigned int));
+	st->prio = malloc(nr * sizeof(unsigned int));
+	st->desc = calloc(nr, sizeof(bool));
+	st->runs_size = 1024;
+	st->runs = malloc(st->runs_size * sizeof(struct opt_run));
+	st->pieces = malloc((3 * st->runs_size + 2) * sizeof(unsigned int));
+	if (!st->runs || !st->pieces || !st->next || !st->next_ref || !st->max_ref || !st->left ||
+			!st->right || !st->parent || !st->size || !st->nr_desc ||
+			!st->prio || !st->desc)
+		sim_error("Failed to allocate the OPT stack");
+
+	/* xorshift, so that the runs are the same */
+	for (n = 0; n < nr; n++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		st->prio[n] = seed;
+	}
+}
+
+static void add_run(struct opt_stack *st, unsigned long nr_runs,
+		unsigned long first, unsigned long last)
+{
+	if (nr_runs == st->runs_size) {
+		st->runs_size *= 2;
+		st->runs = realloc(st->runs, st->runs_size * sizeof(struct opt_run));
+		st->pieces = realloc(st->pieces,
+				(3 * st->runs_size + 2) * sizeof(unsigned int));
+		if (!st->runs || !st->pieces)
+			sim_error("Failed to allocate the OPT stack");
+	}
+
+	st->runs[nr_runs].first = first;
+	st->runs[nr_runs].last = last;
+}
+
+/* Move the page n at pos to the top, and the records above it down */
+static void update_opt_stack(struct opt_stack *st, unsigned int n,
+		unsigned long pos, unsigned long next_ref)
+{
+	unsigned long nr_runs = 0, first = 1, last, i;
+	unsigned int *pieces, top, rest;
+
+	/* n is referenced first, so a run of records ends above it */
+	while (first < pos) {
+		last = find_desc(st, st->root, first);
+		add_run(st, nr_runs++, first, last);
+		first = find_later(st, st->root, last + 1,
+				st->next_ref[page_at(st, last)]);
+		if (!first || first >= pos)
+			first = pos;
+	}
+
+	/*
+	 * n, and the run but its last page, the pages after the run and the
+	 * last page of the run for each run, in the order of the new stack
+	 */
+	pieces = st->pieces;
+	split(st, st->root, pos - 1, &top, &rest);
+	split(st, rest, 1, &pieces[0], &rest);
+	for (i = nr_runs; i--; ) {
+		first = st->runs[i].first;
+		last = st->runs[i].last;
+
+		split(st, top, last, &top, &pieces[3 * i + 2]);
+		split(st, top, last - 1, &top, &pieces[3 * i + 3]);
+		split(st, top, first - 1, &top, &pieces[3 * i + 1]);
+	}
+
+	st->next_ref[n] = next_ref;
+	pull(st, n);
+
+	for (i = 3 * nr_runs + 1; i--; ) {
+		if (!pieces[i])
+			continue;
+		set_last_desc(st, pieces[i], rest ? first_page(st, rest) : 0);
+		rest = merge(st, pieces[i], rest);
+	}
+
+	st->root = rest;
+	st->parent[rest] = 0;
+}
+
+/* Add the page n referenced first at the bottom */
+static unsigned long push_opt_stack(struct opt_stack *st, unsigned int n,
+		unsigned long time)
+{
+	st->next_ref[n] = time;
+	pull(st, n);
+
+	if (st->root)
+		set_last_desc(st, st->root, n);
+	st->root = merge(st, st->root, n);
+	st->parent[st->root] = 0;
+
+	return st->size[st->root];
+}
+
+static void post_sim_mrc_OPT(policy_t *self)
+{
+	struct opt_stack *st = self->data;
+	unsigned long t, pos;
+	unsigned int id, n;
+
+	alloc_opt_stack(st);
+
+	for (id = 0; id < st->nr_pages; id++)
+		st->next_ref[id + 1] = NEVER;
+	for (t = st->nr_refs; t--; ) {
+		n = st->refs[t] + 1;
+		st->next[t] = st->next_ref[n];
+		st->next_ref[n] = t;
+	}
+
+	/* the page referenced is referenced first of the pages in the stack */
+	for (t = 0; t < st->nr_refs; t++) {
+		n = st->refs[t] + 1;
+		st->mrc.nr_ref++;
+
+		if (st->size[n]) {
+			pos = position(st, n);
+			mrc_hit(&st->mrc, pos, 1);
+		} else {
+			pos = push_opt_stack(st, n, t);
+			st->mrc.max_pages = pos;
+		}
+
+		update_opt_stack(st, n, pos, st->next[t]);
+		mrc_fill(&st->mrc, st->size[st->root]);
+	}
+
+	/* the repeated references hit at the top */
+	mrc_hit(&st->mrc, 1, st->nr_repeat);
+	st->mrc.nr_ref += st->nr_repeat;
+}
+
+static struct opt_stack opt_stack;
+static policy_t mrc_OPT = {
+	.name = "opt",
+	.init = init_mrc_OPT,
+	.fini = fini_mrc_OPT,
+	.access = access_mrc_OPT,
+	.mem_alloc = malloc_mrc_OPT,
+	.mem_free = mfree_mrc_OPT,
+	.post_sim = post_sim_mrc_OPT,
+	.data = &opt_stack,
+};
+
+static struct {
+	policy_t *policy;
+	struct mrc *mrc;
+} mrc_policies[] = {
+	{ &mrc_LRU, &lru_stack.mrc },
+	{ &mrc_OPT, &opt_stack.mrc },
+};
+
+#define NR_MRC_POLICIES		(sizeof(mrc_policies) / sizeof(mrc_policies[0]))
+
+static void print_row(policy_t *policy, struct mrc *mrc,
+		unsigned long nr_pages, long hits)
+{
+	struct sim_stats *stats = &policy->stats;
+	long total = stats->cnt[NR_TOTAL];
+	long inst = stats->cnt[NR_INST];
+	long miss = mrc->nr_ref - hits;
+	long cold = nr_pages <= mrc->nr_full ? mrc->cold[nr_pages] : miss;
+
+	printf("%lu\t%lu\t%ld\t%ld\t%.4lf\t", vpn_to_addr(nr_pages) >> 10,
+			nr_pages, miss, cold, total ? (double) miss / total * 100 : 0);
+	if (inst)
+		printf("%.2lf\n", (double) (miss - cold) / inst * 1000000);
+	else
+		printf("-\n");
+}
+
+/* A row per number of pages, up to the first that never evicts */
+static void report_mrc(policy_t *policy, struct mrc *mrc,
+		unsigned long *sizes, int nr_sizes)
+{
+	struct sim_stats *stats = &policy->stats;
+	unsigned long nr_pages;
+	long hits = 0;
+	int i;
+
+	printf("policy\t%s\n", policy->name);
+	printf("nr_total\t%ld\n", stats->cnt[NR_TOTAL]);
+	printf("nr_inst\t%ld\n", stats->cnt[NR_INST]);
+	if (verbose) {
+		printf("nr_mem_alloc\t%ld\n", stats->cnt[NR_MEM_ALLOC]);
+		printf("nr_mem_free\t%ld\n", stats->cnt[NR_MEM_FREE]);
+	}
+	printf("memsz(kB)\tpages\tnr_miss\tnr_cold_miss\tmiss_ratio(%%)\t"
+			"miss_rate(mpmi)\n");
+
+	if (nr_sizes) {
+		for (i = 0; i < nr_sizes; i++)
+			print_row(policy, mrc, sizes[i], mrc_hits(mrc, sizes[i]));
+		return;
+	}
+
+	for (nr_pages = 1; nr_pages <= mrc->max_pages; nr_pages++) {
+		if (nr_pages <= mrc->size)
+			hits += mrc->hist[nr_pages];
+		print_row(policy, mrc, nr_pages, hits);
+	}
+}
+
+static void wrong_mrc_args(char **argv)
+{
+	int i;
+
+	printf("usage: %s mrc <policy> <trace file> [<memory size (kB)> ...] "
+			"[-v] [-p]\n", argv[0]);
+	printf("policies:");
+	for (i = 0; i < (int)NR_MRC_POLICIES; i++)
+		printf(" %s", mrc_policies[i].policy->name);
+	printf("\n");
+	exit(1);
+}
+
+int mrc_main(int argc, char **argv)
+{
+	unsigned long *sizes;
+	struct trace *trace;
+	policy_t *policy = NULL;
+	struct mrc *mrc = NULL;
+	int i, nr_sizes = 0;
+
+	if (argc < 4)
+		wrong_mrc_args(argv);
+
+	for (i = 0; i < (int)NR_MRC_POLICIES; i++) {
+		if (!strcmp(argv[2], mrc_policies[i].policy->name)) {
+			policy = mrc_policies[i].policy;
+			mrc = mrc_policies[i].mrc;
+		}
+	}
+	if (!policy)
+		wrong_mrc_args(argv);
+
+	sizes = malloc(argc * sizeof(unsigned long));
+	if (!sizes)
+		sim_error("Failed to allocate the sizes");
+
+	for (i = 4; i < argc; i++) {
+		if (!strcmp(argv[i], "-v"))
+			verbose = true;
+		else if (!strcmp(argv[i], "-p"))
+			pipelined = true;
+		else if (argv[i][0] >= '0' && argv[i][0] <= '9' &&
+				(sizes[nr_sizes] = (atol(argv[i]) * 1024) >> PAGE_SHIFT))
+			nr_sizes++;
+		else
+			wrong_mrc_args(argv);
+	}
+
+	trace = trace_open(argv[3]);
+
+	/* the engines keep their stacks in static data: a single instance */
+	policy = new_policy(policy);
+	init_policy(policy, 0);
+
+	simulate(policy, trace);
+	post_sim(policy);
+	report_mrc(policy, mrc, sizes, nr_sizes);
+
+	fini_policy(policy);
+	trace_close(trace);
+	free(sizes);
+
+	return 0;
+}
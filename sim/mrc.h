@@ -0,0 +1,14 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _MRC_H
+#define _MRC_H
+
+/*
+ * sim mrc <policy> <trace file> [<memory size (kB)> ...] [-p]
+ *
+ * Simulates a stack algorithm once for every memory size, and prints the
+ * misses of each number of pages (or of the sizes given), with the cold
+ * misses counted as report() does.
+ */
+int mrc_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,120 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sim.h"
+#include "trace.h"
+#include "decoder.h"
+#include "multi.h"
+
+/*
+ * Multi-policy runs
+ *
+ * The decoder thread reads and decodes the trace once, and broadcasts the
+ * batches of events to an instance of each policy, simulated in a thread of
+ * its own. An instance has its own data and state of sim (mapped areas,
+ * sampling and refaults), so the results are those of separate runs. The
+ * instances are initialized, reported and finalized in the main thread, in
+ * the order given.
+ */
+
+struct multi_run {
+	policy_t *policy;
+	struct decoder *dec;
+	int consumer;
+	pthread_t thread;
+};
+
+static void *multi_thread(void *arg)
+{
+	struct multi_run *run = arg;
+
+	simulate_decoded(run->policy, run->dec, run->consumer);
+	post_sim(run->policy);
+
+	return NULL;
+}
+
+static void wrong_multi_args(char **argv)
+{
+	printf("usage: %s multi <policy>,<policy>[,...] <memory size (kB)> "
+			"<trace file> [-v] [-s] [-r]\n", argv[0]);
+	exit(1);
+}
+
+int multi_main(int argc, char **argv)
+{
+	struct multi_run *runs;
+	struct decoder *dec;
+	struct trace *trace;
+	unsigned long memsz;
+	policy_t *tmpl;
+	char *name;
+	int i, nr_runs = 1;
+
+	if (argc < 5)
+		wrong_multi_args(argv);
+
+	for (i = 5; i < argc; i++) {
+		if (!strcmp(argv[i], "-v"))
+			verbose = true;
+		else if (!strcmp(argv[i], "-s"))
+			policy_stat = true;
+		else if (!strcmp(argv[i], "-r"))
+			refault_stat = true;
+		else
+			wrong_multi_args(argv);
+	}
+
+	for (name = argv[2]; *name; name++)
+		nr_runs += *name == ',';
+	if (nr_runs > DECODER_MAX_CONSUMERS)
+		sim_error("Too many policies");
+
+	runs = calloc(nr_runs, sizeof(struct multi_run));
+	if (!runs)
+		sim_error("Failed to allocate the policies");
+
+	init_policy_list();
+	nr_runs = 0;
+	for (name = strtok(argv[2], ","); name; name = strtok(NULL, ",")) {
+		tmpl = search_policy(name);
+		if (!tmpl) {
+			printf("No matching policy: %s\n", name);
+			exit(1);
+		}
+		runs[nr_runs++].policy = new_policy(tmpl);
+	}
+	if (!nr_runs)
+		wrong_multi_args(argv);
+
+	memsz = atoi(argv[3]);
+	trace = trace_open(argv[4]);
+
+	for (i = 0; i < nr_runs; i++)
+		init_policy(runs[i].policy, memsz);
+
+	dec = decoder_start(trace, nr_runs);
+	for (i = 0; i < nr_runs; i++) {
+		runs[i].dec = dec;
+		runs[i].consumer = i;
+		if (pthread_create(&runs[i].thread, NULL, multi_thread, &runs[i]))
+			sim_error("Failed to start the policies");
+	}
+
+	for (i = 0; i < nr_runs; i++)
+		pthread_join(runs[i].thread, NULL);
+	decoder_stop(dec);
+
+	for (i = 0; i < nr_runs; i++) {
+		printf("policy\t%s\n", runs[i].policy->name);
+		report(runs[i].policy);
+		fini_policy(runs[i].policy);
+	}
+
+	trace_close(trace);
+	free(runs);
+
+	return 0;
+}
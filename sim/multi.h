@@ -0,0 +1,14 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _MULTI_H
+#define _MULTI_H
+
+/*
+ * sim multi <policy>,<policy>[,...] <memory size (kB)> <trace file>
+ *     [-v] [-s] [-r]
+ *
+ * Simulates the policies over a single read of the trace, each in a thread
+ * of its own, and prints the report of each as sim does.
+ */
+int multi_main(int argc, char **argv);
+
+#endif
@@ -1,16 +1,20 @@
 /* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "alifo.h"
 #include "../lib/refault.h"
+#include "../lib/checkpoint.h"
 
 void init_aLIFO(policy_t *self, unsigned long memsz);
 void fini_aLIFO(policy_t *self);
 int malloc_aLIFO(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_aLIFO(policy_t *self, unsigned long addr);
 int access_aLIFO(policy_t *self, unsigned long addr);
+int save_aLIFO(policy_t *self, FILE *file);
+int restore_aLIFO(policy_t *self, FILE *file);
+int param_aLIFO(policy_t *self, const char *name, double value);
 
-data_aLIFO_t data_aLIFO;
 policy_t policy_aLIFO = {
 	.name = "alifo",
 	.init = init_aLIFO,
@@ -18,16 +22,14 @@ policy_t policy_aLIFO = {
 	.access = access_aLIFO,
 	.mem_alloc = malloc_aLIFO,
 	.mem_free = mfree_aLIFO,
-	.data = &data_aLIFO,
+	.save = save_aLIFO,
+	.restore = restore_aLIFO,
+	.set_param = param_aLIFO,
+	.data_size = sizeof(data_aLIFO_t),
 };
 
-#define MAX_POW_BIT					64
-
-/* pow_val[x] := base^(2^x) */
-double pow_val[MAX_POW_BIT];
-
 static void
-spow_init(double base)
+spow_init(double *pow_val, double base)
 {
 	int i;
 
@@ -38,7 +40,7 @@ spow_init(double base)
 
 /* O(log N) implementation of power algorithm */
 static double
-spow(double base, unsigned long power)
+spow(const double *pow_val, double base, unsigned long power)
 {
 	double res = 1;
 	int bit;
@@ -55,8 +57,6 @@ spow(double base, unsigned long power)
 
 /* RL control meta data */
 #define INITIAL_WEIGHT 0.5
-long double learning_rate;
-double discount_rate;
 
 
 /*
@@ -152,7 +152,7 @@ vevict_page(struct page *page, int policy)
 static void
 pevict_page(struct page *page, int policy)
 {
-	data_aLIFO_t *data = &data_aLIFO;
+	data_aLIFO_t *data = page_pol(page)->data;
 	pol_t *pol = page_pol(page);
 
 	page_evicted(page) = true;
@@ -478,12 +478,13 @@ score(pol_t *pol, unsigned long stime, int winner)
 	*/
 	double reward;
 	double long temp;
-	reward = spow(discount_rate, stime - pol->last_stime);
+	reward = spow(pol->data->pow_val, pol->data->discount_rate,
+			stime - pol->last_stime);
 	reward *= -1;
 	if (winner == LIFO)
-		pol->clock_weight *= exp(learning_rate * reward);
+		pol->clock_weight *= exp(pol->data->learning_rate * reward);
 	else
-		pol->lifo_weight *= exp(learning_rate * reward);
+		pol->lifo_weight *= exp(pol->data->learning_rate * reward);
 	// sum is 1
 	temp = pol->lifo_weight + pol->clock_weight;
 	pol->lifo_weight = pol->lifo_weight / temp;
@@ -517,7 +518,7 @@ score(pol_t *pol, unsigned long stime, int winner)
 static void
 remove_page(struct page *page)
 {
-	data_aLIFO_t *data = &data_aLIFO;
+	data_aLIFO_t *data = page_pol(page)->data;
 	pol_t *pol = page_pol(page);
 
 	if (pol->reclaim_head == &page->entry)
@@ -765,20 +766,21 @@ pol_stat_init(pol_stat_t **stat)
 }
 
 static void
-pol_init(pol_t **pol)
+pol_init(pol_t **pol, data_aLIFO_t *data)
 {
 	*pol = malloc(sizeof(pol_t));
 	(*pol)->nr_present = 0;
 	(*pol)->nr_entry = 0;
 
 	pol_stat_init(&(*pol)->stat);
+	(*pol)->data = data;
 
 	(*pol)->reclaim_head = &(*pol)->page_list;
 	INIT_LIST_HEAD(&(*pol)->page_list);
 
 	(*pol)->time = 0;
 	(*pol)->last_stime = 0;
-	(*pol)->decay = DECAY_FACTOR_DEFAULT;
+	(*pol)->decay = data->decay;
 	(*pol)->lifo_weight = INITIAL_WEIGHT; 
 	(*pol)->clock_weight = INITIAL_WEIGHT; 
 	(*pol)->lifo = false;
@@ -786,7 +788,7 @@ pol_init(pol_t **pol)
 
 static void
 mem_area_init(mem_area_t **ma, unsigned long req_start, unsigned long req_end,
-		unsigned long start, unsigned long end)
+		unsigned long start, unsigned long end, data_aLIFO_t *data)
 {
 	*ma = malloc(sizeof(mem_area_t));
 	(*ma)->req_start = req_start;
@@ -794,7 +796,7 @@ mem_area_init(mem_area_t **ma, unsigned long req_start, unsigned long req_end,
 	(*ma)->start = start;
 	(*ma)->end = end;
 
-	pol_init(&(*ma)->pol);
+	pol_init(&(*ma)->pol, data);
 
 	(*ma)->obsolete = false;
 }
@@ -836,7 +838,7 @@ create_mem_area(data_aLIFO_t *data, unsigned long addr, unsigned long size)
 		next_entry = ma_list;
 
 	/* Alloc a new mem_area_t */
-	mem_area_init(&new, req_start, req_end, start, end);
+	mem_area_init(&new, req_start, req_end, start, end, data);
 
 	/* Add to list */
 	list_add_tail(&new->entry, next_entry);
@@ -912,21 +914,37 @@ void init_aLIFO(policy_t *self, unsigned long memsz)
 	data->nr_present = 0;
 	data->nr_ghost = 0;
 
+	rng_seed(&data->rng, self->seed);
+
 	pt_init(&data->pt);
 
 	INIT_LIST_HEAD(&data->page_list);
 	INIT_LIST_HEAD(&data->ghost_list);
 	data->reclaim_head = &data->page_list;
 
-	mem_area_init(&def_ma, 0, 0, 0, 0);
+	if (!data->decay)
+		data->decay = DECAY_FACTOR_DEFAULT;
+	spow_init(data->pow_val, data->decay);
+
+	// RL init
+	data->learning_rate = 0.30;
+	data->discount_rate = spow(data->pow_val, 0.005, 1/memsz);
+
+	mem_area_init(&def_ma, 0, 0, 0, 0, data);
 	data->def_ma = def_ma;
 	INIT_LIST_HEAD(&data->ma_list);
+}
 
-	spow_init(DECAY_FACTOR_DEFAULT);
+/* The decay factor of the rewards, in (0, 1) */
+int param_aLIFO(policy_t *self, const char *name, double value)
+{
+	data_aLIFO_t *data = self->data;
 
-	// RL init
-	learning_rate = 0.30;
-	discount_rate = spow(0.005, 1/memsz);
+	if (strcmp(name, "decay") || value <= 0 || value >= 1)
+		return -1;
+
+	data->decay = value;
+	return 0;
 }
 
 void fini_aLIFO(policy_t *self)
@@ -935,7 +953,7 @@ void fini_aLIFO(policy_t *self)
 	if (!refault_stat)
 		goto skip_refault;
 
-	printf("refault dist (avg): %E\n", avg_refault_dist());
+	printf("refault dist (avg): %E\n", avg_refault_dist(self->refault));
 
 skip_refault:
 	if (!policy_stat)
@@ -1172,9 +1190,8 @@ pol_victim_lifo(pol_t *pol)
 static inline void
 get_lifo_score(pol_t* pol)
 {
-	double long num;
-	srand(time(0));
-	num = rand() / (double long)RAND_MAX;
+	double long num = rng_double(&pol->data->rng);
+
 	// Exploration Code for RL
 	//TODO: optimize it
 	//if (pol->clock_weight > pol->lifo_weight && pol->clock_weight > num)
@@ -1234,9 +1251,9 @@ void evict_page_aLIFO(policy_t *self)
 	lifo_victim = pol_victim_lifo(pol);
 
 	if (pol_lifo(pol))
-		reg_evict(lifo_victim->addr);
+		reg_evict(self->refault, lifo_victim->addr);
 	else
-		reg_evict(clock_victim->addr);
+		reg_evict(self->refault, clock_victim->addr);
 
 	evict_victims(data, pol, clock_victim, lifo_victim);
 
@@ -1316,7 +1333,7 @@ page_fault_aLIFO(policy_t *self, unsigned long addr, struct page *page)
 	if (debug)
 		printf("MISS\n");
 
-	reg_fault(addr);
+	reg_fault(self->refault, addr);
 
 	if (page) {
 		if (page_present(page)) {
@@ -1359,7 +1376,7 @@ int access_aLIFO(policy_t *self, unsigned long vpn)
 	unsigned long addr = vpn_to_addr(vpn);
 	struct page *page;
 
-	cnt_access(1);
+	cnt_access(self->refault, 1);
 
 	page = pt_walk(pt, addr);
 
@@ -1373,3 +1390,182 @@ int access_aLIFO(policy_t *self, unsigned long vpn)
 	policy_count_stat(self, NR_TOTAL, 1);
 	return 0;
 }
+
+/*
+ * Checkpoint
+ *
+ * The pols are named by their ids: the default one, those of the memory
+ * areas in the list, and those of the freed areas still holding pages.
+ * The ghosts evicted by CLOCK are out of the global list, so they are
+ * linked in a list of their own through rentry (unused otherwise) while
+ * the pages are written or read. The decay factor is a parameter, not a
+ * state, so a checkpoint is restored with that of the run (-param decay=).
+ */
+static void save_pol(FILE *file, pol_t *pol)
+{
+	ckpt_write(file, pol, offsetof(pol_t, stat));
+	ckpt_write(file, pol->stat, sizeof(pol_stat_t));
+	ckpt_write(file, &pol->time, sizeof(pol_t) - offsetof(pol_t, time));
+}
+
+static void restore_pol(FILE *file, pol_t *pol)
+{
+	ckpt_read(file, pol, offsetof(pol_t, stat));
+	ckpt_read(file, pol->stat, sizeof(pol_stat_t));
+	ckpt_read(file, &pol->time, sizeof(pol_t) - offsetof(pol_t, time));
+	pol->decay = pol->data->decay;		/* of this run */
+}
+
+/* The metadata as it is, as some of it is not set until evicted */
+static void save_page_md(FILE *file, struct page *page, struct ckpt_ids *ids)
+{
+	long id = ckpt_id(ids, page_pol(page));
+
+	ckpt_write(file, page_md(page), offsetof(page_md_t, pol));
+	ckpt_write(file, &id, sizeof(id));
+}
+
+static int restore_page_md(FILE *file, struct page *page, pol_t **pols,
+		long nr_pols)
+{
+	long id;
+
+	page->private = malloc(sizeof(page_md_t));
+	ckpt_read(file, page_md(page), offsetof(page_md_t, pol));
+	ckpt_read(file, &id, sizeof(id));
+	if (id < 0 || id >= nr_pols)
+		return -1;
+	set_page_pol(page, pols[id]);
+
+	return 0;
+}
+
+static void save_pol_pages(FILE *file, pol_t *pol)
+{
+	ckpt_write_list(file, &pol->page_list, entry);
+	ckpt_write_hand(file, &pol->page_list, pol->reclaim_head, entry);
+}
+
+static void restore_pol_pages(FILE *file, pt_t *pt, pol_t *pol)
+{
+	ckpt_read_list(file, pt, &pol->page_list, entry);
+	pol->reclaim_head = ckpt_read_hand(file, pt, &pol->page_list, entry);
+}
+
+int save_aLIFO(policy_t *self, FILE *file)
+{
+	data_aLIFO_t *data = self->data;
+	struct ckpt_ids ids = CKPT_IDS_INIT;
+	struct list_head ghosts;
+	struct page *page, *n;
+	mem_area_t *ma;
+	long nr[2], i;
+
+	ckpt_write(file, data, offsetof(data_aLIFO_t, def_ma));
+	ckpt_write(file, data->mem_stat, sizeof(mem_stat_t));
+
+	INIT_LIST_HEAD(&ghosts);
+	list_for_each_entry(page, &data->ghost_list, centry) {
+		if (list_empty(&page->gentry))
+			list_add_tail(&page->rentry, &ghosts);
+	}
+
+	ckpt_ids_add(&ids, data->def_ma->pol);
+	list_for_each_entry(ma, &data->ma_list, entry)
+		ckpt_ids_add(&ids, ma->pol);
+	nr[0] = ids.nr;
+	list_for_each_entry(page, &data->page_list, gentry) {
+		if (ckpt_id(&ids, page_pol(page)) < 0)
+			ckpt_ids_add(&ids, page_pol(page));
+	}
+	list_for_each_entry(page, &ghosts, rentry) {
+		if (ckpt_id(&ids, page_pol(page)) < 0)
+			ckpt_ids_add(&ids, page_pol(page));
+	}
+	nr[1] = ids.nr - nr[0];
+	ckpt_write(file, nr, sizeof(nr));
+
+	save_pol(file, data->def_ma->pol);
+	list_for_each_entry(ma, &data->ma_list, entry) {
+		ckpt_write(file, ma, offsetof(mem_area_t, entry));
+		ckpt_write(file, &ma->obsolete, sizeof(bool));
+		save_pol(file, ma->pol);
+	}
+	for (i = nr[0]; i < ids.nr; i++)
+		save_pol(file, (pol_t *)ids.ptrs[i]);
+
+	ckpt_write_pages(file, &data->page_list, gentry);
+	ckpt_write_pages(file, &ghosts, rentry);
+	list_for_each_entry(page, &data->page_list, gentry)
+		save_page_md(file, page, &ids);
+	list_for_each_entry_safe(page, n, &ghosts, rentry) {
+		save_page_md(file, page, &ids);
+		list_del_init(&page->rentry);
+	}
+
+	ckpt_write_hand(file, &data->page_list, data->reclaim_head, gentry);
+	ckpt_write_list(file, &data->ghost_list, centry);
+	for (i = 0; i < ids.nr; i++)
+		save_pol_pages(file, (pol_t *)ids.ptrs[i]);
+
+	ckpt_ids_free(&ids);
+	return 0;
+}
+
+int restore_aLIFO(policy_t *self, FILE *file)
+{
+	data_aLIFO_t *data = self->data;
+	struct list_head ghosts;
+	struct page *page, *n;
+	mem_area_t *ma;
+	pol_t **pols;
+	long nr[2], i;
+
+	ckpt_read(file, data, offsetof(data_aLIFO_t, def_ma));
+	ckpt_read(file, data->mem_stat, sizeof(mem_stat_t));
+
+	ckpt_read(file, nr, sizeof(nr));
+	if (nr[0] < 1 || nr[1] < 0)
+		return -1;
+
+	pols = malloc((nr[0] + nr[1]) * sizeof(pol_t *));
+	if (!pols)
+		return -1;
+
+	pols[0] = data->def_ma->pol;
+	restore_pol(file, pols[0]);
+	for (i = 1; i < nr[0]; i++) {
+		mem_area_init(&ma, 0, 0, 0, 0, data);
+		ckpt_read(file, ma, offsetof(mem_area_t, entry));
+		ckpt_read(file, &ma->obsolete, sizeof(bool));
+		restore_pol(file, ma->pol);
+		list_add_tail(&ma->entry, &data->ma_list);
+		pols[i] = ma->pol;
+	}
+	for (; i < nr[0] + nr[1]; i++) {
+		pol_init(&pols[i], data);
+		restore_pol(file, pols[i]);
+	}
+
+	INIT_LIST_HEAD(&ghosts);
+	ckpt_read_pages(file, data->pt, &data->page_list, gentry);
+	ckpt_read_pages(file, data->pt, &ghosts, rentry);
+	list_for_each_entry(page, &data->page_list, gentry) {
+		if (restore_page_md(file, page, pols, nr[0] + nr[1]))
+			return -1;
+	}
+	list_for_each_entry_safe(page, n, &ghosts, rentry) {
+		if (restore_page_md(file, page, pols, nr[0] + nr[1]))
+			return -1;
+		list_del_init(&page->rentry);
+	}
+
+	data->reclaim_head = ckpt_read_hand(file, data->pt, &data->page_list,
+			gentry);
+	ckpt_read_list(file, data->pt, &data->ghost_list, centry);
+	for (i = 0; i < nr[0] + nr[1]; i++)
+		restore_pol_pages(file, data->pt, pols[i]);
+
+	free(pols);
+	return 0;
+}
@@ -5,9 +5,13 @@
 #include "../sim.h"
 #include "../lib/pgtable.h"
 #include "../lib/avltree.h"
+#include "../lib/rng.h"
 
 #define MEM_AREA_THRESHOLD			(PAGE_SIZE * 10)
+#ifndef DECAY_FACTOR_DEFAULT
 #define DECAY_FACTOR_DEFAULT		0.9
+#endif
+#define MAX_POW_BIT					64
 
 enum chal_policy {
 	DRAW = 0,
@@ -36,10 +40,13 @@ typedef struct {
 	unsigned long draw;
 } pol_stat_t;
 
+struct data_aLIFO;
+
 typedef struct {
 	unsigned long nr_present;
 	unsigned long nr_entry;
 	pol_stat_t *stat;
+	struct data_aLIFO *data;		/* of the policy instance */
 
 	struct list_head *reclaim_head;
 	struct list_head page_list;
@@ -68,11 +75,14 @@ typedef struct {
 	bool obsolete;
 } mem_area_t;
 
-typedef struct {
+typedef struct data_aLIFO {
 	unsigned long nr_pages;
 	unsigned long nr_present;
 	unsigned long nr_ghost;
 
+	/* of the exploration, seeded by the instance; saved in checkpoints */
+	struct rng rng;
+
 	mem_area_t *def_ma;
 	struct list_head ma_list;
 	mem_stat_t *mem_stat;
@@ -82,6 +92,15 @@ typedef struct {
 	struct list_head *reclaim_head;
 	struct list_head page_list;
 	struct list_head ghost_list;
+
+	/* RL control meta data */
+	long double learning_rate;
+	double discount_rate;
+
+	/* a parameter (-param decay=<f>), not saved in checkpoints */
+	double decay;
+	/* pow_val[x] := decay^(2^x) */
+	double pow_val[MAX_POW_BIT];
 } data_aLIFO_t;
 
 #endif
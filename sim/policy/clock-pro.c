@@ -3,14 +3,16 @@
 #include <stdlib.h>
 #include "clock-pro.h"
 #include "../lib/refault.h"
+#include "../lib/checkpoint.h"
 
 void init_CLOCK_Pro(policy_t *self, unsigned long memsz);
 void fini_CLOCK_Pro(policy_t *self);
 int malloc_CLOCK_Pro(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_CLOCK_Pro(policy_t *self, unsigned long addr);
 int access_CLOCK_Pro(policy_t *self, unsigned long addr);
+int save_CLOCK_Pro(policy_t *self, FILE *file);
+int restore_CLOCK_Pro(policy_t *self, FILE *file);
 
-data_CLOCK_Pro_t data_CLOCK_Pro;
 policy_t policy_CLOCK_Pro = {
 	.name = "clock-pro",
 	.init = init_CLOCK_Pro,
@@ -18,7 +20,9 @@ policy_t policy_CLOCK_Pro = {
 	.access = access_CLOCK_Pro,
 	.mem_alloc = malloc_CLOCK_Pro,
 	.mem_free = mfree_CLOCK_Pro,
-	.data = &data_CLOCK_Pro,
+	.save = save_CLOCK_Pro,
+	.restore = restore_CLOCK_Pro,
+	.data_size = sizeof(data_CLOCK_Pro_t),
 };
 
 typedef struct {
@@ -202,6 +206,7 @@ void init_CLOCK_Pro(policy_t *self, unsigned long memsz)
 	clock->nr_ghost = 0;
 	clock->nr_cold_max = nr_pages > 100? nr_pages / 100 : 1;
 	clock->nr_ghost_max = nr_pages;
+	clock->refault = self->refault;
 
 	INIT_LIST_HEAD(&clock->page_list);
 	INIT_LIST_HEAD(&clock->cold_list);
@@ -231,7 +236,7 @@ void fini_CLOCK_Pro(policy_t *self)
 	if (!refault_stat)
 		goto skip_refault;
 
-	printf("refault dist (avg): %E\n", avg_refault_dist());
+	printf("refault dist (avg): %E\n", avg_refault_dist(self->refault));
 
 skip_refault:
 	if (!policy_stat)
@@ -805,7 +810,7 @@ void evict_cold_page(clock_pro_t *clock)
 	page = list_entry(clock->hand_cold, struct page, entry);
 	move_hand_cold(clock);
 
-	reg_evict(page->addr);
+	reg_evict(clock->refault, page->addr);
 
 	/* replace the page */
 	if (page_testing(page)) {
@@ -1009,7 +1014,7 @@ page_fault_CLOCK_Pro(policy_t *self, unsigned long addr, struct page *page)
 		printf("MISS\n");
 		print_list_snapshot(__func__, ((data_CLOCK_Pro_t *)self->data)->clock);
 	}
-	reg_fault(addr);
+	reg_fault(self->refault, addr);
 	add_page_CLOCK_Pro(self, addr, page);
 	policy_count_stat(self, NR_MISS, 1);
 	update_clock_stat(self);
@@ -1033,7 +1038,7 @@ int access_CLOCK_Pro(policy_t *self, unsigned long vpn)
 	struct page *page;
 	bool fault = false;
 
-	cnt_access(1);
+	cnt_access(self->refault, 1);
 
 	page = pt_walk(pt, addr);
 
@@ -1050,3 +1055,130 @@ int access_CLOCK_Pro(policy_t *self, unsigned long vpn)
 	policy_count_stat(self, NR_TOTAL, 1);
 	return 0;
 }
+
+/*
+ * Checkpoint
+ *
+ * The memory areas are named by their ids: the default one, those in the
+ * list, and those freed while their pages remain, which only count the stats
+ */
+#define PAGE_MD_HOT				0x1UL
+#define PAGE_MD_RESIDENT		0x2UL
+#define PAGE_MD_TESTING			0x4UL
+
+static void save_mem_area(FILE *file, mem_area_t *ma)
+{
+	ckpt_write(file, ma, offsetof(mem_area_t, stat));
+	ckpt_write(file, ma->stat, sizeof(ma_stat_t));
+	ckpt_write(file, &ma->obsolete, sizeof(bool));
+}
+
+static void restore_mem_area(FILE *file, mem_area_t *ma)
+{
+	ckpt_read(file, ma, offsetof(mem_area_t, stat));
+	ckpt_read(file, ma->stat, sizeof(ma_stat_t));
+	ckpt_read(file, &ma->obsolete, sizeof(bool));
+}
+
+int save_CLOCK_Pro(policy_t *self, FILE *file)
+{
+	data_CLOCK_Pro_t *data = self->data;
+	clock_pro_t *clock = data->clock;
+	struct ckpt_ids ids = CKPT_IDS_INIT;
+	struct page *page;
+	mem_area_t *ma;
+	unsigned long rec[2];
+	long nr[2];
+
+	ckpt_write(file, clock, offsetof(clock_pro_t, page_list));
+	ckpt_write(file, data->stat, sizeof(clock_pro_stat_t));
+	ckpt_write(file, data->mem_stat, sizeof(mem_stat_t));
+
+	ckpt_ids_add(&ids, data->def_ma);
+	list_for_each_entry(ma, &data->ma_list, entry)
+		ckpt_ids_add(&ids, ma);
+	nr[0] = ids.nr;
+	list_for_each_entry(page, &clock->page_list, entry) {
+		if (ckpt_id(&ids, page_mem_area(page)) < 0)
+			ckpt_ids_add(&ids, page_mem_area(page));
+	}
+	nr[1] = ids.nr - nr[0];
+	ckpt_write(file, nr, sizeof(nr));
+
+	save_mem_area(file, data->def_ma);
+	list_for_each_entry(ma, &data->ma_list, entry)
+		save_mem_area(file, ma);
+
+	ckpt_write_pages(file, &clock->page_list, entry);
+	list_for_each_entry(page, &clock->page_list, entry) {
+		rec[0] = (page_hot(page) ? PAGE_MD_HOT : 0) |
+			(page_resident(page) ? PAGE_MD_RESIDENT : 0) |
+			(page_testing(page) ? PAGE_MD_TESTING : 0);
+		rec[1] = ckpt_id(&ids, page_mem_area(page));
+		ckpt_write(file, rec, sizeof(rec));
+	}
+
+	ckpt_write_list(file, &clock->cold_list, centry);
+	ckpt_write_hand(file, &clock->page_list, clock->hand_hot, entry);
+	ckpt_write_hand(file, &clock->page_list, clock->hand_cold, entry);
+	ckpt_write_hand(file, &clock->page_list, clock->hand_test, entry);
+
+	ckpt_ids_free(&ids);
+	return 0;
+}
+
+int restore_CLOCK_Pro(policy_t *self, FILE *file)
+{
+	data_CLOCK_Pro_t *data = self->data;
+	clock_pro_t *clock = data->clock;
+	mem_area_t **mas, *ma;
+	struct page *page;
+	unsigned long rec[2];
+	long nr[2], i;
+
+	ckpt_read(file, clock, offsetof(clock_pro_t, page_list));
+	ckpt_read(file, data->stat, sizeof(clock_pro_stat_t));
+	ckpt_read(file, data->mem_stat, sizeof(mem_stat_t));
+
+	ckpt_read(file, nr, sizeof(nr));
+	if (nr[0] < 1 || nr[1] < 0)
+		return -1;
+
+	mas = malloc((nr[0] + nr[1]) * sizeof(mem_area_t *));
+	if (!mas)
+		return -1;
+
+	mas[0] = data->def_ma;
+	restore_mem_area(file, data->def_ma);
+	for (i = 1; i < nr[0] + nr[1]; i++) {
+		mem_area_init(&ma, 0, 0, 0, 0);
+		if (i < nr[0]) {
+			restore_mem_area(file, ma);
+			list_add_tail(&ma->entry, &data->ma_list);
+		}
+		mas[i] = ma;
+	}
+
+	ckpt_read_pages(file, data->pt, &clock->page_list, entry);
+	list_for_each_entry(page, &clock->page_list, entry) {
+		ckpt_read(file, rec, sizeof(rec));
+		if (rec[1] >= nr[0] + nr[1])
+			return -1;
+
+		alloc_page_md(page);
+		page_hot(page) = rec[0] & PAGE_MD_HOT;
+		page_resident(page) = rec[0] & PAGE_MD_RESIDENT;
+		page_testing(page) = rec[0] & PAGE_MD_TESTING;
+		page_set_mem_area(page, mas[rec[1]]);
+	}
+
+	ckpt_read_list(file, data->pt, &clock->cold_list, centry);
+	clock->hand_hot = ckpt_read_hand(file, data->pt, &clock->page_list, entry);
+	clock->hand_cold = ckpt_read_hand(file, data->pt, &clock->page_list,
+			entry);
+	clock->hand_test = ckpt_read_hand(file, data->pt, &clock->page_list,
+			entry);
+
+	free(mas);
+	return 0;
+}
@@ -23,6 +23,8 @@ typedef struct {
 	struct list_head *hand_hot;
 	struct list_head *hand_cold;
 	struct list_head *hand_test;
+
+	struct refault *refault;		// of the policy instance
 } clock_pro_t;
 
 typedef struct {
@@ -2,15 +2,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "clock.h"
+#include "../lib/checkpoint.h"
 #include "../lib/refault.h"
 
 void init_CLOCK(policy_t *self, unsigned long memsz);
 void fini_CLOCK(policy_t *self);
 int malloc_CLOCK(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_CLOCK(policy_t *self, unsigned long addr);
+int discard_CLOCK(policy_t *self, unsigned long addr, unsigned long size);
 int access_CLOCK(policy_t *self, unsigned long addr);
+int save_CLOCK(policy_t *self, FILE *file);
+int restore_CLOCK(policy_t *self, FILE *file);
 
-data_CLOCK_t data_CLOCK;
 policy_t policy_CLOCK = {
 	.name = "clock",
 	.init = init_CLOCK,
@@ -18,7 +21,10 @@ policy_t policy_CLOCK = {
 	.access = access_CLOCK,
 	.mem_alloc = malloc_CLOCK,
 	.mem_free = mfree_CLOCK,
-	.data = &data_CLOCK,
+	.mem_discard = discard_CLOCK,
+	.save = save_CLOCK,
+	.restore = restore_CLOCK,
+	.data_size = sizeof(data_CLOCK_t),
 };
 
 void init_CLOCK(policy_t *self, unsigned long memsz)
@@ -44,7 +50,7 @@ void fini_CLOCK(policy_t *self)
 	if (!refault_stat)
 		goto skip_refault;
 
-	printf("refault dist (avg): %E\n", avg_refault_dist());
+	printf("refault dist (avg): %E\n", avg_refault_dist(self->refault));
 
 skip_refault:
 	/* Let page table freed automatically at program termination */
@@ -67,6 +73,15 @@ int mfree_CLOCK(policy_t *self, unsigned long addr)
 	return 0;
 }
 
+/* The pages unmapped or madvise()d are dropped without eviction */
+int discard_CLOCK(policy_t *self, unsigned long addr, unsigned long size)
+{
+	data_CLOCK_t *data = self->data;
+
+	data->nr_present -= unmap_free_range(data->pt, addr, size);
+	return 0;
+}
+
 void add_page_CLOCK(struct list_head *page_list, struct page *page)
 {
 	list_add(&page->entry, page_list);
@@ -87,7 +102,7 @@ void evict_page_CLOCK(policy_t *self)
 		}
 	}
 
-	reg_evict(page->addr);
+	reg_evict(self->refault, page->addr);
 
 	/* move page_list->next ~ victim to the tail */
 	list_bulk_move_tail(page_list, page_list->next, &victim->entry);
@@ -114,7 +129,7 @@ page_fault_CLOCK(policy_t *self, unsigned long addr, struct page *page)
 	pt_t *pt = data->pt;
 	struct list_head *page_list = &data->page_list;
 
-	reg_fault(addr);
+	reg_fault(self->refault, addr);
 
 	if (debug)
 		printf("MISS\n");
@@ -155,7 +170,7 @@ int access_CLOCK(policy_t *self, unsigned long vpn)
 	unsigned long addr = vpn_to_addr(vpn);
 	struct page *page;
 
-	cnt_access(1);
+	cnt_access(self->refault, 1);
 
 	page = pt_walk(pt, addr);
 
@@ -167,3 +182,21 @@ int access_CLOCK(policy_t *self, unsigned long vpn)
 	policy_count_stat(self, NR_TOTAL, 1);
 	return 0;
 }
+
+/* The pages in the order of the list */
+int save_CLOCK(policy_t *self, FILE *file)
+{
+	data_CLOCK_t *data = self->data;
+
+	ckpt_write_pages(file, &data->page_list, entry);
+	return 0;
+}
+
+int restore_CLOCK(policy_t *self, FILE *file)
+{
+	data_CLOCK_t *data = self->data;
+
+	data->nr_present = ckpt_read_pages(file, data->pt, &data->page_list,
+			entry);
+	return 0;
+}
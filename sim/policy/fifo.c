@@ -2,14 +2,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "fifo.h"
+#include "../lib/checkpoint.h"
 
 void init_FIFO(policy_t *self, unsigned long memsz);
 void fini_FIFO(policy_t *self);
 int malloc_FIFO(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_FIFO(policy_t *self, unsigned long addr);
+int discard_FIFO(policy_t *self, unsigned long addr, unsigned long size);
 int access_FIFO(policy_t *self, unsigned long addr);
+int save_FIFO(policy_t *self, FILE *file);
+int restore_FIFO(policy_t *self, FILE *file);
 
-data_FIFO_t data_FIFO;
 policy_t policy_FIFO = {
 	.name = "fifo",
 	.init = init_FIFO,
@@ -17,7 +20,10 @@ policy_t policy_FIFO = {
 	.access = access_FIFO,
 	.mem_alloc = malloc_FIFO,
 	.mem_free = mfree_FIFO,
-	.data = &data_FIFO,
+	.mem_discard = discard_FIFO,
+	.save = save_FIFO,
+	.restore = restore_FIFO,
+	.data_size = sizeof(data_FIFO_t),
 };
 
 void init_FIFO(policy_t *self, unsigned long memsz)
@@ -60,6 +66,15 @@ int mfree_FIFO(policy_t *self, unsigned long addr)
 	return 0;
 }
 
+/* The pages unmapped or madvise()d are dropped without eviction */
+int discard_FIFO(policy_t *self, unsigned long addr, unsigned long size)
+{
+	data_FIFO_t *data = self->data;
+
+	data->nr_present -= unmap_free_range(data->pt, addr, size);
+	return 0;
+}
+
 void evict_page_FIFO(policy_t *self)
 {
 	data_FIFO_t *data = (data_FIFO_t *)self->data;
@@ -147,3 +162,21 @@ int access_FIFO(policy_t *self, unsigned long vpn)
 	policy_count_stat(self, NR_TOTAL, 1);
 	return 0;
 }
+
+/* The pages in the order of the list */
+int save_FIFO(policy_t *self, FILE *file)
+{
+	data_FIFO_t *data = self->data;
+
+	ckpt_write_pages(file, &data->page_list, entry);
+	return 0;
+}
+
+int restore_FIFO(policy_t *self, FILE *file)
+{
+	data_FIFO_t *data = self->data;
+
+	data->nr_present = ckpt_read_pages(file, data->pt, &data->page_list,
+			entry);
+	return 0;
+}
@@ -2,22 +2,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "lru.h"
+#include "../lib/checkpoint.h"
 
 void init_LRU(policy_t *self, unsigned long memsz);
 void fini_LRU(policy_t *self);
 int malloc_LRU(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_LRU(policy_t *self, unsigned long addr);
+int discard_LRU(policy_t *self, unsigned long addr, unsigned long size);
 int access_LRU(policy_t *self, unsigned long addr);
+int save_LRU(policy_t *self, FILE *file);
+int restore_LRU(policy_t *self, FILE *file);
+int access_range_LRU(policy_t *self, unsigned long vpn, unsigned long nr_pages);
 
-data_LRU_t data_LRU;
 policy_t policy_LRU = {
 	.name = "lru",
 	.init = init_LRU,
 	.fini = fini_LRU,
 	.access = access_LRU,
+	.access_range = access_range_LRU,
 	.mem_alloc = malloc_LRU,
 	.mem_free = mfree_LRU,
-	.data = &data_LRU,
+	.mem_discard = discard_LRU,
+	.save = save_LRU,
+	.restore = restore_LRU,
+	.data_size = sizeof(data_LRU_t),
 };
 
 void init_LRU(policy_t *self, unsigned long memsz)
@@ -60,6 +68,15 @@ int mfree_LRU(policy_t *self, unsigned long addr)
 	return 0;
 }
 
+/* The pages unmapped or madvise()d are dropped without eviction */
+int discard_LRU(policy_t *self, unsigned long addr, unsigned long size)
+{
+	data_LRU_t *data = self->data;
+
+	data->nr_present -= unmap_free_range(data->pt, addr, size);
+	return 0;
+}
+
 void evict_page_LRU(policy_t *self)
 {
 	data_LRU_t *data = (data_LRU_t *)self->data;
@@ -152,3 +169,66 @@ int access_LRU(policy_t *self, unsigned long vpn)
 	policy_count_stat(self, NR_TOTAL, 1);
 	return 0;
 }
+
+/*
+ * The pages of a range in a row. The PTEs under a PMD are walked once, and a
+ * run of present pages is spliced to the head of the list at once, in the
+ * order the accesses one by one leave it. A fault ends the run, since it
+ * evicts from the tail.
+ */
+int access_range_LRU(policy_t *self, unsigned long vpn, unsigned long nr_pages)
+{
+	data_LRU_t *data = (data_LRU_t *)self->data;
+	unsigned long addr = vpn_to_addr(vpn);
+	unsigned long end = addr + vpn_to_addr(nr_pages);
+	unsigned long pmd_end = addr, nr_hits = 0;
+	pmd_t *pmd = NULL;
+	pte_t *pte;
+	struct page *page;
+	LIST_HEAD(run);
+
+	for (; addr < end; addr += PAGE_SIZE) {
+		if (addr >= pmd_end) {
+			pmd = pt_walk_pmd(data->pt, addr);
+			pmd_end = ((addr >> PMD_SHIFT) + 1) << PMD_SHIFT;
+		}
+
+		pte = pmd ? pte_offset(pmd, addr) : NULL;
+		page = pte ? pte->page : NULL;
+		if (page) {
+			if (debug)
+				printf("HIT\n");
+			list_move(&page->entry, &run);
+			nr_hits++;
+			continue;
+		}
+
+		list_splice_init(&run, &data->page_list);
+		page_fault_LRU(self, addr, NULL);
+		/* the fault may have added the PMD */
+		pmd_end = addr;
+	}
+	list_splice(&run, &data->page_list);
+
+	policy_count_stat(self, NR_HIT, nr_hits);
+	policy_count_stat(self, NR_TOTAL, nr_pages);
+	return 0;
+}
+
+/* The pages in the order of the list */
+int save_LRU(policy_t *self, FILE *file)
+{
+	data_LRU_t *data = self->data;
+
+	ckpt_write_pages(file, &data->page_list, entry);
+	return 0;
+}
+
+int restore_LRU(policy_t *self, FILE *file)
+{
+	data_LRU_t *data = self->data;
+
+	data->nr_present = ckpt_read_pages(file, data->pt, &data->page_list,
+			entry);
+	return 0;
+}
@@ -9,7 +9,6 @@ int malloc_mallocstat(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_mallocstat(policy_t *self, unsigned long addr);
 int access_mallocstat(policy_t *self, unsigned long addr);
 
-data_mallocstat_t data_mallocstat;
 policy_t policy_mallocstat = {
 	.name = "mallocstat",
 	.init = init_mallocstat,
@@ -17,7 +16,7 @@ policy_t policy_mallocstat = {
 	.access = access_mallocstat,
 	.mem_alloc = malloc_mallocstat,
 	.mem_free = mfree_mallocstat,
-	.data = &data_mallocstat,
+	.data_size = sizeof(data_mallocstat_t),
 };
 
 static void
@@ -12,7 +12,6 @@ int mfree_OPT(policy_t *self, unsigned long addr);
 int access_OPT(policy_t *self, unsigned long addr);
 void post_sim_OPT(policy_t *self);
 
-data_OPT_t data_OPT;
 policy_t policy_OPT = {
 	.name = "opt",
 	.init = init_OPT,
@@ -21,7 +20,7 @@ policy_t policy_OPT = {
 	.mem_alloc = malloc_OPT,
 	.mem_free = mfree_OPT,
 	.post_sim = post_sim_OPT,
-	.data = &data_OPT,
+	.data_size = sizeof(data_OPT_t),
 };
 
 typedef struct {
@@ -202,7 +201,7 @@ void fini_OPT(policy_t *self)
 	if (!refault_stat)
 		goto skip_refault;
 
-	printf("refault dist (avg): %E\n", avg_refault_dist());
+	printf("refault dist (avg): %E\n", avg_refault_dist(self->refault));
 
 skip_refault:
 	if (!policy_stat)
@@ -456,7 +455,7 @@ void sim_opt(policy_t *self)
 
 		policy_count_stat(self, NR_TOTAL, 1 + hit_skipped);
 		policy_count_stat(self, NR_HIT, hit_skipped);
-		cnt_access(1 + hit_skipped);
+		cnt_access(self->refault, 1 + hit_skipped);
 
 		if (page_present(page)) {
 			delete_max_cand(&cand);
@@ -487,11 +486,11 @@ void sim_opt(policy_t *self)
 
 		/* page fault */
 
-		reg_fault(addr);
+		reg_fault(self->refault, addr);
 
 		if (nr_present == nr_pages) {
 			if (nr_obsolete) {
-				reg_evict(0);
+				reg_evict(self->refault, 0);
 				nr_obsolete--;
 			} else {
 				cand_node = delete_min_cand(&cand);
@@ -499,7 +498,7 @@ void sim_opt(policy_t *self)
 				victim = pt_walk(pt, vpn_to_addr(victim_node->vpn));
 				page_mknotpresent(victim);
 
-				reg_evict(vpn_to_addr(victim_node->vpn));
+				reg_evict(self->refault, vpn_to_addr(victim_node->vpn));
 
 				victim_ma = find_mem_area(data, vpn_to_addr(victim_node->vpn));
 				victim_ma->nr_present--;
@@ -547,7 +546,7 @@ void sim_opt(policy_t *self)
 
 	policy_count_stat(self, NR_TOTAL, hit_skipped);
 	policy_count_stat(self, NR_HIT, hit_skipped);
-	cnt_access(hit_skipped);
+	cnt_access(self->refault, hit_skipped);
 }
 
 void
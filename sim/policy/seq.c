@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "seq.h"
+#include "../lib/checkpoint.h"
 #include "../lib/refault.h"
 
 void init_SEQ(policy_t *self, unsigned long memsz);
@@ -9,8 +10,9 @@ void fini_SEQ(policy_t *self);
 int malloc_SEQ(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_SEQ(policy_t *self, unsigned long addr);
 int access_SEQ(policy_t *self, unsigned long addr);
+int save_SEQ(policy_t *self, FILE *file);
+int restore_SEQ(policy_t *self, FILE *file);
 
-data_SEQ_t data_SEQ;
 policy_t policy_SEQ = {
 	.name = "seq",
 	.init = init_SEQ,
@@ -18,7 +20,9 @@ policy_t policy_SEQ = {
 	.access = access_SEQ,
 	.mem_alloc = malloc_SEQ,
 	.mem_free = mfree_SEQ,
-	.data = &data_SEQ,
+	.save = save_SEQ,
+	.restore = restore_SEQ,
+	.data_size = sizeof(data_SEQ_t),
 };
 
 #define seq_nth_fault_time(_seq, _n)	\
@@ -109,7 +113,7 @@ void fini_SEQ(policy_t *self)
 	if (!refault_stat)
 		goto skip_refault;
 
-	printf("refault dist (avg): %E\n", avg_refault_dist());
+	printf("refault dist (avg): %E\n", avg_refault_dist(self->refault));
 
 skip_refault:
 	if (!policy_stat)
@@ -484,8 +488,9 @@ choose_victim_in_seq(data_SEQ_t *data, seq_t *seq)
 }
 
 static bool
-try_evict_page_seq(data_SEQ_t *data)
+try_evict_page_seq(policy_t *self)
 {
+	data_SEQ_t *data = self->data;
 	global_seq_t *gseq = data->gseq;
 	struct list_head *young_list = &gseq->young_list;
 	unsigned long length;
@@ -501,7 +506,7 @@ try_evict_page_seq(data_SEQ_t *data)
 		if (victim) {
 			unmap_free_page(victim);
 			data->nr_present--;
-			reg_evict(victim->addr);
+			reg_evict(self->refault, victim->addr);
 			return true;
 		}
 	}
@@ -510,8 +515,9 @@ try_evict_page_seq(data_SEQ_t *data)
 }
 
 static void
-evict_page_clock(data_SEQ_t *data)
+evict_page_clock(policy_t *self)
 {
+	data_SEQ_t *data = self->data;
 	struct page *page, *victim = NULL;
 	struct list_head *page_list = &data->page_list;
 
@@ -527,7 +533,7 @@ evict_page_clock(data_SEQ_t *data)
 	/* move page_list->next ~ victim to the tail */
 	list_bulk_move_tail(page_list, page_list->next, &victim->entry);
 
-	reg_evict(page->addr);
+	reg_evict(self->refault, page->addr);
 
 	/* delete victim from the list */
 	unmap_free_page(victim);
@@ -538,9 +544,9 @@ void evict_page_SEQ(policy_t *self)
 {
 	bool evicted;
 
-	evicted = try_evict_page_seq(self->data);
+	evicted = try_evict_page_seq(self);
 	if (!evicted)
-		evict_page_clock(self->data);
+		evict_page_clock(self);
 }
 
 static inline bool is_full_SEQ(policy_t *self)
@@ -561,7 +567,7 @@ page_fault_SEQ(policy_t *self, unsigned long addr, struct page *page)
 	struct list_head *page_list = &data->page_list;
 	global_seq_t *gseq = data->gseq;
 
-	reg_fault(addr);
+	reg_fault(self->refault, addr);
 
 	if (debug)
 		printf("MISS\n");
@@ -608,7 +614,7 @@ int access_SEQ(policy_t *self, unsigned long vpn)
 	unsigned long addr = vpn_to_addr(vpn);
 	struct page *page;
 
-	cnt_access(1);
+	cnt_access(self->refault, 1);
 
 	page = pt_walk(pt, addr);
 
@@ -620,3 +626,68 @@ int access_SEQ(policy_t *self, unsigned long vpn)
 	policy_count_stat(self, NR_TOTAL, 1);
 	return 0;
 }
+
+/*
+ * Checkpoint
+ *
+ * The sequences are written in the order of the list, and the young list
+ * as their ids in that order.
+ */
+int save_SEQ(policy_t *self, FILE *file)
+{
+	data_SEQ_t *data = self->data;
+	global_seq_t *gseq = data->gseq;
+	struct ckpt_ids ids = CKPT_IDS_INIT;
+	seq_t *seq;
+	long id;
+
+	ckpt_write_pages(file, &data->page_list, entry);
+	ckpt_write(file, gseq, offsetof(global_seq_t, seq_list));
+
+	list_for_each_entry(seq, &gseq->seq_list, entry) {
+		ckpt_write(file, seq, offsetof(seq_t, entry));
+		ckpt_ids_add(&ids, seq);
+	}
+	list_for_each_entry(seq, &gseq->young_list, sentry) {
+		id = ckpt_id(&ids, seq);
+		ckpt_write(file, &id, sizeof(id));
+	}
+
+	ckpt_ids_free(&ids);
+	return 0;
+}
+
+int restore_SEQ(policy_t *self, FILE *file)
+{
+	data_SEQ_t *data = self->data;
+	global_seq_t *gseq = data->gseq;
+	seq_t **seqs;
+	long i, id;
+
+	data->nr_present = ckpt_read_pages(file, data->pt, &data->page_list,
+			entry);
+	ckpt_read(file, gseq, offsetof(global_seq_t, seq_list));
+	if (gseq->nr_seq < 0 || gseq->nr_seq > MAX_NR_SEQ)
+		return -1;
+
+	seqs = malloc(gseq->nr_seq * sizeof(seq_t *) + 1);
+	if (!seqs)
+		return -1;
+
+	for (i = 0; i < gseq->nr_seq; i++) {
+		seqs[i] = malloc(sizeof(seq_t));
+		if (!seqs[i])
+			return -1;
+		ckpt_read(file, seqs[i], offsetof(seq_t, entry));
+		list_add_tail(&seqs[i]->entry, &gseq->seq_list);
+	}
+	for (i = 0; i < gseq->nr_seq; i++) {
+		ckpt_read(file, &id, sizeof(id));
+		if (id < 0 || id >= gseq->nr_seq)
+			return -1;
+		list_add_tail(&seqs[id]->sentry, &gseq->young_list);
+	}
+
+	free(seqs);
+	return 0;
+}
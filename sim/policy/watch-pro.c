@@ -2,14 +2,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "watch-pro.h"
+#include "../lib/checkpoint.h"
 
 void init_WATCH_Pro(policy_t *self, unsigned long memsz);
 void fini_WATCH_Pro(policy_t *self);
 int malloc_WATCH_Pro(policy_t *self, unsigned long addr, unsigned long size);
 int mfree_WATCH_Pro(policy_t *self, unsigned long addr);
 int access_WATCH_Pro(policy_t *self, unsigned long addr);
+int save_WATCH_Pro(policy_t *self, FILE *file);
+int restore_WATCH_Pro(policy_t *self, FILE *file);
 
-data_WATCH_Pro_t data_WATCH_Pro;
 policy_t policy_WATCH_Pro = {
 	.name = "watch-pro",
 	.init = init_WATCH_Pro,
@@ -17,7 +19,9 @@ policy_t policy_WATCH_Pro = {
 	.access = access_WATCH_Pro,
 	.mem_alloc = malloc_WATCH_Pro,
 	.mem_free = mfree_WATCH_Pro,
-	.data = &data_WATCH_Pro,
+	.save = save_WATCH_Pro,
+	.restore = restore_WATCH_Pro,
+	.data_size = sizeof(data_WATCH_Pro_t),
 };
 
 #define max(x, y)					((x) > (y)? (x) : (y))
@@ -1790,3 +1794,190 @@ int access_WATCH_Pro(policy_t *self, unsigned long vpn)
 	policy_count_stat(self, NR_TOTAL, 1);
 	return 0;
 }
+
+/*
+ * Checkpoint
+ *
+ * The watches are named by their ids: the default one, those of the memory
+ * areas in the list, and the obsolete ones still holding pages. The most
+ * recently faulted page of a watch is kept only while the page is alive.
+ */
+#define PAGE_MD_GHOT			0x01UL
+#define PAGE_MD_WHOT			0x02UL
+#define PAGE_MD_RESIDENT		0x04UL
+#define PAGE_MD_GTESTING		0x08UL
+#define PAGE_MD_WTESTING		0x10UL
+#define PAGE_MD_GREF			0x20UL
+#define PAGE_MD_WREF			0x40UL
+
+static void save_watch(FILE *file, watch_t *watch)
+{
+	ckpt_write(file, watch, offsetof(watch_t, hand_hot));
+	ckpt_write(file, watch->stat, sizeof(watch_stat_t));
+	ckpt_write(file, &watch->obsolete, sizeof(bool));
+}
+
+static void restore_watch(FILE *file, watch_t *watch)
+{
+	ckpt_read(file, watch, offsetof(watch_t, hand_hot));
+	ckpt_read(file, watch->stat, sizeof(watch_stat_t));
+	ckpt_read(file, &watch->obsolete, sizeof(bool));
+}
+
+static void save_watch_pages(FILE *file, watch_t *watch,
+		struct ckpt_ids *pages)
+{
+	struct list_head *mrf = &watch->page_list;
+
+	if (watch->mrf && ckpt_id(pages, watch->mrf) >= 0)
+		mrf = &watch->mrf->entry;
+
+	ckpt_write_list(file, &watch->page_list, entry);
+	ckpt_write_hand(file, &watch->page_list, watch->hand_hot, entry);
+	ckpt_write_list(file, &watch->cold_list, centry);
+	ckpt_write_hand(file, &watch->page_list, mrf, entry);
+}
+
+static void restore_watch_pages(FILE *file, pt_t *pt, watch_t *watch)
+{
+	struct list_head *mrf;
+
+	ckpt_read_list(file, pt, &watch->page_list, entry);
+	watch->hand_hot = ckpt_read_hand(file, pt, &watch->page_list, entry);
+	ckpt_read_list(file, pt, &watch->cold_list, centry);
+
+	mrf = ckpt_read_hand(file, pt, &watch->page_list, entry);
+	watch->mrf = NULL;
+	if (mrf != &watch->page_list)
+		watch->mrf = list_entry(mrf, struct page, entry);
+}
+
+int save_WATCH_Pro(policy_t *self, FILE *file)
+{
+	data_WATCH_Pro_t *data = self->data;
+	gclock_t *gclock = data->gclock;
+	struct ckpt_ids ids = CKPT_IDS_INIT;
+	struct ckpt_ids pages = CKPT_IDS_INIT;
+	struct page *page;
+	mem_area_t *ma;
+	page_md_t *md;
+	unsigned long rec[2];
+	long nr[2], i;
+
+	ckpt_write(file, gclock, offsetof(gclock_t, hand_hot));
+	ckpt_write(file, gclock->stat, sizeof(gclock_stat_t));
+	ckpt_write(file, data->mem_stat, sizeof(mem_stat_t));
+
+	ckpt_ids_add(&ids, data->def_ma->watch);
+	list_for_each_entry(ma, &data->ma_list, entry)
+		ckpt_ids_add(&ids, ma->watch);
+	nr[0] = ids.nr;
+	list_for_each_entry(page, &gclock->page_list, gentry) {
+		if (ckpt_id(&ids, page_watch(page)) < 0)
+			ckpt_ids_add(&ids, page_watch(page));
+		ckpt_ids_add(&pages, page);
+	}
+	nr[1] = ids.nr - nr[0];
+	ckpt_write(file, nr, sizeof(nr));
+
+	save_watch(file, data->def_ma->watch);
+	list_for_each_entry(ma, &data->ma_list, entry) {
+		ckpt_write(file, ma, offsetof(mem_area_t, entry));
+		save_watch(file, ma->watch);
+	}
+	for (i = nr[0]; i < ids.nr; i++)
+		save_watch(file, (watch_t *)ids.ptrs[i]);
+
+	ckpt_write_pages(file, &gclock->page_list, gentry);
+	list_for_each_entry(page, &gclock->page_list, gentry) {
+		md = page_md(page);
+		rec[0] = (md->ghot ? PAGE_MD_GHOT : 0) |
+			(md->whot ? PAGE_MD_WHOT : 0) |
+			(md->resident ? PAGE_MD_RESIDENT : 0) |
+			(md->gtesting ? PAGE_MD_GTESTING : 0) |
+			(md->wtesting ? PAGE_MD_WTESTING : 0) |
+			(md->gref ? PAGE_MD_GREF : 0) |
+			(md->wref ? PAGE_MD_WREF : 0);
+		rec[1] = ckpt_id(&ids, md->watch);
+		ckpt_write(file, rec, sizeof(rec));
+	}
+
+	ckpt_write_list(file, &gclock->cold_list, rentry);
+	ckpt_write_hand(file, &gclock->page_list, gclock->hand_hot, gentry);
+	ckpt_write_hand(file, &gclock->page_list, gclock->hand_test, gentry);
+
+	for (i = 0; i < ids.nr; i++)
+		save_watch_pages(file, (watch_t *)ids.ptrs[i], &pages);
+
+	ckpt_ids_free(&ids);
+	ckpt_ids_free(&pages);
+	return 0;
+}
+
+int restore_WATCH_Pro(policy_t *self, FILE *file)
+{
+	data_WATCH_Pro_t *data = self->data;
+	gclock_t *gclock = data->gclock;
+	watch_t **watches;
+	struct page *page;
+	mem_area_t *ma;
+	page_md_t *md;
+	unsigned long rec[2];
+	long nr[2], i;
+
+	ckpt_read(file, gclock, offsetof(gclock_t, hand_hot));
+	ckpt_read(file, gclock->stat, sizeof(gclock_stat_t));
+	ckpt_read(file, data->mem_stat, sizeof(mem_stat_t));
+
+	ckpt_read(file, nr, sizeof(nr));
+	if (nr[0] < 1 || nr[1] < 0)
+		return -1;
+
+	watches = malloc((nr[0] + nr[1]) * sizeof(watch_t *));
+	if (!watches)
+		return -1;
+
+	watches[0] = data->def_ma->watch;
+	restore_watch(file, watches[0]);
+	for (i = 1; i < nr[0]; i++) {
+		mem_area_init(&ma, 0, 0, 0, 0);
+		ckpt_read(file, ma, offsetof(mem_area_t, entry));
+		restore_watch(file, ma->watch);
+		list_add_tail(&ma->entry, &data->ma_list);
+		watches[i] = ma->watch;
+	}
+	for (; i < nr[0] + nr[1]; i++) {
+		watch_init(&watches[i]);
+		restore_watch(file, watches[i]);
+	}
+
+	ckpt_read_pages(file, data->pt, &gclock->page_list, gentry);
+	list_for_each_entry(page, &gclock->page_list, gentry) {
+		ckpt_read(file, rec, sizeof(rec));
+		if (rec[1] >= nr[0] + nr[1])
+			return -1;
+
+		alloc_page_md(page);
+		md = page_md(page);
+		md->ghot = rec[0] & PAGE_MD_GHOT;
+		md->whot = rec[0] & PAGE_MD_WHOT;
+		md->resident = rec[0] & PAGE_MD_RESIDENT;
+		md->gtesting = rec[0] & PAGE_MD_GTESTING;
+		md->wtesting = rec[0] & PAGE_MD_WTESTING;
+		md->gref = rec[0] & PAGE_MD_GREF;
+		md->wref = rec[0] & PAGE_MD_WREF;
+		md->watch = watches[rec[1]];
+	}
+
+	ckpt_read_list(file, data->pt, &gclock->cold_list, rentry);
+	gclock->hand_hot = ckpt_read_hand(file, data->pt, &gclock->page_list,
+			gentry);
+	gclock->hand_test = ckpt_read_hand(file, data->pt, &gclock->page_list,
+			gentry);
+
+	for (i = 0; i < nr[0] + nr[1]; i++)
+		restore_watch_pages(file, data->pt, watches[i]);
+
+	free(watches);
+	return 0;
+}
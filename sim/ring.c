@@ -0,0 +1,134 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sim.h"
+#include "ring.h"
+
+#define RING_POLL_NS			50000		/* while waiting */
+#define RING_CHECK_POLLS		20000		/* ~1 s between liveness checks */
+
+static void ring_wait(void)
+{
+	struct timespec ts = { 0, RING_POLL_NS };
+
+	nanosleep(&ts, NULL);
+}
+
+/* Wait for posetrace to create the ring, then map it */
+struct ring *ring_attach(const char *name)
+{
+	struct ring *ring;
+	struct stat st;
+	int fd;
+
+	ring = calloc(1, sizeof(struct ring));
+	if (!ring)
+		sim_error("Failed to attach the ring");
+
+	ring->name = malloc(strlen(name) + 2);
+	if (!ring->name)
+		sim_error("Failed to attach the ring");
+	sprintf(ring->name, "/%s", name[0] == '/' ? name + 1 : name);
+
+	while ((fd = shm_open(ring->name, O_RDWR, 0)) < 0) {
+		if (errno != ENOENT) {
+			perror(ring->name);
+			exit(1);
+		}
+		ring_wait();
+	}
+
+	/* the producer sizes the ring before publishing it */
+	for (;;) {
+		if (fstat(fd, &st))
+			sim_error("Failed to attach the ring");
+		if (st.st_size >= RING_DATA_OFF)
+			break;
+		ring_wait();
+	}
+
+	ring->map_size = st.st_size;
+	ring->hdr = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->hdr == MAP_FAILED)
+		sim_error("Failed to map the ring");
+
+	while (__atomic_load_n(&ring->hdr->magic, __ATOMIC_ACQUIRE) != RING_MAGIC)
+		ring_wait();
+
+	if (RING_DATA_OFF + ring->hdr->size > ring->map_size)
+		sim_error("Invalid ring size");
+
+	ring->data = (unsigned char *)ring->hdr + RING_DATA_OFF;
+	ring->hdr->consumer = getpid();
+
+	return ring;
+}
+
+static bool producer_alive(struct ring *ring)
+{
+	return kill(ring->hdr->producer, 0) == 0 || errno != ESRCH;
+}
+
+/* Read size bytes; returns less only at the end of the stream */
+size_t ring_read(struct ring *ring, void *ptr, size_t size)
+{
+	struct ring_hdr *hdr = ring->hdr;
+	unsigned char *dst = ptr;
+	unsigned long head, tail, off, len;
+	size_t done = 0;
+	int polls = 0;
+
+	tail = hdr->tail;
+	while (done < size) {
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			/* eof is set after the last head, so check head again */
+			if (__atomic_load_n(&hdr->eof, __ATOMIC_ACQUIRE)) {
+				if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == tail)
+					break;
+				continue;
+			}
+
+			if (++polls % RING_CHECK_POLLS == 0 && !producer_alive(ring)) {
+				fprintf(stderr, "posetrace exited without closing the ring\n");
+				break;
+			}
+			ring_wait();
+			continue;
+		}
+
+		off = tail & (hdr->size - 1);
+		len = head - tail;
+		if (len > hdr->size - off)
+			len = hdr->size - off;
+		if (len > size - done)
+			len = size - done;
+
+		memcpy(dst + done, ring->data + off, len);
+		done += len;
+		tail += len;
+		__atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return done;
+}
+
+void ring_detach(struct ring *ring)
+{
+	munmap(ring->hdr, ring->map_size);
+	shm_unlink(ring->name);
+	free(ring->name);
+	free(ring);
+}
@@ -0,0 +1,51 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _RING_H
+#define _RING_H
+
+#include <stddef.h>
+
+/*
+ * Shared-memory ring of posetrace -ring
+ *
+ * A single-producer single-consumer byte ring in /dev/shm/<name> (POSIX
+ * shared memory), through which posetrace streams the trace into sim
+ * without a trace file. The producer creates the ring and publishes the
+ * header by writing the magic last.
+ *
+ * head and tail are the numbers of bytes written and read, on their own
+ * cache lines; data is copied before head is released, and read before tail
+ * is released. The producer waits while the ring is full (back-pressure), and
+ * sets eof after the last chunk of the trace.
+ */
+
+#define RING_MAGIC				0x474e495245534f50UL	/* "POSERING" */
+#define RING_CACHELINE			64
+#define RING_DATA_OFF			4096
+
+struct ring_hdr {
+	unsigned long magic;
+	unsigned long size;				/* of the data; power of two */
+	unsigned long producer;			/* pid */
+	unsigned long consumer;			/* pid; 0 until attached */
+	unsigned long eof;
+	char pad0[RING_CACHELINE - 5 * sizeof(unsigned long)];
+
+	unsigned long head;
+	char pad1[RING_CACHELINE - sizeof(unsigned long)];
+
+	unsigned long tail;
+	char pad2[RING_CACHELINE - sizeof(unsigned long)];
+};
+
+struct ring {
+	struct ring_hdr *hdr;
+	unsigned char *data;
+	size_t map_size;
+	char *name;
+};
+
+struct ring *ring_attach(const char *name);
+size_t ring_read(struct ring *ring, void *ptr, size_t size);
+void ring_detach(struct ring *ring);
+
+#endif
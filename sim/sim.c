@@ -1,9 +1,25 @@
 /* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include "sim.h"
+#include "trace.h"
+#include "decoder.h"
+#include "decode.h"
+#include "convert.h"
+#include "slice.h"
+#include "mrc.h"
+#include "multi.h"
+#include "sweep.h"
 #include "policy/common.h"
+#include "lib/refault.h"
+#include "lib/checkpoint.h"
 
 policy_t policy[MAX_NR_POLICY];
 int nr_policy;
@@ -11,6 +27,156 @@ bool debug;
 bool verbose;
 bool policy_stat;
 bool refault_stat;
+bool pipelined;
+
+/*
+ * Checkpoints
+ *
+ * A checkpoint holds the position in the trace, the state of sim (stats,
+ * sampling, mapped areas and refaults) and that of the policy through its
+ * save hook. It is taken on SIGUSR1 and every ckpt_interval accesses, between
+ * the batches of references, and written to a temporary file renamed over
+ * the last one, so that a crash leaves a complete checkpoint.
+ */
+#define CKPT_MAGIC				0x54504b43534f50UL	/* "POSCKPT" */
+#define CKPT_VERSION			3
+#define MAX_PARAMS_LEN			64
+
+struct ckpt_header {
+	unsigned long magic;
+	unsigned int version;
+	unsigned int pad;
+	char policy[20];
+	unsigned long memsz;
+	unsigned long trace_size;		/* to tell another trace */
+	char params[MAX_PARAMS_LEN];	/* of -param, may differ when restored */
+};
+
+static const char *ckpt_path;
+static const char *restore_path;
+static long ckpt_interval;
+static unsigned long ckpt_memsz;
+static unsigned long ckpt_trace_size;
+static long ckpt_next = LONG_MAX;	/* NR_TOTAL of the next checkpoint */
+static volatile sig_atomic_t ckpt_requested;
+
+static unsigned long seed;
+static char params[MAX_PARAMS_LEN];	/* <name>=<value> of -param, spaced */
+static long shards_size;			/* of the sample of -shards-size */
+
+/*
+ * Sampled traces
+ *
+ * The stats are counted while at least a thread is in PHASE_MEASURE, and
+ * the instructions measured are summed from the phase entries of each thread.
+ */
+struct sample_thread {
+	unsigned long tid;
+	int phase;
+	unsigned long start;			/* icount at the start of the phase */
+};
+
+/* Advice of the traced program (Linux) */
+#define LINUX_MADV_DONTNEED		4UL
+#define LINUX_MADV_FREE			8UL
+
+/*
+ * Areas mapped by the program itself, which are passed to the policies as
+ * allocations; the mappings of the allocator functions are not, since their
+ * objects are recorded by their own entries.
+ */
+struct map_area {
+	unsigned long start;
+	unsigned long end;
+};
+
+/*
+ * Spatial sampling (SHARDS, Waldspurger et al., FAST '15)
+ *
+ * Only the pages whose hash is below shards_threshold are simulated, with
+ * the memory scaled by the rate; the allocations are all passed on. The
+ * counts of the references are rescaled by the fraction of the references
+ * sampled rather than by the rate, which corrects for hot pages falling in
+ * or out of the sample. The sampled pages are split into SHARDS_NR_GROUPS
+ * groups by the low bits of their hash, and the standard error of the miss
+ * ratio is estimated from the spread of the groups (as random groups of a
+ * sample); the misses of the policies counting them in post_sim() cannot be
+ * told apart by page, so theirs is not estimated.
+ */
+#define SHARDS_NR_GROUPS		32
+#define SHARDS_HASH_RANGE		18446744073709551616.0L	/* 2^64 */
+
+double shards_rate;
+static uint64_t shards_threshold;	/* of the hashes sampled (below) */
+
+struct shards_group {
+	long refs;
+	long misses;
+};
+
+/* The rate of a fixed-size sample: the size-th lowest hash of the pages */
+struct shards_scan {
+	uint64_t *hashes;				/* sorted when compacted */
+	long nr;
+	long max;
+	long size;
+	uint64_t threshold;				/* of the hashes kept (at most) */
+};
+
+/*
+ * Sampling windows
+ *
+ * Every window_period references, the first window_warmup are simulated to
+ * warm the policy up, the next window_measure are measured, and the rest are
+ * fast-forwarded: only counted, while the allocations and mappings are still
+ * passed to the policy. A reference is simulated whole in the window where
+ * it starts, however many pages it touches. The miss ratio of the trace is
+ * estimated as that of all the windows measured, with a confidence interval
+ * from their spread (windows as clusters of a sample), and scaled to the page
+ * accesses of the whole trace, which are counted while fast-forwarding; the
+ * last window may be cut short.
+ */
+#define WINDOW_FF				0
+#define WINDOW_WARM				1
+#define WINDOW_MEASURE			2
+
+long window_period;					/* 0 if not sampled */
+static long window_warmup;
+static long window_measure;
+
+struct window {
+	long refs;						/* references measured */
+	long accesses;					/* to their pages (NR_TOTAL) */
+	long misses;
+};
+
+/* State of sim other than the policy, of each policy instance */
+struct sim_state {
+	struct sample_thread *sample_threads;
+	int nr_sample_threads;
+	int nr_measuring;
+	bool sampled;
+	struct sim_stats sample_snap;
+	struct sim_stats sample_stats;
+	unsigned long sample_inst;
+
+	struct map_area *map_areas;
+	int nr_map_areas;
+	unsigned long brk_end;
+
+	struct shards_group shards_groups[SHARDS_NR_GROUPS];
+	long shards_refs;				/* sampled or not */
+
+	int window_phase;				/* WINDOW_* */
+	long window_left;				/* references left in the phase */
+	long window_refs;				/* simulated or not */
+	long window_accesses;			/* to their pages */
+	long window_snap_refs;			/* at the start of the measure */
+	struct sim_stats window_snap;
+	struct window *windows;
+	int nr_windows;
+	int max_windows;
+};
 
 const char * const sim_stat_text[] = {
 	"      nr_hit",
@@ -22,13 +188,48 @@ const char * const sim_stat_text[] = {
 	" nr_mem_free",
 };
 
+/* Report a fatal error of sim and its commands, as printf() */
+void sim_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(1);
+}
+
 void wrong_args(int argc, char **argv)
 {
-	printf("usage: %s <policy> <memory size (kB)> <trace file> [-v] [-s] [-d]\n", argv[0]);
+	printf("usage: %s <policy> <memory size (kB)> <trace file | shm:<name> | -> [-v] [-s] [-d]\n", argv[0]);
 	printf("-v: verbose mode\n");
 	printf("-s: print policy stat\n");
 	printf("-d: debug mode\n");
 	printf("-r: print refault stat\n");
+	printf("-p: decode the trace in another thread\n");
+	printf("-c <file>: checkpoint to the file on SIGUSR1\n");
+	printf("-ci <n>: checkpoint every n accesses as well (with -c)\n");
+	printf("-restore <file>: resume from a checkpoint\n");
+	printf("-seed <n>: seed of the random choices of the policy (0)\n");
+	printf("-param <name>=<value>: set a parameter of the policy\n");
+	printf("-shards <rate>: simulate the pages sampled at the rate\n");
+	printf("-shards-size <n>: sample about n pages (of a trace file)\n");
+	printf("-windows <period>:<warm-up>:<measure>: simulate windows of "
+			"every period references\n");
+	printf("\n");
+	printf("usage: %s convert <trace file> <page trace>\n", argv[0]);
+	printf("usage: %s slice <out> <trace file> [-r <first>:<last>] "
+			"[-i <first>:<last>] [<trace file> ...]\n", argv[0]);
+	printf("usage: %s mrc <policy> <trace file> [<memory size (kB)> ...] "
+			"[-v] [-p]\n", argv[0]);
+	printf("usage: %s multi <policy>,<policy>[,...] <memory size (kB)> "
+			"<trace file> [-v] [-s] [-r]\n", argv[0]);
+	printf("usage: %s sweep <policy>,<policy>[,...] "
+			"<memory size (kB)>,<memory size>[,...] <trace file> "
+			"[-j <threads>] [-seeds <n>] [-shards <rate> | -shards-size <n>] "
+			"[-windows <period>:<warm-up>:<measure>] [-json] [-v]\n",
+			argv[0]);
 	exit(1);
 }
 
@@ -38,6 +239,43 @@ void check_args(int argc, char **argv)
 		wrong_args(argc, argv);
 }
 
+/* A parameter of the policy given as <name>=<value> */
+static void add_param(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	char *end;
+
+	if (!eq || eq == arg || strchr(arg, ' '))
+		sim_error("-param %s: not <name>=<value>", arg);
+	strtod(eq + 1, &end);
+	if (end == eq + 1 || *end)
+		sim_error("-param %s: not a number", arg);
+	if (strlen(params) + strlen(arg) + 2 > sizeof(params))
+		sim_error("Too many parameters");
+
+	if (params[0])
+		strcat(params, " ");
+	strcat(params, arg);
+}
+
+/* Set the parameters of -param before init() */
+static void set_params(policy_t *policy)
+{
+	char buf[MAX_PARAMS_LEN], *name, *eq, *save;
+
+	strcpy(buf, params);
+	for (name = strtok_r(buf, " ", &save); name;
+			name = strtok_r(NULL, " ", &save)) {
+		eq = strchr(name, '=');
+		*eq = '\0';
+		if (!policy->set_param)
+			sim_error("%s has no parameters", policy->name);
+		if (policy->set_param(policy, name, strtod(eq + 1, NULL)))
+			sim_error("%s has no parameter %s of %s", policy->name,
+					name, eq + 1);
+	}
+}
+
 void parse_opt_args(int argc, char **argv)
 {
 	int i;
@@ -51,9 +289,41 @@ void parse_opt_args(int argc, char **argv)
 			debug = true;
 		else if (!strcmp(argv[i], "-r"))
 			refault_stat = true;
+		else if (!strcmp(argv[i], "-p"))
+			pipelined = true;
+		else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+			ckpt_path = argv[++i];
+		else if (!strcmp(argv[i], "-ci") && i + 1 < argc)
+			ckpt_interval = atol(argv[++i]);
+		else if (!strcmp(argv[i], "-restore") && i + 1 < argc)
+			restore_path = argv[++i];
+		else if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+			seed = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-param") && i + 1 < argc)
+			add_param(argv[++i]);
+		else if (!strcmp(argv[i], "-shards") && i + 1 < argc)
+			shards_start(strtod(argv[++i], NULL));
+		else if (!strcmp(argv[i], "-shards-size") && i + 1 < argc)
+			shards_size = atol(argv[++i]);
+		else if (!strcmp(argv[i], "-windows") && i + 1 < argc)
+			windows_start(argv[++i]);
 		else
 			wrong_args(argc, argv);
 	}
+
+	if (shards_size < 0 || (shards_size && shards_rate))
+		wrong_args(argc, argv);
+	if ((shards_rate || shards_size || window_period) &&
+			(ckpt_path || restore_path))
+		sim_error("Sampled pages or windows cannot be checkpointed");
+	if ((shards_rate || shards_size) && window_period)
+		sim_error("-windows cannot be used with -shards");
+
+	if (ckpt_interval && !ckpt_path)
+		wrong_args(argc, argv);
+	if (ckpt_path && pipelined)
+		sim_error("The decoder thread reads ahead of checkpoints; "
+				"-c cannot be used with -p");
 }
 
 void init_policy_list(void)
@@ -79,46 +349,404 @@ policy_t *search_policy(const char *name)
 	return NULL;
 }
 
+/*
+ * An instance of a registered policy, with data of its own; a policy without
+ * data_size keeps the data of the template, so it has a single instance
+ */
+policy_t *new_policy(const policy_t *tmpl)
+{
+	policy_t *policy = malloc(sizeof(policy_t));
+
+	if (!policy)
+		sim_error("Failed to allocate the policy");
+
+	*policy = *tmpl;
+	if (tmpl->data_size)
+		policy->data = calloc(1, tmpl->data_size);
+	policy->refault = refault_alloc();
+	policy->sim = calloc(1, sizeof(struct sim_state));
+	if ((tmpl->data_size && !policy->data) || !policy->sim)
+		sim_error("Failed to allocate the policy");
+
+	return policy;
+}
+
+/* Sample windows given as <period>:<warm-up>:<measure> references */
+void windows_start(const char *arg)
+{
+	long period, warmup, measure;
+
+	if (sscanf(arg, "%ld:%ld:%ld", &period, &warmup, &measure) != 3 ||
+			warmup < 0 || measure <= 0 || warmup + measure > period)
+		sim_error("The windows must be <period>:<warm-up>:<measure> "
+				"references, with warm-up + measure <= period");
+
+	window_period = period;
+	window_warmup = warmup;
+	window_measure = measure;
+}
+
+static void window_record(policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+	struct window *win;
+
+	if (sim->nr_windows == sim->max_windows) {
+		sim->max_windows = sim->max_windows ? 2 * sim->max_windows : 64;
+		sim->windows = realloc(sim->windows,
+				sim->max_windows * sizeof(struct window));
+		if (!sim->windows)
+			sim_error("Failed to allocate the windows");
+	}
+
+	win = &sim->windows[sim->nr_windows++];
+	win->refs = sim->window_refs - sim->window_snap_refs;
+	win->accesses = policy->stats.cnt[NR_TOTAL] -
+		sim->window_snap.cnt[NR_TOTAL];
+	win->misses = policy->stats.cnt[NR_MISS] -
+		sim->window_snap.cnt[NR_MISS];
+}
+
+/* Go on to the next phase: warm-up, measure and fast-forward */
+static void window_next(policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+
+	switch (sim->window_phase) {
+		case WINDOW_FF:
+			sim->window_phase = WINDOW_WARM;
+			sim->window_left += window_warmup;
+			break;
+
+		case WINDOW_WARM:
+			sim->window_phase = WINDOW_MEASURE;
+			sim->window_left += window_measure;
+			sim->window_snap = policy->stats;
+			sim->window_snap_refs = sim->window_refs;
+			break;
+
+		case WINDOW_MEASURE:
+			window_record(policy);
+			sim->window_phase = WINDOW_FF;
+			sim->window_left += window_period - window_warmup -
+				window_measure;
+			break;
+	}
+}
+
+/*
+ * Move past nr references to accesses pages in all, once they are simulated
+ * (or not)
+ */
+static inline void window_advance(policy_t *policy, unsigned long nr,
+		unsigned long accesses)
+{
+	struct sim_state *sim = policy->sim;
+
+	sim->window_refs += nr;
+	sim->window_accesses += accesses;
+	sim->window_left -= nr;
+	while (sim->window_left <= 0)
+		window_next(policy);
+}
+
+/* The memory of the sampled pages (kB), a page at least */
+static unsigned long shards_memsz(unsigned long memsz)
+{
+	unsigned long nr_pages = (memsz * 1024) >> PAGE_SHIFT;
+
+	nr_pages = lround(nr_pages * shards_rate);
+	if (!nr_pages)
+		nr_pages = 1;
+
+	return (nr_pages << PAGE_SHIFT) / 1024;
+}
+
 void init_policy(policy_t *policy, unsigned long memsz)
 {
 	int i;
 
+	if (shards_rate)
+		memsz = shards_memsz(memsz);
+	if (window_period && policy->post_sim)
+		sim_error("%s counts its misses at the end; it cannot be "
+				"sampled in windows", policy->name);
+
 	policy->init(policy, memsz);
 	policy->cold_state = true;
 	policy->warm_state = false;
 
 	for (i = NR_HIT; i < NR_STATS_VERBOSE; i++)
 		(policy->stats).cnt[i] = 0;
+
+	if (window_period) {
+		policy->sim->window_phase = WINDOW_FF;
+		policy->sim->window_left = 0;
+		while (policy->sim->window_left <= 0)
+			window_next(policy);
+	}
 }
 
-size_t read_trace(void *ptr, size_t size, FILE *tracefile, bool term)
+/* The finalizer of MurmurHash3, a bijection of the vpns */
+static inline uint64_t shards_hash(unsigned long vpn)
 {
-	size_t nr;
+	uint64_t hash = vpn;
 
-	nr = fread(ptr, 1, size, tracefile);
-	if (term && nr != size) {
-		fprintf(stderr, "Invalid remaining trace length\n");
-		exit(1);
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* Sample the pages at the rate, in (0, 1] */
+void shards_start(double rate)
+{
+	if (!(rate > 0 && rate <= 1))
+		sim_error("The sampling rate must be in (0, 1]");
+
+	shards_rate = rate;
+	shards_threshold = rate < 1 ?
+		(uint64_t) (rate * SHARDS_HASH_RANGE) : UINT64_MAX;
+}
+
+struct shards_scan *shards_scan_start(long size)
+{
+	struct shards_scan *scan = calloc(1, sizeof(*scan));
+
+	if (scan) {
+		scan->size = size;
+		scan->max = 2 * size;
+		scan->threshold = UINT64_MAX;
+		scan->hashes = malloc(scan->max * sizeof(uint64_t));
+	}
+	if (!scan || !scan->hashes)
+		sim_error("Failed to allocate the sample");
+
+	return scan;
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Drop the duplicates, and keep the size lowest hashes */
+static void shards_scan_compact(struct shards_scan *scan)
+{
+	uint64_t *hashes = scan->hashes;
+	long i, nr = 0;
+
+	qsort(hashes, scan->nr, sizeof(uint64_t), cmp_hash);
+	for (i = 0; i < scan->nr; i++) {
+		if (!nr || hashes[i] != hashes[nr - 1])
+			hashes[nr++] = hashes[i];
+	}
+
+	if (nr >= scan->size) {
+		nr = scan->size;
+		scan->threshold = hashes[nr - 1];
+	}
+	scan->nr = nr;
+}
+
+static inline void shards_scan_pages(struct shards_scan *scan,
+		unsigned long vpn, unsigned long nr_pages)
+{
+	uint64_t hash;
+
+	for (; nr_pages; nr_pages--, vpn++) {
+		hash = shards_hash(vpn);
+		if (hash > scan->threshold)
+			continue;
+		/* the references in a row to a page are kept once */
+		if (scan->nr && scan->hashes[scan->nr - 1] == hash)
+			continue;
+
+		if (scan->nr == scan->max) {
+			shards_scan_compact(scan);
+			if (hash > scan->threshold)
+				continue;
+		}
+		scan->hashes[scan->nr++] = hash;
 	}
+}
+
+/* Scan the pages referenced by decoded events */
+void shards_scan(struct shards_scan *scan, const struct sim_event *events,
+		long nr_events, const struct trace_entry *entries)
+{
+	const struct trace_entry *ent;
+	long i;
 
-	return nr;
+	for (i = 0; i < nr_events; i++) {
+		if (events[i].type == EVENT_REF) {
+			shards_scan_pages(scan, events[i].vpn, events[i].nr_pages);
+			continue;
+		} else if (events[i].type == EVENT_RUN) {
+			shards_scan_pages(scan, events[i].vpn, 1);
+			continue;
+		}
+
+		ent = &entries[events[i].vpn];
+		if (ent->type == TYPE_HITS)
+			shards_scan_pages(scan, addr_to_vpn(ent->addr), 1);
+		else if (ent->type == TYPE_RANGE && ent->arg1)
+			shards_scan_pages(scan, addr_to_vpn(ent->addr),
+					addr_to_vpn(ent->addr + ent->arg1 - 1) -
+					addr_to_vpn(ent->addr) + 1);
+	}
+}
+
+/* The rate sampling size pages of those scanned (1 if fewer); frees scan */
+double shards_scan_end(struct shards_scan *scan)
+{
+	double rate = 1;
+
+	shards_scan_compact(scan);
+	if (scan->nr == scan->size)
+		rate = (scan->threshold + 1.0L) / SHARDS_HASH_RANGE;
+
+	free(scan->hashes);
+	free(scan);
+
+	return rate;
+}
+
+/* The group of a page counting nr references to it; NULL if not sampled */
+static inline struct shards_group *shards_sample(policy_t *policy,
+		unsigned long vpn, unsigned long nr)
+{
+	struct sim_state *sim = policy->sim;
+	struct shards_group *group;
+	uint64_t hash = shards_hash(vpn);
+
+	sim->shards_refs += nr;
+	if (hash >= shards_threshold)
+		return NULL;
+
+	group = &sim->shards_groups[hash % SHARDS_NR_GROUPS];
+	group->refs += nr;
+	return group;
+}
+
+/* Access a page, counting the cold misses once the memory is full */
+static inline void sim_page(unsigned long vpn, policy_t *policy)
+{
+	policy->access(policy, vpn);
+	if (!policy->cold_state && !policy->warm_state) {
+		policy->stats.cnt[NR_COLD_MISS] = policy->stats.cnt[NR_MISS];
+		policy->warm_state = true;
+	}
+}
+
+/* Access the sampled pages of a reference, counting the misses by group */
+static void sim_pages_sampled(unsigned long vpn, unsigned long nr_pages,
+		policy_t *policy)
+{
+	struct shards_group *group;
+	long miss;
+
+	for (; nr_pages; nr_pages--, vpn++) {
+		group = shards_sample(policy, vpn, 1);
+		if (!group)
+			continue;
+
+		miss = policy->stats.cnt[NR_MISS];
+		sim_page(vpn, policy);
+		group->misses += policy->stats.cnt[NR_MISS] - miss;
+	}
+}
+
+static inline void __sim_pages(unsigned long vpn, unsigned long nr_pages,
+		policy_t *policy)
+{
+	if (shards_rate) {
+		sim_pages_sampled(vpn, nr_pages, policy);
+		return;
+	}
+
+	/* at once after the cold misses, which are counted page by page */
+	if (nr_pages > 1 && policy->access_range && policy->warm_state) {
+		policy->access_range(policy, vpn, nr_pages);
+		return;
+	}
+
+	for (; nr_pages; nr_pages--, vpn++)
+		sim_page(vpn, policy);
+}
+
+/* Access the pages touched by a reference */
+static inline void sim_pages(unsigned long vpn, unsigned long nr_pages,
+		policy_t *policy)
+{
+	if (window_period) {
+		if (policy->sim->window_phase != WINDOW_FF)
+			__sim_pages(vpn, nr_pages, policy);
+		window_advance(policy, 1, nr_pages);
+		return;
+	}
+
+	__sim_pages(vpn, nr_pages, policy);
 }
 
 void sim_ref(unsigned long addr, int size, policy_t *policy)
 {
-	unsigned long vpn;
+	unsigned long first = addr_to_vpn(addr);
+	unsigned long last = addr_to_vpn(addr + size - 1);
 
 	if (debug)
 		printf("%#018lx %#x\n", addr, size);
 
-	for (vpn = addr_to_vpn(addr);
-			vpn <= addr_to_vpn(addr + size - 1); vpn++) {
-		policy->access(policy, vpn);
-		if (!policy->cold_state && !policy->warm_state) {
-			policy->stats.cnt[NR_COLD_MISS] = policy->stats.cnt[NR_MISS];
-			policy->warm_state = true;
-		}
+	if (last >= first)
+		sim_pages(first, last - first + 1, policy);
+}
+
+/* Range of a string instruction, gather or scatter */
+void sim_range(unsigned long addr, unsigned long len, bool write,
+		policy_t *policy)
+{
+	if (debug)
+		printf("%#018lx range %#lx%s\n", addr, len, write ? " write" : "");
+
+	if (len)
+		sim_pages(addr_to_vpn(addr),
+				addr_to_vpn(addr + len - 1) - addr_to_vpn(addr) + 1, policy);
+}
+
+/* Consecutive accesses to a page of a converted trace */
+static inline void sim_run(unsigned long vpn, unsigned long run,
+		policy_t *policy)
+{
+	if (debug)
+		printf("%#018lx run %lu\n", vpn, run);
+
+	for (; run; run--)
+		sim_pages(vpn, 1, policy);
+}
+
+/* References that hit the cache filter of posetrace */
+void sim_hits(unsigned long addr, unsigned long count, policy_t *policy)
+{
+	if (debug)
+		printf("%#018lx hits %lu\n", addr, count);
+
+	if (window_period && policy->sim->window_phase == WINDOW_FF) {
+		window_advance(policy, count, count);
+		return;
 	}
+	if (shards_rate && !shards_sample(policy, addr_to_vpn(addr), count))
+		return;
+
+	policy_count_stat(policy, NR_HIT, count);
+	policy_count_stat(policy, NR_TOTAL, count);
+
+	if (window_period)
+		window_advance(policy, count, count);
 }
 
 void sim_malloc(unsigned long addr, unsigned long size,
@@ -186,74 +814,763 @@ void sim_free(unsigned long addr, policy_t *policy)
 	}
 }
 
-void count_inst(unsigned long icount, policy_t *policy)
+static void sim_discard(unsigned long addr, unsigned long size,
+		policy_t *policy)
 {
-	policy->stats.cnt[NR_INST] = icount;
+	int err;
+
+	if (!policy->mem_discard || !size)
+		return;
+
+	err = policy->mem_discard(policy, addr, size);
+	if (err)
+		sim_error("mem_discard() failed");
 }
 
-void simulate(policy_t *policy, FILE *tracefile)
+static void map_alloc(unsigned long addr, unsigned long size,
+		policy_t *policy)
 {
-	unsigned long addr, type;
-	int ref_size;
-	unsigned long m_size, m_nmemb, m_ptr;
-	size_t nr;
+	struct sim_state *sim = policy->sim;
+	struct map_area *area;
+	int err;
 
-	nr = read_trace(&addr, sizeof(unsigned long), tracefile, false);
+	sim->map_areas = realloc(sim->map_areas,
+			(sim->nr_map_areas + 1) * sizeof(struct map_area));
+	if (!sim->map_areas)
+		sim_error("Failed to allocate the mapped areas");
 
-	while (nr == sizeof(unsigned long)) {
-		type = ENTRY_TYPE(addr);
-		addr = ENTRY_ADDR(addr);
+	area = &sim->map_areas[sim->nr_map_areas++];
+	area->start = addr;
+	area->end = addr + size;
 
-		switch (type) {
-			case TYPE_REF:
-				read_trace(&ref_size, sizeof(int), tracefile, true);
-				sim_ref(addr, ref_size, policy);
-				break;
+	err = policy->mem_alloc(policy, addr, size);
+	if (err)
+		sim_error("mmap() failed");
+}
 
-			case TYPE_MALLOC:
-				read_trace(&m_size, sizeof(unsigned long), tracefile, true);
-				sim_malloc(addr, m_size, policy);
-				break;
+/* Free the areas starting in [addr, addr + size); returns true if any */
+static bool map_free(unsigned long addr, unsigned long size,
+		policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+	struct map_area *areas = sim->map_areas;
+	bool found = false;
+	int i, err;
+
+	for (i = 0; i < sim->nr_map_areas; i++) {
+		if (areas[i].start < addr || areas[i].start >= addr + size)
+			continue;
 
-			case TYPE_CALLOC:
-				read_trace(&m_nmemb, sizeof(unsigned long), tracefile, true);
-				read_trace(&m_size, sizeof(unsigned long), tracefile, true);
-				sim_calloc(addr, m_nmemb, m_size, policy);
-				break;
+		err = policy->mem_free(policy, areas[i].start);
+		if (err)
+			sim_error("munmap() failed");
 
-			case TYPE_REALLOC:
-				read_trace(&m_ptr, sizeof(unsigned long), tracefile, true);
-				read_trace(&m_size, sizeof(unsigned long), tracefile, true);
-				sim_realloc(addr, m_ptr, m_size, policy);
-				break;
+		areas[i--] = areas[--sim->nr_map_areas];
+		found = true;
+	}
 
-			case TYPE_FREE:
-				sim_free(addr, policy);
-				break;
+	return found;
+}
 
-			case TYPE_ICOUNT:
-				count_inst(addr, policy);
-				break;
+void sim_mmap(struct trace_entry *ent, policy_t *policy)
+{
+	unsigned long op = ent->arg1 & MMAP_OP_MASK;
+	bool in_alloc = ent->arg1 & MMAP_IN_ALLOC;
+	unsigned long addr = ent->addr, size = ent->arg2;
+	unsigned long old_addr = ent->arg3, old_size = ent->arg4;
+	unsigned long *brk_end = &policy->sim->brk_end;
+	bool mapped;
 
-			default:
-				/* wrong path */
-				printf("Wrong trace entry type..\n");
-				exit(1);
+	switch (op) {
+		case MMAP_OP_MMAP:
+			if (debug)
+				printf("%#lx = mmap(%#lx, %#lx, %#lx)\n",
+						addr, size, ent->arg4, ent->arg3);
+
+			/* the contents of a fixed mapping are replaced */
+			if (ent->arg3 & LINUX_MAP_FIXED)
+				sim_discard(addr, size, policy);
+			else if (!in_alloc && (ent->arg3 & LINUX_MAP_ANONYMOUS))
+				map_alloc(addr, size, policy);
+			break;
+
+		case MMAP_OP_MUNMAP:
+			if (debug)
+				printf("munmap(%#lx, %#lx)\n", addr, size);
+
+			map_free(addr, size, policy);
+			sim_discard(addr, size, policy);
+			break;
+
+		case MMAP_OP_MREMAP:
+			if (debug)
+				printf("%#lx = mremap(%#lx, %#lx, %#lx)\n",
+						addr, old_addr, old_size, size);
+
+			/* the pages moved are simply dropped from the old range */
+			mapped = map_free(old_addr, 1, policy);
+			if (addr != old_addr)
+				sim_discard(old_addr, old_size, policy);
+			else if (size < old_size)
+				sim_discard(addr + size, old_size - size, policy);
+			if (mapped)
+				map_alloc(addr, size, policy);
+			break;
+
+		case MMAP_OP_BRK:
+			if (debug)
+				printf("%#lx = brk(%#lx)\n", addr, ent->arg3);
+
+			/* the first brk() only tells the initial break */
+			if (*brk_end && addr < *brk_end)
+				sim_discard(addr, *brk_end - addr, policy);
+			else if (*brk_end && addr > *brk_end && !in_alloc)
+				map_alloc(*brk_end, addr - *brk_end, policy);
+			*brk_end = addr;
+			break;
+
+		case MMAP_OP_MADVISE:
+			if (debug)
+				printf("madvise(%#lx, %#lx, %lu)\n", addr, size, ent->arg3);
+
+			if (ent->arg3 == LINUX_MADV_DONTNEED ||
+					ent->arg3 == LINUX_MADV_FREE)
+				sim_discard(addr, size, policy);
+			break;
+	}
+}
+
+static struct sample_thread *get_sample_thread(struct sim_state *sim,
+		unsigned long tid)
+{
+	struct sample_thread *thread;
+	int i;
+
+	for (i = 0; i < sim->nr_sample_threads; i++) {
+		if (sim->sample_threads[i].tid == tid)
+			return &sim->sample_threads[i];
+	}
+
+	sim->sample_threads = realloc(sim->sample_threads,
+			(sim->nr_sample_threads + 1) * sizeof(struct sample_thread));
+	if (!sim->sample_threads)
+		sim_error("Failed to allocate the sampling state");
+
+	/* threads start fast-forwarding until the first phase entry */
+	thread = &sim->sample_threads[sim->nr_sample_threads++];
+	thread->tid = tid;
+	thread->phase = PHASE_FF;
+	thread->start = 0;
+
+	return thread;
+}
+
+void sim_phase(unsigned long tid, unsigned long icount, int phase,
+		policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+	struct sample_thread *thread = get_sample_thread(sim, tid);
+	int i;
+
+	if (debug)
+		printf("tid %lu phase %d at %lu\n", tid, phase, icount);
+
+	sim->sampled = true;
+
+	if (thread->phase == PHASE_MEASURE) {
+		sim->sample_inst += icount - thread->start;
+		if (!--sim->nr_measuring) {
+			for (i = NR_HIT; i < NR_STATS_VERBOSE; i++)
+				sim->sample_stats.cnt[i] +=
+					policy->stats.cnt[i] - sim->sample_snap.cnt[i];
+		}
+	}
+
+	if (phase == PHASE_MEASURE) {
+		if (!sim->nr_measuring++)
+			sim->sample_snap = policy->stats;
+	}
+
+	thread->phase = phase;
+	thread->start = icount;
+}
+
+/* Each thread records its own icount */
+void count_inst(unsigned long tid, unsigned long icount, policy_t *policy)
+{
+	/* the last phase of the thread ends at the exit */
+	if (policy->sim->sampled)
+		sim_phase(tid, icount, PHASE_FF, policy);
+
+	policy->stats.cnt[NR_INST] += icount;
+}
+
+static void sim_entry(struct trace_entry *ent, policy_t *policy)
+{
+	switch (ent->type) {
+		case TYPE_REF:
+			sim_ref(ent->addr, (int)ent->arg1, policy);
+			break;
+
+		case ENTRY_PAGE_RUN:
+			sim_run(ent->addr, ent->arg1, policy);
+			break;
+
+		case TYPE_HITS:
+			sim_hits(ent->addr, ent->arg1, policy);
+			break;
+
+		case TYPE_RANGE:
+			sim_range(ent->addr, ent->arg1, ent->arg2, policy);
+			break;
+
+		case TYPE_MALLOC:
+			sim_malloc(ent->addr, ent->arg1, policy);
+			break;
+
+		case TYPE_CALLOC:
+			sim_calloc(ent->addr, ent->arg1, ent->arg2, policy);
+			break;
+
+		case TYPE_REALLOC:
+			sim_realloc(ent->addr, ent->arg1, ent->arg2, policy);
+			break;
+
+		case TYPE_FREE:
+			sim_free(ent->addr, policy);
+			break;
+
+		case TYPE_MMAP:
+			sim_mmap(ent, policy);
+			break;
+
+		case TYPE_PHASE:
+			sim_phase(ent->tid, ent->addr, (int)ent->arg1, policy);
+			break;
+
+		case TYPE_ICOUNT:
+			count_inst(ent->tid, ent->addr, policy);
+			break;
+
+		default:
+			/* wrong path */
+			printf("Wrong trace entry type..\n");
+			exit(1);
+	}
+}
+
+static unsigned long trace_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st)) {
+		perror(path);
+		exit(1);
+	}
+
+	return st.st_size;
+}
+
+static void ckpt_header(struct ckpt_header *hdr, policy_t *policy,
+		unsigned long memsz)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = CKPT_MAGIC;
+	hdr->version = CKPT_VERSION;
+	memcpy(hdr->policy, policy->name, sizeof(hdr->policy));
+	hdr->memsz = memsz;
+	strcpy(hdr->params, params);
+}
+
+/* State of sim other than the policy */
+static void save_sim(FILE *file, policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+	bool state[3] = { policy->cold_state, policy->warm_state, sim->sampled };
+	long nr[2] = { sim->nr_sample_threads, sim->nr_map_areas };
+
+	ckpt_write(file, &policy->stats, sizeof(policy->stats));
+	ckpt_write(file, state, sizeof(state));
+	ckpt_write(file, nr, sizeof(nr));
+	ckpt_write(file, sim->sample_threads,
+			sim->nr_sample_threads * sizeof(struct sample_thread));
+	ckpt_write(file, &sim->nr_measuring, sizeof(sim->nr_measuring));
+	ckpt_write(file, &sim->sample_snap, sizeof(sim->sample_snap));
+	ckpt_write(file, &sim->sample_stats, sizeof(sim->sample_stats));
+	ckpt_write(file, &sim->sample_inst, sizeof(sim->sample_inst));
+	ckpt_write(file, sim->map_areas,
+			sim->nr_map_areas * sizeof(struct map_area));
+	ckpt_write(file, &sim->brk_end, sizeof(sim->brk_end));
+	refault_save(policy->refault, file);
+}
+
+static void restore_sim(FILE *file, policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+	bool state[3];
+	long nr[2];
+
+	ckpt_read(file, &policy->stats, sizeof(policy->stats));
+	ckpt_read(file, state, sizeof(state));
+	policy->cold_state = state[0];
+	policy->warm_state = state[1];
+	sim->sampled = state[2];
+
+	ckpt_read(file, nr, sizeof(nr));
+	if (nr[0] < 0 || nr[1] < 0)
+		sim_error("Invalid checkpoint");
+	sim->nr_sample_threads = nr[0];
+	sim->nr_map_areas = nr[1];
+	sim->sample_threads = malloc(nr[0] * sizeof(struct sample_thread) + 1);
+	sim->map_areas = malloc(nr[1] * sizeof(struct map_area) + 1);
+	if (!sim->sample_threads || !sim->map_areas)
+		sim_error("Failed to restore the checkpoint");
+
+	ckpt_read(file, sim->sample_threads,
+			sim->nr_sample_threads * sizeof(struct sample_thread));
+	ckpt_read(file, &sim->nr_measuring, sizeof(sim->nr_measuring));
+	ckpt_read(file, &sim->sample_snap, sizeof(sim->sample_snap));
+	ckpt_read(file, &sim->sample_stats, sizeof(sim->sample_stats));
+	ckpt_read(file, &sim->sample_inst, sizeof(sim->sample_inst));
+	ckpt_read(file, sim->map_areas,
+			sim->nr_map_areas * sizeof(struct map_area));
+	ckpt_read(file, &sim->brk_end, sizeof(sim->brk_end));
+	refault_restore(policy->refault, file);
+}
+
+static void request_checkpoint(int sig)
+{
+	ckpt_requested = 1;
+}
+
+/* Write a checkpoint at the current position of the trace */
+static void checkpoint(policy_t *policy, struct trace *trace)
+{
+	struct ckpt_header hdr;
+	struct trace_pos tpos;
+	char *tmp;
+	FILE *file;
+
+	ckpt_requested = 0;
+	if (ckpt_interval)
+		ckpt_next = policy->stats.cnt[NR_TOTAL] + ckpt_interval;
+
+	tmp = malloc(strlen(ckpt_path) + sizeof(".tmp"));
+	if (!tmp)
+		sim_error("Failed to write the checkpoint");
+	sprintf(tmp, "%s.tmp", ckpt_path);
+
+	file = fopen(tmp, "wb");
+	if (!file) {
+		perror(tmp);
+		exit(1);
+	}
+
+	ckpt_header(&hdr, policy, ckpt_memsz);
+	hdr.trace_size = ckpt_trace_size;
+	trace_tell(trace, &tpos);
+
+	ckpt_write(file, &hdr, sizeof(hdr));
+	ckpt_write(file, &tpos, sizeof(tpos));
+	save_sim(file, policy);
+	if (policy->save(policy, file))
+		sim_error("%s failed to save the checkpoint", policy->name);
+
+	if (fclose(file) || rename(tmp, ckpt_path)) {
+		perror(ckpt_path);
+		exit(1);
+	}
+	free(tmp);
+
+	if (verbose)
+		fprintf(stderr, "checkpoint at %ld accesses\n",
+				policy->stats.cnt[NR_TOTAL]);
+}
+
+/* Resume from a checkpoint of the same policy, size and trace */
+static void restore(policy_t *policy, struct trace *trace)
+{
+	struct ckpt_header hdr, expected;
+	struct trace_pos tpos;
+	FILE *file;
+
+	file = fopen(restore_path, "rb");
+	if (!file) {
+		perror(restore_path);
+		exit(1);
+	}
+
+	ckpt_header(&expected, policy, ckpt_memsz);
+	expected.trace_size = ckpt_trace_size;
+	ckpt_read(file, &hdr, sizeof(hdr));
+	if (hdr.magic != CKPT_MAGIC || hdr.version != CKPT_VERSION)
+		sim_error("Invalid checkpoint");
+	hdr.params[sizeof(hdr.params) - 1] = '\0';
+	memcpy(expected.params, hdr.params, sizeof(hdr.params));
+	if (memcmp(&hdr, &expected, sizeof(hdr)))
+		sim_error("The checkpoint is of another policy, memory size "
+				"or trace");
+	/* a warmed-up state may be run on with other parameters */
+	if (strcmp(hdr.params, params))
+		fprintf(stderr, "checkpoint of -param \"%s\" restored with "
+				"\"%s\"\n", hdr.params, params);
+
+	ckpt_read(file, &tpos, sizeof(tpos));
+	restore_sim(file, policy);
+	if (policy->restore(policy, file))
+		sim_error("Invalid checkpoint");
+	fclose(file);
+
+	trace_seek(trace, &tpos);
+}
+
+/* Simulate decoded events, whose entries are indexed in entries */
+void simulate_events(policy_t *policy, const struct sim_event *events,
+		long nr_events, struct trace_entry *entries)
+{
+	const struct sim_event *ev;
+	long i;
+
+	for (i = 0; i < nr_events; i++) {
+		ev = &events[i];
+		if (ev->type == EVENT_REF)
+			sim_pages(ev->vpn, ev->nr_pages, policy);
+		else if (ev->type == EVENT_RUN)
+			sim_run(ev->vpn, ev->nr_pages, policy);
+		else
+			sim_entry(&entries[ev->vpn], policy);
+	}
+}
+
+/* Simulate the events of a decoder as its consumer */
+void simulate_decoded(policy_t *policy, struct decoder *dec, int consumer)
+{
+	struct sim_batch *batch;
+
+	while ((batch = decoder_next(dec, consumer))) {
+		simulate_events(policy, batch->events, batch->nr_events,
+				batch->entries);
+		decoder_release(dec, consumer);
+	}
+}
+
+/* Simulate the events decoded by the decoder thread */
+static void simulate_pipelined(policy_t *policy, struct trace *trace)
+{
+	struct decoder *dec = decoder_start(trace, 1);
+
+	simulate_decoded(policy, dec, 0);
+	decoder_stop(dec);
+}
+
+void simulate(policy_t *policy, struct trace *trace)
+{
+	unsigned long vpns[SIM_NR_VPNS];
+	struct trace_entry ent;
+	int i, n, nr;
+
+	/* the references are printed in order only without the decoder */
+	if (pipelined && !debug) {
+		simulate_pipelined(policy, trace);
+		return;
+	}
+
+	for (;;) {
+		/* runs of references are decoded at once, unless printed */
+		if (!debug && (nr = trace_next_vpns(trace, vpns, SIM_NR_VPNS))) {
+			for (i = 0; i < nr; i += n) {
+				/* the next pages of a reference are marked */
+				for (n = 1; i + n < nr &&
+						(vpns[i + n] & VPN_NEXT_PAGE); n++)
+					;
+				sim_pages(vpns[i], n, policy);
+			}
+		} else if (trace_next(trace, &ent)) {
+			sim_entry(&ent, policy);
+		} else {
+			break;
 		}
 
-		nr = read_trace(&addr, sizeof(unsigned long), tracefile, false);
+		if (ckpt_requested || policy->stats.cnt[NR_TOTAL] >= ckpt_next)
+			checkpoint(policy, trace);
 	}
 }
 
 void post_sim(policy_t *policy)
 {
+	struct sim_state *sim = policy->sim;
+
 	if (policy->post_sim)
 		policy->post_sim(policy);
+
+	/* the last window, cut short */
+	if (window_period && sim->window_phase == WINDOW_MEASURE) {
+		if (sim->window_refs > sim->window_snap_refs)
+			window_record(policy);
+		sim->window_phase = WINDOW_FF;
+	}
+}
+
+/*
+ * Standard error of the miss ratio (%) of the sampled pages, from the spread
+ * of their groups; -1 if not known
+ */
+static double shards_error(policy_t *policy)
+{
+	struct shards_group *groups = policy->sim->shards_groups;
+	double refs = 0, misses = 0, ratio, dev, sq = 0;
+	int i;
+
+	if (!shards_rate || policy->post_sim)
+		return -1;
+
+	for (i = 0; i < SHARDS_NR_GROUPS; i++) {
+		refs += groups[i].refs;
+		misses += groups[i].misses;
+	}
+	if (!refs)
+		return -1;
+
+	ratio = misses / refs;
+	for (i = 0; i < SHARDS_NR_GROUPS; i++) {
+		dev = groups[i].misses - ratio * groups[i].refs;
+		sq += dev * dev;
+	}
+
+	return sqrt(sq * SHARDS_NR_GROUPS / (SHARDS_NR_GROUPS - 1)) / refs * 100;
+}
+
+/* Rescale the counts of the sampled references to all the references */
+static void shards_scale(policy_t *policy, struct sim_stats *stats)
+{
+	long sampled = policy->stats.cnt[NR_TOTAL];
+	double scale;
+	int i;
+
+	if (!shards_rate || !sampled)
+		return;
+
+	scale = (double) policy->sim->shards_refs / sampled;
+	for (i = NR_HIT; i <= NR_TOTAL; i++)
+		stats->cnt[i] = llround(stats->cnt[i] * scale);
+}
+
+/* The rate and the 95% confidence interval of the miss ratio */
+static void report_shards(policy_t *policy)
+{
+	double err = shards_error(policy);
+
+	printf("|     shards:  %8.4lf %%    |\n", shards_rate * 100);
+	if (err >= 0)
+		printf("|  miss ci95:  +-%6.2lf %%    |\n", 1.96 * err);
+}
+
+/* t_{0.975} of Student's t-distribution with df degrees of freedom */
+static const double t_975[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+double t_quantile(int df)
+{
+	double z = 1.959964;
+
+	if (df <= (int) (sizeof(t_975) / sizeof(t_975[0])))
+		return t_975[df - 1];
+	/* the first term of the expansion in 1/df (Cornish-Fisher) */
+	return z + (z * z * z + z) / (4 * df);
+}
+
+/*
+ * Miss ratio of the windows measured, and the half-width of its 95%
+ * confidence interval (-1 with fewer than two windows), corrected for the
+ * fraction of the trace measured
+ */
+static double window_ratio(policy_t *policy, double *ci)
+{
+	struct sim_state *sim = policy->sim;
+	struct window *wins = sim->windows;
+	double refs = 0, accesses = 0, misses = 0, ratio, dev, sq = 0, frac;
+	int i, n = sim->nr_windows;
+
+	for (i = 0; i < n; i++) {
+		refs += wins[i].refs;
+		accesses += wins[i].accesses;
+		misses += wins[i].misses;
+	}
+	ratio = accesses ? misses / accesses : 0;
+
+	*ci = -1;
+	if (n < 2 || !accesses)
+		return ratio;
+
+	for (i = 0; i < n; i++) {
+		dev = wins[i].misses - ratio * wins[i].accesses;
+		sq += dev * dev;
+	}
+	/* of the references, by which the windows are taken */
+	frac = refs < sim->window_refs ? refs / sim->window_refs : 1;
+	*ci = t_quantile(n - 1) * sqrt(sq * n / (n - 1) * (1 - frac)) / accesses;
+
+	return ratio;
+}
+
+/* The counts of the whole trace, as estimated from the windows */
+static void window_estimate(policy_t *policy, struct sim_stats *stats)
+{
+	long total = policy->sim->window_accesses;
+	double ci, ratio = window_ratio(policy, &ci);
+
+	*stats = policy->stats;
+	stats->cnt[NR_MISS] = llround(ratio * total);
+	stats->cnt[NR_HIT] = total - stats->cnt[NR_MISS];
+	stats->cnt[NR_COLD_MISS] = 0;
+	stats->cnt[NR_TOTAL] = total;
+}
+
+/*
+ * Half-width of the 95% confidence interval of the miss ratio (%) of
+ * sampled pages or windows; -1 if not known
+ */
+double miss_ratio_ci95(policy_t *policy)
+{
+	double ci, err;
+
+	if (window_period) {
+		window_ratio(policy, &ci);
+		return ci >= 0 ? ci * 100 : -1;
+	}
+
+	err = shards_error(policy);
+	return err >= 0 ? 1.96 * err : -1;
+}
+
+/* Estimate the whole trace from the windows measured */
+static void report_windows(policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+	struct sim_stats stats;
+	double ratio, ci, measured = 0;
+	long total, inst;
+	int i;
+
+	ratio = window_ratio(policy, &ci);
+	window_estimate(policy, &stats);
+	total = stats.cnt[NR_TOTAL];
+	inst = stats.cnt[NR_INST];
+
+	for (i = 0; i < sim->nr_windows; i++)
+		measured += sim->windows[i].refs;
+	measured = sim->window_refs ? measured / sim->window_refs * 100 : 0;
+
+	printf("+----------------------------+\n");
+	printf("|  hit ratio:    %6.2lf %%    |\n", (1 - ratio) * 100);
+	printf("| miss ratio:    %6.2lf %%    |\n", ratio * 100);
+	if (inst)
+		printf("|  miss rate: %9.2lf mpmi |\n",
+				(double) stats.cnt[NR_MISS] / inst * 1000000);
+	else
+		printf("|  miss rate: no icount info |\n");
+	printf("|    windows: %9d      |\n", sim->nr_windows);
+	printf("|   measured:    %6.2lf %%    |\n", measured);
+	if (ci >= 0) {
+		printf("|  miss ci95:  +-%6.2lf %%    |\n", ci * 100);
+		if (inst)
+			printf("|  rate ci95: +-%7.2lf mpmi |\n",
+					ci * total / inst * 1000000);
+	}
+	printf("+----------------------------+\n");
+
+	if (verbose) {
+		for (i = 0; i < NR_STATS_VERBOSE; i++)
+			printf("%s\t%ld\n", sim_stat_text[i], stats.cnt[i]);
+		printf(" nr_measured\t%.0lf\n", measured * sim->window_refs / 100);
+	} else {
+		for (i = 0; i < NR_STATS; i++)
+			printf("%s\t%ld\n", sim_stat_text[i], stats.cnt[i]);
+	}
+}
+
+/* Extrapolate the measured intervals to the whole program */
+void report_sampled(policy_t *policy)
+{
+	struct sim_state *sim = policy->sim;
+	struct sim_stats scaled = sim->sample_stats;
+	struct sim_stats *stats = &scaled;
+	unsigned long hit, miss, total;
+	unsigned long inst, est_miss;
+	double hit_ratio, miss_ratio;
+	double miss_rate, coverage;
+	int i;
+
+	shards_scale(policy, stats);
+	hit = stats->cnt[NR_HIT];
+	miss = stats->cnt[NR_MISS];
+	total = stats->cnt[NR_TOTAL];
+	inst = policy->stats.cnt[NR_INST];
+
+	hit_ratio = (double) hit / total * 100;
+	miss_ratio = (double) miss / total * 100;
+
+	miss_rate = sim->sample_inst ?
+		(double) miss / sim->sample_inst * 1000000 : 0;
+	coverage = inst ? (double) sim->sample_inst / inst * 100 : 0;
+	est_miss = miss_rate * inst / 1000000;
+
+	printf("+----------------------------+\n");
+	printf("|  hit ratio:    %6.2lf %%    |\n", hit_ratio);
+	printf("| miss ratio:    %6.2lf %%    |\n", miss_ratio);
+	printf("|  miss rate: %9.2lf mpmi |\n", miss_rate);
+	printf("|    sampled:    %6.2lf %%    |\n", coverage);
+	if (shards_rate)
+		report_shards(policy);
+	printf("+----------------------------+\n");
+
+	stats->cnt[NR_COLD_MISS] = 0;
+	stats->cnt[NR_INST] = sim->sample_inst;
+
+	if (verbose) {
+		for (i = 0; i < NR_STATS_VERBOSE; i++)
+			printf("%s\t%ld\n", sim_stat_text[i], stats->cnt[i]);
+		printf("    all_inst\t%ld\n", inst);
+		printf(" est_nr_miss\t%ld\n", est_miss);
+	} else {
+		for (i = 0; i < NR_STATS; i++)
+			printf("%s\t%ld\n", sim_stat_text[i], stats->cnt[i]);
+	}
+}
+
+/*
+ * The stats as reported: those of the measured phases of a sampled trace
+ * (without cold misses, and with the instructions measured), or of the whole
+ */
+void report_stats(policy_t *policy, struct sim_stats *stats)
+{
+	struct sim_state *sim = policy->sim;
+
+	if (window_period) {
+		window_estimate(policy, stats);
+		return;
+	}
+
+	if (sim->sampled && !policy->post_sim) {
+		*stats = sim->sample_stats;
+		stats->cnt[NR_COLD_MISS] = 0;
+		stats->cnt[NR_INST] = sim->sample_inst;
+	} else {
+		*stats = policy->stats;
+		if (!policy->warm_state)
+			stats->cnt[NR_COLD_MISS] = stats->cnt[NR_MISS];
+	}
+
+	shards_scale(policy, stats);
 }
 
 void report(policy_t *policy)
 {
 	struct sim_stats *stats = &policy->stats;
+	struct sim_stats scaled;
 	unsigned long hit, miss, total;
 	unsigned long cold_miss, warm_miss;
 	unsigned long inst;
@@ -261,9 +1578,30 @@ void report(policy_t *policy)
 	double miss_rate;
 	int i;
 
+	if (window_period) {
+		report_windows(policy);
+		return;
+	}
+
+	/* stats of post_sim() policies are not split into the phases */
+	if (policy->sim->sampled && !policy->post_sim) {
+		report_sampled(policy);
+		return;
+	} else if (policy->sim->sampled) {
+		fprintf(stderr, "%s does not support sampled traces; "
+				"reporting the whole trace\n", policy->name);
+	}
+
 	if (!policy->warm_state)
 		stats->cnt[NR_COLD_MISS] = stats->cnt[NR_MISS];
 
+	/* the estimates of all the references, of sampled pages */
+	if (shards_rate) {
+		scaled = *stats;
+		shards_scale(policy, &scaled);
+		stats = &scaled;
+	}
+
 	hit = stats->cnt[NR_HIT];
 	miss = stats->cnt[NR_MISS];
 	cold_miss = stats->cnt[NR_COLD_MISS];
@@ -283,18 +1621,24 @@ void report(policy_t *policy)
 		printf("|  hit ratio:    %6.2lf %%    |\n", hit_ratio);
 		printf("| miss ratio:    %6.2lf %%    |\n", miss_ratio);
 		printf("|  miss rate: %9.2lf mpmi |\n", miss_rate);
+		if (shards_rate)
+			report_shards(policy);
 		printf("+----------------------------+\n");
 	} else {
 		printf("+----------------------------+\n");
 		printf("|  hit ratio:    %6.2lf %%    |\n", hit_ratio);
 		printf("| miss ratio:    %6.2lf %%    |\n", miss_ratio);
 		printf("|  miss rate: no icount info |\n");
+		if (shards_rate)
+			report_shards(policy);
 		printf("+----------------------------+\n");
 	}
 
 	if (verbose) {
 		for (i = 0; i < NR_STATS_VERBOSE; i++)
 			printf("%s\t%ld\n", sim_stat_text[i], stats->cnt[i]);
+		if (shards_rate)
+			printf("  nr_sampled\t%ld\n", policy->stats.cnt[NR_TOTAL]);
 	} else {
 		for (i = 0; i < NR_STATS; i++)
 			printf("%s\t%ld\n", sim_stat_text[i], stats->cnt[i]);
@@ -306,33 +1650,94 @@ void fini_policy(policy_t *policy)
 	policy->fini(policy);
 }
 
+/* Sample about size pages of the trace, as found by reading it once more */
+static void shards_adapt(const char *path, long size)
+{
+	struct trace *trace = trace_open(path);
+	struct decoder *dec = decoder_start(trace, 1);
+	struct shards_scan *scan = shards_scan_start(size);
+	struct sim_batch *batch;
+
+	while ((batch = decoder_next(dec, 0))) {
+		shards_scan(scan, batch->events, batch->nr_events, batch->entries);
+		decoder_release(dec, 0);
+	}
+
+	decoder_stop(dec);
+	trace_close(trace);
+
+	shards_start(shards_scan_end(scan));
+}
+
 int main(int argc, char **argv)
 {
-	FILE *tracefile;
-	policy_t *policy;
+	struct trace *trace;
+	policy_t *tmpl, *policy;
 	unsigned long memsz;
 
+	if (argc > 1 && !strcmp(argv[1], "convert"))
+		return convert_main(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "slice"))
+		return slice_main(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "mrc"))
+		return mrc_main(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "multi"))
+		return multi_main(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "sweep"))
+		return sweep_main(argc, argv);
+
 	check_args(argc, argv);
 
 	init_policy_list();
-	policy = search_policy(argv[1]);
-	if (!policy) {
+	tmpl = search_policy(argv[1]);
+	if (!tmpl) {
 		printf("No matching policy..\n");
 		exit(1);
 	}
+	policy = new_policy(tmpl);
 
 	memsz = atoi(argv[2]);
-	tracefile = fopen(argv[3], "rb");
+	trace = trace_open(argv[3]);
 
 	parse_opt_args(argc, argv);
+	policy->seed = seed;
+	set_params(policy);
+
+	if (shards_size) {
+		if (trace->stream)
+			sim_error("A stream cannot be scanned for the sample; "
+					"use -shards");
+		shards_adapt(argv[3], shards_size);
+	}
+	if (shards_rate && verbose)
+		printf("shards: rate %.6lf, %lu kB simulated\n", shards_rate,
+				shards_memsz(memsz));
+
+	if (ckpt_path || restore_path) {
+		if (!policy->save || !policy->restore)
+			sim_error("%s does not support checkpoints", policy->name);
+		if (trace->stream)
+			sim_error("A stream cannot be checkpointed");
+		ckpt_memsz = memsz;
+		ckpt_trace_size = trace_size(argv[3]);
+	}
 
 	init_policy(policy, memsz);
-	simulate(policy, tracefile);
+	if (restore_path)
+		restore(policy, trace);
+
+	if (ckpt_path) {
+		signal(SIGUSR1, request_checkpoint);
+		if (ckpt_interval)
+			ckpt_next = policy->stats.cnt[NR_TOTAL] + ckpt_interval;
+	}
+
+	simulate(policy, trace);
 	post_sim(policy);
 	report(policy);
 	fini_policy(policy);
 
-	fclose(tracefile);
+	trace_close(trace);
 
 	return 0;
 }
@@ -2,6 +2,7 @@
 #ifndef _SIM_H
 #define _SIM_H
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <math.h>
@@ -10,6 +11,7 @@
 
 #define NR_READ_CHUNK			1024
 #define MAX_NR_POLICY			20
+#define SIM_NR_VPNS				4096	/* decoded at once */
 
 #define PAGE_SHIFT				12
 #define PAGE_SIZE				(1UL << PAGE_SHIFT)
@@ -24,19 +26,28 @@
  * 4 MSB in addr are used for the signitures
  *
  * 0000: memory ref
+ * 0001: range (string instructions, gathers and scatters)
+ * 0111: filter hits (posetrace -filter_kb)
  * 1000: malloc
  * 1001: calloc
  * 1010: realloc
  * 1011: free
- * 1100: mmap?
+ * 1100: mmap, munmap, mremap, brk and madvise
+ * 1101: chunk header (multithreaded trace, see trace.h)
+ * 1110: sampling phase
  * 1111: icount
  */
 
 #define TYPE_REF				0x0UL
+#define TYPE_RANGE				0x1UL
+#define TYPE_HITS				0x7UL
 #define TYPE_MALLOC				0x8UL
 #define TYPE_CALLOC				0x9UL
 #define TYPE_REALLOC			0xaUL
 #define TYPE_FREE				0xbUL
+#define TYPE_MMAP				0xcUL
+#define TYPE_CHUNK				0xdUL
+#define TYPE_PHASE				0xeUL
 #define TYPE_ICOUNT				0xfUL
 
 #define TYPE_SHIFT				60
@@ -44,6 +55,81 @@
 #define TYPE_MASK				~ADDR_MASK
 #define ENTRY_TYPE(_addr)		((_addr) >> TYPE_SHIFT)
 #define ENTRY_ADDR(_addr)		((_addr) & ADDR_MASK)
+#define ALLOC_TAG_SHIFT			48
+#define ALLOC_TAG(_addr)		(((_addr) >> ALLOC_TAG_SHIFT) & 0xffUL)
+#define ALLOC_ADDR(_addr)		((_addr) & ((0x1UL << ALLOC_TAG_SHIFT) - 1))
+#define CHUNK_TID(_hdr)			((_hdr) & 0xffffffffUL)
+#define CHUNK_FLAGS(_hdr)		(ENTRY_ADDR(_hdr) >> 32)
+
+/*
+ * Tags of the allocator entries (malloc, calloc, realloc and free), by the
+ * allocator function recorded
+ */
+#define ALLOC_TAG_C				0
+#define ALLOC_TAG_NEW			1	/* operator new / delete */
+#define ALLOC_TAG_NEW_ARRAY		2	/* operator new[] / delete[] */
+#define ALLOC_TAG_ALIGNED		3	/* memalign() and the family */
+#define ALLOC_TAG_EXT			4	/* extensions of jemalloc */
+#define ALLOC_TAG_CUSTOM		5	/* posetrace -alloc_sym */
+
+/*
+ * Memory mapping system calls
+ *
+ * An mmap entry carries the address (the result of the call), the op, the
+ * length and two words that depend on the op:
+ *
+ * MMAP_OP_MMAP:    flags, prot
+ * MMAP_OP_MUNMAP:  -
+ * MMAP_OP_MREMAP:  old address, old length
+ * MMAP_OP_BRK:     requested break (the address is the new break)
+ * MMAP_OP_MADVISE: advice
+ *
+ * MMAP_IN_ALLOC is set in the op when the call is made inside the allocator
+ * functions, whose objects are already recorded by their own entries.
+ */
+#define MMAP_OP_MMAP			0x0UL
+#define MMAP_OP_MUNMAP			0x1UL
+#define MMAP_OP_MREMAP			0x2UL
+#define MMAP_OP_BRK				0x3UL
+#define MMAP_OP_MADVISE			0x4UL
+#define MMAP_OP_MASK			0xffUL
+#define MMAP_IN_ALLOC			0x100UL
+
+/* Flags of mmap() in the traced program (Linux) */
+#define LINUX_MAP_FIXED			0x10UL
+#define LINUX_MAP_ANONYMOUS		0x20UL
+
+/*
+ * Ranges
+ *
+ * A REP string instruction is recorded as a range per memory operand, from
+ * its count, and a gather or scatter as the range spanning the elements it
+ * accesses. A range entry carries the start address and the length in bytes,
+ * with RANGE_WRITE set for a write. The pages of a range are passed to the
+ * optional access_range hook of the policy at once.
+ */
+#define RANGE_WRITE				(0x1UL << 63)
+#define RANGE_LEN_MASK			(RANGE_WRITE - 1)
+
+/*
+ * Cache filter of posetrace -filter_kb
+ *
+ * A filtered trace records only the references missing the cache filter.
+ * The references hitting it are counted per line, and a hits entry carries
+ * the address of the line and the count when the line is evicted from the
+ * filter (or at a phase boundary and the exit of the thread). The hits are
+ * counted as page hits without passing them to the policy.
+ */
+
+/*
+ * Sampling phases of posetrace -sample_ff
+ *
+ * A phase entry carries the icount of the thread and the phase starting.
+ * Only the references in PHASE_MEASURE are counted in the estimates.
+ */
+#define PHASE_FF				0
+#define PHASE_WARMUP			1
+#define PHASE_MEASURE			2
 
 #define policy_count_stat(_policy, _stat, _cnt)		{	\
 	(_policy)->stats.cnt[_stat] += _cnt;						\
@@ -97,14 +183,32 @@ typedef struct policy_t {
 	void (*init)(struct policy_t *policy, unsigned long memsz);
 	void (*fini)(struct policy_t *policy);
 	int (*access)(struct policy_t *policy, unsigned long vpn);
+	/* access nr_pages pages from vpn in order; optional */
+	int (*access_range)(struct policy_t *policy, unsigned long vpn,
+			unsigned long nr_pages);
 	int (*mem_alloc)(struct policy_t *policy,
 			unsigned long addr, unsigned long size);
 	int (*mem_free)(struct policy_t *policy, unsigned long addr);
+	/* drop the resident pages of a range; optional */
+	int (*mem_discard)(struct policy_t *policy,
+			unsigned long addr, unsigned long size);
 	void (*post_sim)(struct policy_t *policy);
+	/* write / read the state for a checkpoint (see lib/checkpoint.h); the
+	   state is read right after init(); optional */
+	int (*save)(struct policy_t *policy, FILE *file);
+	int (*restore)(struct policy_t *policy, FILE *file);
+	/* set a parameter of -param before init(); nonzero if it has no such
+	   parameter or the value is out of its range; optional */
+	int (*set_param)(struct policy_t *policy, const char *name,
+			double value);
 	struct sim_stats stats;
 	bool cold_state;
 	bool warm_state;
 	void *data;
+	size_t data_size;				/* of the data of an instance */
+	struct refault *refault;
+	struct sim_state *sim;			/* of sim.c */
+	unsigned long seed;				/* of the random choices of the instance */
 } policy_t;
 
 extern policy_t policy[];
@@ -113,5 +217,46 @@ extern bool debug;
 extern bool verbose;
 extern bool policy_stat;
 extern bool refault_stat;
+extern bool pipelined;
+extern double shards_rate;			/* of the pages sampled; 0 if not */
+extern long window_period;			/* of the windows sampled; 0 if not */
+
+struct trace;
+struct trace_entry;
+struct decoder;
+struct sim_event;
+struct refault;
+struct sim_state;
+struct shards_scan;
+
+extern void sim_error(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2), noreturn));
+extern policy_t *search_policy(const char *name);
+extern policy_t *new_policy(const policy_t *tmpl);
+extern void init_policy_list(void);
+extern void init_policy(policy_t *policy, unsigned long memsz);
+extern void simulate(policy_t *policy, struct trace *trace);
+extern void simulate_decoded(policy_t *policy, struct decoder *dec,
+		int consumer);
+extern void simulate_events(policy_t *policy, const struct sim_event *events,
+		long nr_events, struct trace_entry *entries);
+extern void post_sim(policy_t *policy);
+extern void report_stats(policy_t *policy, struct sim_stats *stats);
+extern void report(policy_t *policy);
+extern void fini_policy(policy_t *policy);
+
+/* spatial sampling of the pages (see sim.c) */
+extern void shards_start(double rate);
+extern struct shards_scan *shards_scan_start(long size);
+extern void shards_scan(struct shards_scan *scan,
+		const struct sim_event *events, long nr_events,
+		const struct trace_entry *entries);
+extern double shards_scan_end(struct shards_scan *scan);
+
+/* temporal sampling in windows (see sim.c) */
+extern void windows_start(const char *arg);
+
+extern double miss_ratio_ci95(policy_t *policy);
+extern double t_quantile(int df);
 
 #endif
@@ -0,0 +1,623 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "trace.h"
+#include "slice.h"
+#include "lib/avltree.h"
+
+#define SLICE_CHUNK				(1UL << 20)		/* payload of a chunk written */
+
+#define WINDOW_REF				0
+#define WINDOW_INST				1
+
+struct slice_window {
+	int unit;						/* WINDOW_* */
+	unsigned long first;
+	unsigned long last;				/* exclusive */
+};
+
+/* allocator object live in the slice */
+struct slice_object {
+	struct avl_tree_node node;
+	unsigned long addr;
+	unsigned long size;
+	unsigned long tag;
+};
+
+/* area mapped by the program itself, as the map areas of sim */
+struct slice_map {
+	unsigned long start;
+	unsigned long end;
+};
+
+struct slicer {
+	FILE *out;
+	unsigned long seq;				/* of the next chunk */
+
+	/* chunk being written */
+	unsigned char *buf;
+	unsigned long len;
+	unsigned long tid;
+
+	struct avl_tree_node *live;
+	unsigned long nr_live;
+	struct slice_map *maps;
+	int nr_maps;
+	unsigned long brk_end;			/* 0 before the first brk() */
+};
+
+static int cmp_object(const struct avl_tree_node *a,
+		const struct avl_tree_node *b)
+{
+	unsigned long a_key = avl_tree_entry(a, struct slice_object, node)->addr;
+	unsigned long b_key = avl_tree_entry(b, struct slice_object, node)->addr;
+
+	if (a_key < b_key)
+		return -1;
+	else if (a_key > b_key)
+		return 1;
+	return 0;
+}
+
+static struct slice_object *lookup_object(struct slicer *sl,
+		unsigned long addr)
+{
+	struct slice_object key = { .addr = addr };
+	struct avl_tree_node *node;
+
+	node = avl_tree_lookup_node(sl->live, &key.node, cmp_object);
+
+	return node ? avl_tree_entry(node, struct slice_object, node) : NULL;
+}
+
+static void del_object(struct slicer *sl, unsigned long addr)
+{
+	struct slice_object *obj = lookup_object(sl, addr);
+
+	if (!obj)
+		return;
+
+	avl_tree_remove(&sl->live, &obj->node);
+	sl->nr_live--;
+	free(obj);
+}
+
+static void add_object(struct slicer *sl, unsigned long addr,
+		unsigned long size, unsigned long tag)
+{
+	struct slice_object *obj;
+
+	if (!addr)
+		return;
+
+	del_object(sl, addr);
+
+	obj = malloc(sizeof(*obj));
+	if (!obj)
+		sim_error("Failed to slice the trace");
+	obj->addr = addr;
+	obj->size = size;
+	obj->tag = tag;
+	avl_tree_insert(&sl->live, &obj->node, cmp_object);
+	sl->nr_live++;
+}
+
+static void add_map(struct slicer *sl, unsigned long addr,
+		unsigned long size)
+{
+	sl->maps = realloc(sl->maps, (sl->nr_maps + 1) * sizeof(*sl->maps));
+	if (!sl->maps)
+		sim_error("Failed to slice the trace");
+
+	sl->maps[sl->nr_maps].start = addr;
+	sl->maps[sl->nr_maps++].end = addr + size;
+}
+
+/* Drop the areas starting in [addr, addr + size); returns true if any */
+static bool del_maps(struct slicer *sl, unsigned long addr,
+		unsigned long size)
+{
+	bool found = false;
+	int i;
+
+	for (i = 0; i < sl->nr_maps; i++) {
+		if (sl->maps[i].start < addr || sl->maps[i].start >= addr + size)
+			continue;
+		sl->maps[i--] = sl->maps[--sl->nr_maps];
+		found = true;
+	}
+
+	return found;
+}
+
+/* Follow the areas mapped by the program, as sim_mmap() */
+static void track_map(struct slicer *sl, struct trace_entry *ent)
+{
+	bool in_alloc = ent->arg1 & MMAP_IN_ALLOC;
+
+	switch (ent->arg1 & MMAP_OP_MASK) {
+		case MMAP_OP_MMAP:
+			if (!in_alloc && !(ent->arg3 & LINUX_MAP_FIXED) &&
+					(ent->arg3 & LINUX_MAP_ANONYMOUS))
+				add_map(sl, ent->addr, ent->arg2);
+			break;
+
+		case MMAP_OP_MUNMAP:
+			del_maps(sl, ent->addr, ent->arg2);
+			break;
+
+		case MMAP_OP_MREMAP:
+			if (del_maps(sl, ent->arg3, 1))
+				add_map(sl, ent->addr, ent->arg2);
+			break;
+
+		case MMAP_OP_BRK:
+			if (sl->brk_end && ent->addr > sl->brk_end && !in_alloc)
+				add_map(sl, sl->brk_end, ent->addr - sl->brk_end);
+			sl->brk_end = ent->addr;
+			break;
+	}
+}
+
+/* Follow the allocator and mmap entries, as the snapshots of posetrace */
+static void track_entry(struct slicer *sl, struct trace_entry *ent)
+{
+	switch (ent->type) {
+		case TYPE_MALLOC:
+			add_object(sl, ent->addr, ent->arg1, ent->tag);
+			break;
+
+		case TYPE_CALLOC:
+			add_object(sl, ent->addr, ent->arg1 * ent->arg2, ent->tag);
+			break;
+
+		case TYPE_REALLOC:
+			del_object(sl, ent->arg1);
+			add_object(sl, ent->addr, ent->arg2, ent->tag);
+			break;
+
+		case TYPE_FREE:
+			del_object(sl, ent->addr);
+			break;
+
+		case TYPE_MMAP:
+			track_map(sl, ent);
+			break;
+	}
+}
+
+static void flush_chunk(struct slicer *sl)
+{
+	unsigned long hdr[3];
+
+	if (!sl->len)
+		return;
+
+	hdr[0] = (TYPE_CHUNK << TYPE_SHIFT) | sl->tid;
+	hdr[1] = sl->seq++;
+	hdr[2] = sl->len;
+	if (fwrite(hdr, sizeof(hdr), 1, sl->out) != 1 ||
+			fwrite(sl->buf, sl->len, 1, sl->out) != 1)
+		sim_error("Failed to write the slice");
+
+	sl->len = 0;
+}
+
+static void put_word(struct slicer *sl, unsigned long word)
+{
+	memcpy(sl->buf + sl->len, &word, sizeof(word));
+	sl->len += sizeof(word);
+}
+
+/* Write an entry in the legacy format, in a chunk of its thread */
+static void write_entry(struct slicer *sl, struct trace_entry *ent)
+{
+	unsigned long word = (ent->type << TYPE_SHIFT) | ent->addr;
+	int ref_size;
+
+	/* an mmap entry takes the most, 5 words */
+	if (sl->len && (ent->tid != sl->tid ||
+				sl->len + 5 * sizeof(unsigned long) > SLICE_CHUNK))
+		flush_chunk(sl);
+	sl->tid = ent->tid;
+
+	switch (ent->type) {
+		case TYPE_REF:
+			ref_size = ent->arg1;
+			put_word(sl, word);
+			memcpy(sl->buf + sl->len, &ref_size, sizeof(int));
+			sl->len += sizeof(int);
+			break;
+
+		case TYPE_MALLOC:
+			put_word(sl, word | (ent->tag << ALLOC_TAG_SHIFT));
+			put_word(sl, ent->arg1);
+			break;
+
+		case TYPE_CALLOC:
+		case TYPE_REALLOC:
+			put_word(sl, word | (ent->tag << ALLOC_TAG_SHIFT));
+			put_word(sl, ent->arg1);
+			put_word(sl, ent->arg2);
+			break;
+
+		case TYPE_FREE:
+			put_word(sl, word | (ent->tag << ALLOC_TAG_SHIFT));
+			break;
+
+		case TYPE_MMAP:
+			put_word(sl, word);
+			put_word(sl, ent->arg1);
+			put_word(sl, ent->arg2);
+			put_word(sl, ent->arg3);
+			put_word(sl, ent->arg4);
+			break;
+
+		case TYPE_PHASE:
+		case TYPE_HITS:
+			put_word(sl, word);
+			put_word(sl, ent->arg1);
+			break;
+
+		case TYPE_RANGE:
+			put_word(sl, word);
+			put_word(sl, ent->arg1 | (ent->arg2 ? RANGE_WRITE : 0));
+			break;
+
+		case TYPE_ICOUNT:
+			put_word(sl, word);
+			break;
+
+		default:
+			sim_error("A page trace cannot be sliced");
+	}
+}
+
+/*
+ * Map the areas and allocate the objects live at the start of the window.
+ * An area grown by brk() is mapped anonymously as well, and the break is set
+ * inside the allocator, which only tells sim where it is.
+ */
+static void write_preamble(struct slicer *sl)
+{
+	struct slice_object *obj;
+	struct trace_entry ent;
+	int i;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.type = TYPE_MMAP;
+
+	for (i = 0; i < sl->nr_maps; i++) {
+		ent.addr = sl->maps[i].start;
+		ent.arg1 = MMAP_OP_MMAP;
+		ent.arg2 = sl->maps[i].end - sl->maps[i].start;
+		ent.arg3 = LINUX_MAP_ANONYMOUS;
+		write_entry(sl, &ent);
+	}
+	if (sl->brk_end) {
+		ent.addr = sl->brk_end;
+		ent.arg1 = MMAP_OP_BRK | MMAP_IN_ALLOC;
+		ent.arg2 = 0;
+		ent.arg3 = sl->brk_end;
+		write_entry(sl, &ent);
+	}
+
+	memset(&ent, 0, sizeof(ent));
+	ent.type = TYPE_MALLOC;
+
+	avl_tree_for_each_in_order(obj, sl->live, struct slice_object, node) {
+		ent.addr = obj->addr;
+		ent.arg1 = obj->size;
+		ent.tag = obj->tag;
+		write_entry(sl, &ent);
+	}
+}
+
+/* Free the objects and areas left live by the last slice, before the next */
+static void write_postamble(struct slicer *sl)
+{
+	struct slice_object *obj;
+	struct trace_entry ent;
+	int i;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.type = TYPE_FREE;
+
+	while (sl->live) {
+		obj = avl_tree_entry(avl_tree_first_in_order(sl->live),
+				struct slice_object, node);
+		ent.addr = obj->addr;
+		ent.tag = obj->tag;
+		write_entry(sl, &ent);
+		del_object(sl, obj->addr);
+	}
+
+	memset(&ent, 0, sizeof(ent));
+	ent.type = TYPE_MMAP;
+	ent.arg1 = MMAP_OP_MUNMAP;
+
+	for (i = 0; i < sl->nr_maps; i++) {
+		ent.addr = sl->maps[i].start;
+		ent.arg2 = sl->maps[i].end - sl->maps[i].start;
+		write_entry(sl, &ent);
+	}
+	sl->nr_maps = 0;
+	sl->brk_end = 0;
+}
+
+static int *seq_order;
+static struct trace_index_entry *order_index;
+
+static int cmp_seq(const void *a, const void *b)
+{
+	unsigned long sa = order_index[*(const int *)a].seq;
+	unsigned long sb = order_index[*(const int *)b].seq;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+/*
+ * Instructions of all the threads at the start of each chunk in order of seq,
+ * from the icount of its thread and the last ones of the others
+ */
+static unsigned long *chunk_insts(struct trace *trace)
+{
+	struct trace_index_entry *ent;
+	unsigned long *insts, *tids, *icounts, total = 0;
+	int i, j, nr_threads = 0;
+
+	insts = malloc((trace->nr_index + 1) * sizeof(unsigned long));
+	tids = malloc((trace->nr_index + 1) * sizeof(unsigned long));
+	icounts = malloc((trace->nr_index + 1) * sizeof(unsigned long));
+	if (!insts || !tids || !icounts)
+		sim_error("Failed to slice the trace");
+
+	for (i = 0; i < trace->nr_index; i++) {
+		ent = &trace->index[seq_order[i]];
+		for (j = 0; j < nr_threads && tids[j] != ent->tid; j++)
+			;
+		if (j == nr_threads) {
+			tids[nr_threads] = ent->tid;
+			icounts[nr_threads++] = 0;
+		}
+
+		total += ent->icount - icounts[j];
+		icounts[j] = ent->icount;
+		insts[i] = total;
+	}
+
+	free(tids);
+	free(icounts);
+	return insts;
+}
+
+/*
+ * Rebuild the objects live at the start of a chunk from the last snapshot
+ * written after every chunk before it, and the chunks between
+ */
+static void replay_to(struct slicer *sl, struct trace *trace, unsigned long seq)
+{
+	struct trace_index_entry *index = trace->index;
+	struct trace_entry ent;
+	unsigned long max_seq = 0, snapshot = 0;
+	int i, from = 0;
+
+	/* a snapshot is taken after the chunks before it in the file */
+	for (i = 0; i < trace->nr_index; i++) {
+		if (i && max_seq >= seq)
+			break;
+		if (index[i].snapshot && (!i ||
+					index[i].snapshot != index[i - 1].snapshot)) {
+			snapshot = index[i].snapshot;
+			from = i;
+		}
+		if (index[i].seq > max_seq)
+			max_seq = index[i].seq;
+	}
+
+	trace_select(trace, from, trace->nr_index, 0, seq);
+	if (snapshot)
+		trace_start_snapshot(trace, snapshot);
+	while (trace_next(trace, &ent))
+		track_entry(sl, &ent);
+}
+
+/*
+ * Move to the chunk where the window starts, through the index of a v2
+ * trace; returns the number of references before it
+ */
+static unsigned long seek_window(struct slicer *sl, struct trace *trace,
+		struct slice_window *win)
+{
+	struct trace_index_entry *index = trace->index, *start;
+	unsigned long *insts = NULL, seq_hi = ~0UL;
+	int i, first = 0;
+
+	if (!trace->nr_index)
+		return 0;
+
+	seq_order = malloc(trace->nr_index * sizeof(int));
+	if (!seq_order)
+		sim_error("Failed to slice the trace");
+	for (i = 0; i < trace->nr_index; i++)
+		seq_order[i] = i;
+	order_index = index;
+	qsort(seq_order, trace->nr_index, sizeof(int), cmp_seq);
+
+	if (win->unit == WINDOW_REF) {
+		/* the last chunk starting at or before the first reference */
+		for (i = 1; i < trace->nr_index; i++) {
+			if (index[seq_order[i]].ref > win->first)
+				break;
+			first = i;
+		}
+	} else {
+		/* the chunks starting in the window */
+		insts = chunk_insts(trace);
+		for (first = 0; first < trace->nr_index; first++) {
+			if (insts[first] >= win->first)
+				break;
+		}
+		for (i = first; i < trace->nr_index; i++) {
+			if (insts[i] >= win->last) {
+				seq_hi = index[seq_order[i]].seq;
+				break;
+			}
+		}
+		free(insts);
+	}
+
+	if (first == trace->nr_index) {
+		/* nothing in the window */
+		trace_select(trace, 0, 0, 0, 0);
+		free(seq_order);
+		return 0;
+	}
+
+	start = &index[seq_order[first]];
+	free(seq_order);
+
+	replay_to(sl, trace, start->seq);
+	trace_select(trace, 0, trace->nr_index, start->seq, seq_hi);
+
+	return start->ref;
+}
+
+static void slice_trace(struct slicer *sl, const char *path,
+		struct slice_window *win)
+{
+	struct trace *trace = trace_open(path);
+	struct trace_entry ent;
+	unsigned long ref = 0, first, last, nr_refs = 0;
+
+	if (trace->stream)
+		sim_error("A trace to slice must be a file");
+
+	first = win->unit == WINDOW_REF ? win->first : 0;
+	last = win->unit == WINDOW_REF ? win->last : ~0UL;
+
+	/* the objects of the last slice are not live in this one */
+	write_postamble(sl);
+
+	if (trace->index)
+		ref = seek_window(sl, trace, win);
+	else if (win->unit == WINDOW_INST)
+		sim_error("An instruction window needs the index of a v2 trace");
+
+	/* a window of instructions is the chunks selected */
+	if (win->unit == WINDOW_INST)
+		first = ref;
+
+	while (ref < first && trace_next(trace, &ent)) {
+		if (ent.type == TYPE_REF)
+			ref++;
+		else
+			track_entry(sl, &ent);
+	}
+
+	write_preamble(sl);
+	printf("%s: %lu objects and %d areas live", path, sl->nr_live,
+			sl->nr_maps);
+
+	while (trace_next(trace, &ent)) {
+		if (ent.type == TYPE_REF) {
+			if (ref >= last)
+				break;
+			ref++;
+			nr_refs++;
+		}
+		track_entry(sl, &ent);
+		write_entry(sl, &ent);
+	}
+	flush_chunk(sl);
+
+	printf(", references %lu-%lu\n", ref - nr_refs, ref);
+
+	trace_close(trace);
+}
+
+static void wrong_slice_args(char **argv)
+{
+	printf("usage: %s slice <out> <trace file> [-r <first>:<last>] "
+			"[-i <first>:<last>] [<trace file> ...]\n", argv[0]);
+	printf("-r: references [first, last) of the trace\n");
+	printf("-i: instructions [first, last) of the trace (v2 only)\n");
+	exit(1);
+}
+
+static void parse_window(char **argv, const char *arg,
+		struct slice_window *win)
+{
+	char *end;
+
+	win->first = strtoul(arg, &end, 0);
+	if (*end != ':')
+		wrong_slice_args(argv);
+
+	if (!*++end) {
+		win->last = ~0UL;
+		return;
+	}
+
+	win->last = strtoul(end, &end, 0);
+	if (*end || win->last < win->first)
+		wrong_slice_args(argv);
+}
+
+/*
+ * sim slice <out> <trace file> [-r <first>:<last>] [-i <first>:<last>]
+ *           [<trace file> ...]
+ */
+int slice_main(int argc, char **argv)
+{
+	struct slice_window win;
+	struct slicer sl;
+	int i, next;
+
+	if (argc < 4)
+		wrong_slice_args(argv);
+
+	memset(&sl, 0, sizeof(sl));
+	sl.buf = malloc(SLICE_CHUNK);
+	if (!sl.buf)
+		sim_error("Failed to slice the trace");
+	sl.out = fopen(argv[2], "wb");
+	if (!sl.out) {
+		perror(argv[2]);
+		exit(1);
+	}
+
+	for (i = 3; i < argc; i = next) {
+		win.unit = WINDOW_REF;
+		win.first = 0;
+		win.last = ~0UL;
+
+		for (next = i + 1; next + 1 < argc && argv[next][0] == '-'; next += 2) {
+			if (!strcmp(argv[next], "-r"))
+				win.unit = WINDOW_REF;
+			else if (!strcmp(argv[next], "-i"))
+				win.unit = WINDOW_INST;
+			else
+				wrong_slice_args(argv);
+			parse_window(argv, argv[next + 1], &win);
+		}
+		if (next < argc && argv[next][0] == '-')
+			wrong_slice_args(argv);
+
+		slice_trace(&sl, argv[i], &win);
+	}
+
+	/* the slices end as the traces do, with their objects live */
+	while (sl.live)
+		del_object(&sl, avl_tree_entry(sl.live, struct slice_object,
+					node)->addr);
+	free(sl.maps);
+
+	if (fclose(sl.out))
+		sim_error("Failed to write the slice");
+	free(sl.buf);
+
+	return 0;
+}
@@ -0,0 +1,16 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _SLICE_H
+#define _SLICE_H
+
+/*
+ * sim slice <out> <trace file> [-r <first>:<last>] [-i <first>:<last>]
+ *           [<trace file> ...]
+ *
+ * Writes windows of traces, one after another, as a chunked trace. A slice
+ * starts with malloc entries of the objects live at the start of its window,
+ * and frees those it leaves live before the next slice. A v2 trace is seeked
+ * through its index and snapshots instead of being read from the start.
+ */
+int slice_main(int argc, char **argv);
+
+#endif
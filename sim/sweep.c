@@ -0,0 +1,508 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sim.h"
+#include "trace.h"
+#include "decoder.h"
+#include "sweep.h"
+
+/*
+ * Sweeps
+ *
+ * The trace is decoded once into an array of events in memory, which the
+ * jobs (a policy instance and a memory size each) read in place. The jobs
+ * are dealt round-robin to the deques of the workers; a worker takes the
+ * jobs of its own deque from the front, and steals from the back of the
+ * others once it runs out, so that the workers are kept busy while OPT and
+ * APR jobs take far longer than FIFO ones. The instances are initialized
+ * and finalized in the main thread, and the results are printed in the
+ * order of the lists once all the jobs are done.
+ *
+ * With -seeds, every policy and size is simulated once per seed (0, 1, ...),
+ * and the runs of a policy and size are summarized by the mean, standard
+ * deviation and 95% confidence interval of their miss ratio and rate.
+ *
+ * With -shards or -shards-size, only the pages sampled are simulated, and
+ * with -windows only windows of the trace (see sim.c); the rows hold the
+ * estimates of the whole trace with the 95% confidence interval of the miss
+ * ratio. The rate of -shards-size is found from the decoded trace.
+ */
+
+#define SWEEP_INIT_EVENTS		(1UL << 16)
+#define SWEEP_INIT_ENTRIES		(1UL << 10)
+
+/* The decoded trace */
+struct sweep_trace {
+	struct sim_event *events;
+	long nr_events;
+	long max_events;
+	struct trace_entry *entries;
+	long nr_entries;
+	long max_entries;
+};
+
+struct sweep_job {
+	policy_t *policy;
+	unsigned long memsz;
+	double time;					/* of the simulation (s) */
+	double miss_ratio;				/* (%) */
+	double miss_rate;				/* (mpmi), NAN without instructions */
+};
+
+/* Jobs [head, tail) of a worker */
+struct sweep_deque {
+	pthread_mutex_t lock;
+	int *jobs;
+	int head;
+	int tail;
+};
+
+struct sweep {
+	struct sweep_trace trace;
+	struct sweep_job *jobs;
+	int nr_jobs;
+	struct sweep_deque *deques;
+	int nr_workers;
+};
+
+struct sweep_worker {
+	struct sweep *sweep;
+	int id;
+	pthread_t thread;
+};
+
+static double sweep_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *sweep_grow(void *ptr, long *max, size_t size)
+{
+	*max *= 2;
+	ptr = realloc(ptr, *max * size);
+	if (!ptr)
+		sim_error("Failed to allocate the decoded trace");
+
+	return ptr;
+}
+
+/* Append the batches of the decoder, with the indices of their entries */
+static void sweep_decode(struct trace *trace, struct sweep_trace *st)
+{
+	struct decoder *dec = decoder_start(trace, 1);
+	struct sim_batch *batch;
+	struct sim_event *ev;
+	int i;
+
+	st->max_events = SWEEP_INIT_EVENTS;
+	st->max_entries = SWEEP_INIT_ENTRIES;
+	st->events = malloc(st->max_events * sizeof(struct sim_event));
+	st->entries = malloc(st->max_entries * sizeof(struct trace_entry));
+	if (!st->events || !st->entries)
+		sim_error("Failed to allocate the decoded trace");
+
+	while ((batch = decoder_next(dec, 0))) {
+		while (st->nr_events + batch->nr_events > st->max_events)
+			st->events = sweep_grow(st->events, &st->max_events,
+					sizeof(struct sim_event));
+		while (st->nr_entries + batch->nr_entries > st->max_entries)
+			st->entries = sweep_grow(st->entries, &st->max_entries,
+					sizeof(struct trace_entry));
+
+		for (i = 0; i < batch->nr_events; i++) {
+			ev = &st->events[st->nr_events++];
+			*ev = batch->events[i];
+			if (ev->type == EVENT_ENTRY)
+				ev->vpn += st->nr_entries;
+		}
+		memcpy(st->entries + st->nr_entries, batch->entries,
+				batch->nr_entries * sizeof(struct trace_entry));
+		st->nr_entries += batch->nr_entries;
+
+		decoder_release(dec, 0);
+	}
+
+	decoder_stop(dec);
+}
+
+/* The next job of a worker, or one stolen from another; -1 if none left */
+static int sweep_take(struct sweep *sweep, int id)
+{
+	struct sweep_deque *deque;
+	int i, job = -1;
+
+	for (i = 0; i < sweep->nr_workers && job < 0; i++) {
+		deque = &sweep->deques[(id + i) % sweep->nr_workers];
+
+		pthread_mutex_lock(&deque->lock);
+		if (deque->head < deque->tail)
+			job = i ? deque->jobs[--deque->tail] : deque->jobs[deque->head++];
+		pthread_mutex_unlock(&deque->lock);
+	}
+
+	return job;
+}
+
+static void *sweep_thread(void *arg)
+{
+	struct sweep_worker *worker = arg;
+	struct sweep *sweep = worker->sweep;
+	struct sweep_trace *st = &sweep->trace;
+	struct sweep_job *job;
+	double start;
+	int id;
+
+	while ((id = sweep_take(sweep, worker->id)) >= 0) {
+		job = &sweep->jobs[id];
+		start = sweep_now();
+
+		simulate_events(job->policy, st->events, st->nr_events,
+				st->entries);
+		post_sim(job->policy);
+
+		job->time = sweep_now() - start;
+		if (verbose)
+			fprintf(stderr, "%s %lu kB seed %lu: %.2lf s (worker %d)\n",
+					job->policy->name, job->memsz, job->policy->seed,
+					job->time, worker->id);
+	}
+
+	return NULL;
+}
+
+/* Deal the jobs round-robin to the workers */
+static void sweep_deal(struct sweep *sweep)
+{
+	struct sweep_deque *deque;
+	int i;
+
+	sweep->deques = calloc(sweep->nr_workers, sizeof(struct sweep_deque));
+	if (!sweep->deques)
+		sim_error("Failed to allocate the workers");
+
+	for (i = 0; i < sweep->nr_workers; i++) {
+		deque = &sweep->deques[i];
+		pthread_mutex_init(&deque->lock, NULL);
+		deque->jobs = malloc((sweep->nr_jobs / sweep->nr_workers + 1) *
+				sizeof(int));
+		if (!deque->jobs)
+			sim_error("Failed to allocate the workers");
+	}
+
+	for (i = 0; i < sweep->nr_jobs; i++) {
+		deque = &sweep->deques[i % sweep->nr_workers];
+		deque->jobs[deque->tail++] = i;
+	}
+}
+
+/* The stats of the report, and the miss ratio and rate of the job */
+static void job_stats(struct sweep_job *job, struct sim_stats *stats)
+{
+	long miss, cold, total, inst;
+
+	report_stats(job->policy, stats);
+	miss = stats->cnt[NR_MISS];
+	cold = stats->cnt[NR_COLD_MISS];
+	total = stats->cnt[NR_TOTAL];
+	inst = stats->cnt[NR_INST];
+
+	job->miss_ratio = total ? (double) miss / total * 100 : 0;
+	job->miss_rate = inst ? (double) (miss - cold) / inst * 1000000 : NAN;
+}
+
+static void print_result(struct sweep_job *job, bool json, bool last)
+{
+	struct sim_stats stats;
+	long hit, miss, cold, total, inst;
+	double hit_ratio, miss_ratio;
+	double ci = miss_ratio_ci95(job->policy);
+	bool sampled = shards_rate || window_period;
+
+	job_stats(job, &stats);
+	hit = stats.cnt[NR_HIT];
+	miss = stats.cnt[NR_MISS];
+	cold = stats.cnt[NR_COLD_MISS];
+	total = stats.cnt[NR_TOTAL];
+	inst = stats.cnt[NR_INST];
+
+	hit_ratio = total ? (double) hit / total * 100 : 0;
+	miss_ratio = job->miss_ratio;
+
+	if (json) {
+		printf("  {\"policy\": \"%s\", \"memsz_kb\": %lu, \"nr_hit\": %ld, "
+				"\"nr_miss\": %ld, \"nr_cold_miss\": %ld, \"nr_total\": %ld, "
+				"\"nr_inst\": %ld, \"hit_ratio\": %.4lf, "
+				"\"miss_ratio\": %.4lf, \"miss_rate\": ",
+				job->policy->name, job->memsz, hit, miss, cold, total,
+				inst, hit_ratio, miss_ratio);
+		if (inst)
+			printf("%.4lf", job->miss_rate);
+		else
+			printf("null");
+		if (sampled && ci >= 0)
+			printf(", \"miss_ratio_ci95\": %.4lf", ci);
+		else if (sampled)
+			printf(", \"miss_ratio_ci95\": null");
+		printf(", \"time\": %.3lf}%s\n", job->time, last ? "" : ",");
+		return;
+	}
+
+	printf("%s,%lu,%ld,%ld,%ld,%ld,%ld,%.4lf,%.4lf,", job->policy->name,
+			job->memsz, hit, miss, cold, total, inst, hit_ratio, miss_ratio);
+	if (inst)
+		printf("%.4lf", job->miss_rate);
+	if (sampled && ci >= 0)
+		printf(",%.4lf", ci);
+	else if (sampled)
+		printf(",");
+	printf(",%.3lf\n", job->time);
+}
+
+/* Mean, standard deviation and half-width of the 95% CI of n values */
+static void summarize(const double *vals, int n, double res[3])
+{
+	double sum = 0, sq = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += vals[i];
+	res[0] = sum / n;
+	for (i = 0; i < n; i++)
+		sq += (vals[i] - res[0]) * (vals[i] - res[0]);
+	res[1] = n > 1 ? sqrt(sq / (n - 1)) : 0;
+	res[2] = n > 1 ? t_quantile(n - 1) * res[1] / sqrt(n) : 0;
+}
+
+/* Summarize the runs of the seeds of a policy and size */
+static void print_seeds(struct sweep_job *jobs, int nr_seeds, double *vals,
+		bool json, bool last)
+{
+	struct sim_stats stats;
+	double ratio[3], rate[3], time = 0;
+	bool has_rate = true;
+	int i;
+
+	for (i = 0; i < nr_seeds; i++) {
+		job_stats(&jobs[i], &stats);
+		vals[i] = jobs[i].miss_ratio;
+		has_rate = has_rate && !isnan(jobs[i].miss_rate);
+		time += jobs[i].time;
+	}
+	summarize(vals, nr_seeds, ratio);
+	for (i = 0; i < nr_seeds; i++)
+		vals[i] = jobs[i].miss_rate;
+	summarize(vals, nr_seeds, rate);
+
+	if (json) {
+		printf("  {\"policy\": \"%s\", \"memsz_kb\": %lu, "
+				"\"nr_seeds\": %d, \"miss_ratio_mean\": %.4lf, "
+				"\"miss_ratio_stddev\": %.4lf, \"miss_ratio_ci95\": %.4lf, ",
+				jobs->policy->name, jobs->memsz, nr_seeds,
+				ratio[0], ratio[1], ratio[2]);
+		if (has_rate)
+			printf("\"miss_rate_mean\": %.4lf, \"miss_rate_stddev\": %.4lf, "
+					"\"miss_rate_ci95\": %.4lf, ", rate[0], rate[1], rate[2]);
+		else
+			printf("\"miss_rate_mean\": null, \"miss_rate_stddev\": null, "
+					"\"miss_rate_ci95\": null, ");
+		printf("\"time\": %.3lf}%s\n", time, last ? "" : ",");
+		return;
+	}
+
+	printf("%s,%lu,%d,%.4lf,%.4lf,%.4lf,", jobs->policy->name, jobs->memsz,
+			nr_seeds, ratio[0], ratio[1], ratio[2]);
+	if (has_rate)
+		printf("%.4lf,%.4lf,%.4lf", rate[0], rate[1], rate[2]);
+	else
+		printf(",,");
+	printf(",%.3lf\n", time);
+}
+
+static void wrong_sweep_args(char **argv)
+{
+	printf("usage: %s sweep <policy>,<policy>[,...] "
+			"<memory size (kB)>,<memory size>[,...] <trace file> "
+			"[-j <threads>] [-seeds <n>] [-shards <rate> | -shards-size <n>] "
+			"[-windows <period>:<warm-up>:<measure>] [-json] [-v]\n",
+			argv[0]);
+	exit(1);
+}
+
+static int count_list(const char *list)
+{
+	int nr = 1;
+
+	for (; *list; list++)
+		nr += *list == ',';
+
+	return nr;
+}
+
+int sweep_main(int argc, char **argv)
+{
+	struct sweep sweep = { { 0 } };
+	struct sweep_worker *workers;
+	struct sweep_job *job;
+	struct shards_scan *scan;
+	struct trace *trace;
+	unsigned long *sizes;
+	policy_t **tmpls;
+	double *vals;
+	char *item;
+	bool json = false;
+	int nr_tmpls = 0, nr_sizes = 0, nr_seeds = 0;
+	long shards_size = 0;
+	int i, j, k, nr_threads = 0;
+
+	if (argc < 5)
+		wrong_sweep_args(argv);
+
+	for (i = 5; i < argc; i++) {
+		if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			nr_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-seeds") && i + 1 < argc) {
+			nr_seeds = atoi(argv[++i]);
+			if (nr_seeds <= 0)
+				wrong_sweep_args(argv);
+		} else if (!strcmp(argv[i], "-shards") && i + 1 < argc) {
+			shards_start(strtod(argv[++i], NULL));
+		} else if (!strcmp(argv[i], "-shards-size") && i + 1 < argc) {
+			shards_size = atol(argv[++i]);
+			if (shards_size <= 0)
+				wrong_sweep_args(argv);
+		} else if (!strcmp(argv[i], "-windows") && i + 1 < argc) {
+			windows_start(argv[++i]);
+		} else if (!strcmp(argv[i], "-json"))
+			json = true;
+		else if (!strcmp(argv[i], "-v"))
+			verbose = true;
+		else
+			wrong_sweep_args(argv);
+	}
+
+	tmpls = malloc(count_list(argv[2]) * sizeof(policy_t *));
+	sizes = malloc(count_list(argv[3]) * sizeof(unsigned long));
+	if (!tmpls || !sizes)
+		sim_error("Failed to allocate the jobs");
+
+	init_policy_list();
+	for (item = strtok(argv[2], ","); item; item = strtok(NULL, ",")) {
+		tmpls[nr_tmpls] = search_policy(item);
+		if (!tmpls[nr_tmpls]) {
+			printf("No matching policy: %s\n", item);
+			exit(1);
+		}
+		nr_tmpls++;
+	}
+	for (item = strtok(argv[3], ","); item; item = strtok(NULL, ",")) {
+		sizes[nr_sizes] = atol(item);
+		if (!sizes[nr_sizes])
+			wrong_sweep_args(argv);
+		nr_sizes++;
+	}
+	if (!nr_tmpls || !nr_sizes)
+		wrong_sweep_args(argv);
+
+	/* a job per policy, size and seed, in the order of the table */
+	sweep.nr_jobs = nr_tmpls * nr_sizes * (nr_seeds ? nr_seeds : 1);
+	sweep.jobs = calloc(sweep.nr_jobs, sizeof(struct sweep_job));
+	vals = malloc((nr_seeds ? nr_seeds : 1) * sizeof(double));
+	if (!sweep.jobs || !vals)
+		sim_error("Failed to allocate the jobs");
+
+	job = sweep.jobs;
+	for (i = 0; i < nr_tmpls; i++) {
+		for (j = 0; j < nr_sizes; j++) {
+			for (k = 0; k < (nr_seeds ? nr_seeds : 1); k++, job++) {
+				job->policy = new_policy(tmpls[i]);
+				job->policy->seed = k;
+				job->memsz = sizes[j];
+			}
+		}
+	}
+
+	if (nr_threads <= 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads <= 0)
+		nr_threads = 1;
+	if (nr_threads > sweep.nr_jobs)
+		nr_threads = sweep.nr_jobs;
+	sweep.nr_workers = nr_threads;
+
+	trace = trace_open(argv[4]);
+	sweep_decode(trace, &sweep.trace);
+	trace_close(trace);
+
+	if ((shards_size && shards_rate) ||
+			((shards_size || shards_rate) && window_period))
+		wrong_sweep_args(argv);
+	if (shards_size) {
+		scan = shards_scan_start(shards_size);
+		shards_scan(scan, sweep.trace.events, sweep.trace.nr_events,
+				sweep.trace.entries);
+		shards_start(shards_scan_end(scan));
+	}
+	if (shards_rate && verbose)
+		fprintf(stderr, "shards: rate %.6lf\n", shards_rate);
+
+	if (verbose)
+		fprintf(stderr, "%ld events, %ld entries decoded; %d jobs on %d "
+				"threads\n", sweep.trace.nr_events, sweep.trace.nr_entries,
+				sweep.nr_jobs, sweep.nr_workers);
+
+	for (i = 0; i < sweep.nr_jobs; i++)
+		init_policy(sweep.jobs[i].policy, sweep.jobs[i].memsz);
+
+	sweep_deal(&sweep);
+	workers = calloc(sweep.nr_workers, sizeof(struct sweep_worker));
+	if (!workers)
+		sim_error("Failed to allocate the workers");
+
+	for (i = 0; i < sweep.nr_workers; i++) {
+		workers[i].sweep = &sweep;
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, sweep_thread,
+					&workers[i]))
+			sim_error("Failed to start the workers");
+	}
+	for (i = 0; i < sweep.nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if (json)
+		printf("[\n");
+	else if (nr_seeds)
+		printf("policy,memsz_kb,nr_seeds,miss_ratio_mean,miss_ratio_stddev,"
+				"miss_ratio_ci95,miss_rate_mean,miss_rate_stddev,"
+				"miss_rate_ci95,time\n");
+	else
+		printf("policy,memsz_kb,nr_hit,nr_miss,nr_cold_miss,nr_total,"
+				"nr_inst,hit_ratio,miss_ratio,miss_rate,%stime\n",
+				shards_rate || window_period ? "miss_ratio_ci95," : "");
+	if (nr_seeds) {
+		for (i = 0; i < sweep.nr_jobs; i += nr_seeds)
+			print_seeds(&sweep.jobs[i], nr_seeds, vals, json,
+					i + nr_seeds == sweep.nr_jobs);
+	} else {
+		for (i = 0; i < sweep.nr_jobs; i++)
+			print_result(&sweep.jobs[i], json, i == sweep.nr_jobs - 1);
+	}
+	for (i = 0; i < sweep.nr_jobs; i++)
+		fini_policy(sweep.jobs[i].policy);
+	if (json)
+		printf("]\n");
+
+	free(workers);
+	free(vals);
+	free(tmpls);
+	free(sizes);
+
+	return 0;
+}
@@ -0,0 +1,15 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _SWEEP_H
+#define _SWEEP_H
+
+/*
+ * sim sweep <policy>,<policy>[,...] <memory size (kB)>,<memory size>[,...]
+ *     <trace file> [-j <threads>] [-seeds <n>] [-json] [-v]
+ *
+ * Simulates every policy with every memory size (and seed) over a single
+ * decoding of the trace, in a pool of threads, and prints a table of the
+ * results (CSV, or JSON with -json).
+ */
+int sweep_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,998 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sim.h"
+#include "trace.h"
+#include "ring.h"
+#include "decode.h"
+
+/* Read the input; returns less than size only at the end of it */
+static size_t input_read(struct trace *trace, void *ptr, size_t size)
+{
+	unsigned char *dst = ptr;
+	size_t nr = 0;
+
+	while (nr < size && trace->peek_pos < trace->peek_len)
+		dst[nr++] = trace->peek[trace->peek_pos++];
+
+	if (trace->ring)
+		return nr + ring_read(trace->ring, dst + nr, size - nr);
+	return nr + fread(dst + nr, 1, size - nr, trace->file);
+}
+
+static size_t trace_read(struct trace *trace, void *ptr, size_t size,
+		bool term)
+{
+	size_t nr;
+
+	if (trace->chunked || trace->map || trace->pages) {
+		if (size > (size_t)(trace->end - trace->pos)) {
+			if (trace->chunked)
+				sim_error("Invalid chunk length");
+			if (term)
+				sim_error("Invalid remaining trace length");
+			return 0;
+		}
+		memcpy(ptr, trace->pos, size);
+		trace->pos += size;
+		return size;
+	}
+
+	nr = input_read(trace, ptr, size);
+	if (term && nr != size)
+		sim_error("Invalid remaining trace length");
+
+	return nr;
+}
+
+static unsigned long read_varint(struct trace *trace)
+{
+	unsigned long val = 0;
+	int shift;
+
+	for (shift = 0; trace->pos < trace->end && shift < 64; shift += 7) {
+		val |= (unsigned long)(*trace->pos & 0x7f) << shift;
+		if (!(*trace->pos++ & 0x80))
+			return val;
+	}
+
+	sim_error("Invalid varint");
+	return 0;
+}
+
+static unsigned long lz_length(const unsigned char **ip,
+		const unsigned char *end, unsigned long len)
+{
+	unsigned char b;
+
+	if (len != 15)
+		return len;
+
+	do {
+		if (*ip >= end)
+			sim_error("Invalid LZ block");
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+
+	return len;
+}
+
+/* Decompress an LZ4 block; returns the decompressed length */
+static unsigned long lz_decompress(const unsigned char *src, unsigned long len,
+		unsigned char *dst, unsigned long dst_len)
+{
+	const unsigned char *ip = src, *end = src + len;
+	unsigned char *op = dst, *op_end = dst + dst_len;
+	unsigned long lit, mlen, off;
+	unsigned char token;
+
+	while (ip < end) {
+		token = *ip++;
+
+		lit = lz_length(&ip, end, token >> 4);
+		if (lit > (unsigned long)(end - ip) ||
+				lit > (unsigned long)(op_end - op))
+			sim_error("Invalid LZ block");
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* the last sequence has no match */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			sim_error("Invalid LZ block");
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		mlen = lz_length(&ip, end, token & 0xf) + 4;
+		if (!off || off > (unsigned long)(op - dst) ||
+				mlen > (unsigned long)(op_end - op))
+			sim_error("Invalid LZ block");
+
+		/* may overlap */
+		for (; mlen; mlen--, op++)
+			*op = *(op - off);
+	}
+
+	return op - dst;
+}
+
+/* Start decoding a payload; it is decompressed if needed */
+static void start_chunk(struct trace *trace, const unsigned char *data,
+		unsigned long flags, unsigned long tid, unsigned long len)
+{
+	unsigned long raw_len;
+
+	trace->flags = flags;
+	trace->tid = tid;
+	trace->pos = data;
+	trace->end = data + len;
+
+	if (trace->flags & CHUNK_LZ) {
+		trace_read(trace, &raw_len, sizeof(unsigned long), true);
+		if (raw_len > trace->raw_size) {
+			trace->raw_size = raw_len;
+			trace->raw = realloc(trace->raw, trace->raw_size);
+			if (!trace->raw)
+				sim_error("Failed to read the chunk");
+		}
+
+		if (lz_decompress(trace->pos, trace->end - trace->pos,
+					trace->raw, raw_len) != raw_len)
+			sim_error("Invalid LZ block");
+
+		trace->pos = trace->raw;
+		trace->end = trace->raw + raw_len;
+	}
+
+	trace->start = trace->pos;
+	memset(trace->pred, 0, sizeof(trace->pred));
+}
+
+/* Read the payload of a chunk of a trace file */
+static void load_chunk(struct trace *trace, struct trace_chunk *chunk)
+{
+	trace->seq = chunk->seq;
+
+	if (trace->map) {
+		if (chunk->off + chunk->len > trace->map_size)
+			sim_error("Invalid chunk length");
+		start_chunk(trace, trace->map + chunk->off, chunk->flags, chunk->tid,
+				chunk->len);
+		return;
+	}
+
+	if (chunk->len > trace->buf_size) {
+		trace->buf_size = chunk->len;
+		trace->buf = realloc(trace->buf, trace->buf_size);
+		if (!trace->buf)
+			sim_error("Failed to read the chunk");
+	}
+
+	if (fseek(trace->file, chunk->off, SEEK_SET) ||
+			fread(trace->buf, 1, chunk->len, trace->file) != chunk->len)
+		sim_error("Invalid chunk length");
+
+	start_chunk(trace, trace->buf, chunk->flags, chunk->tid, chunk->len);
+}
+
+static int cmp_chunk(const void *a, const void *b)
+{
+	const struct trace_chunk *ca = a, *cb = b;
+
+	if (ca->tid != cb->tid)
+		return ca->tid < cb->tid ? -1 : 1;
+	if (ca->seq != cb->seq)
+		return ca->seq < cb->seq ? -1 : 1;
+	return 0;
+}
+
+static void split_streams(struct trace *trace);
+
+/* Scan the chunk headers and split the chunks into per-thread streams */
+static void build_index(struct trace *trace)
+{
+	unsigned long hdr[3];
+	struct trace_chunk *chunk;
+	int nr_alloc = 0;
+
+	while (fread(hdr, sizeof(unsigned long), 3, trace->file) == 3) {
+		if (ENTRY_TYPE(hdr[0]) != TYPE_CHUNK)
+			sim_error("Invalid chunk header");
+		if (CHUNK_FLAGS(hdr[0]) & CHUNK_INDEX)
+			break;
+		if (CHUNK_FLAGS(hdr[0]) & CHUNK_SNAPSHOT) {
+			if (fseek(trace->file, hdr[2], SEEK_CUR))
+				sim_error("Invalid chunk length");
+			continue;
+		}
+
+		if (trace->nr_chunks == nr_alloc) {
+			nr_alloc = nr_alloc ? nr_alloc * 2 : 1024;
+			trace->chunks = realloc(trace->chunks,
+					nr_alloc * sizeof(struct trace_chunk));
+			if (!trace->chunks)
+				sim_error("Failed to index the trace");
+		}
+
+		chunk = &trace->chunks[trace->nr_chunks++];
+		chunk->off = ftell(trace->file);
+		chunk->len = hdr[2];
+		chunk->seq = hdr[1];
+		chunk->tid = CHUNK_TID(hdr[0]);
+		chunk->flags = CHUNK_FLAGS(hdr[0]);
+
+		if (fseek(trace->file, chunk->len, SEEK_CUR))
+			sim_error("Invalid chunk length");
+	}
+
+	split_streams(trace);
+}
+
+/* Split the chunks into per-thread streams */
+static void split_streams(struct trace *trace)
+{
+	int i;
+
+	qsort(trace->chunks, trace->nr_chunks, sizeof(struct trace_chunk),
+			cmp_chunk);
+
+	trace->streams = malloc(trace->nr_chunks * sizeof(struct trace_stream));
+	trace->heap = malloc(trace->nr_chunks * sizeof(int));
+	if (trace->nr_chunks && (!trace->streams || !trace->heap))
+		sim_error("Failed to index the trace");
+
+	for (i = 0; i < trace->nr_chunks; i++) {
+		if (!i || trace->chunks[i].tid != trace->chunks[i - 1].tid) {
+			trace->streams[trace->nr_streams].chunks = &trace->chunks[i];
+			trace->streams[trace->nr_streams].nr_chunks = 0;
+			trace->streams[trace->nr_streams].cur = 0;
+			trace->nr_streams++;
+		}
+		trace->streams[trace->nr_streams - 1].nr_chunks++;
+	}
+}
+
+static inline unsigned long stream_seq(struct trace *trace, int idx)
+{
+	struct trace_stream *stream = &trace->streams[idx];
+
+	return stream->chunks[stream->cur].seq;
+}
+
+static void heap_down(struct trace *trace, int pos)
+{
+	int *heap = trace->heap;
+	int child, tmp;
+
+	while ((child = 2 * pos + 1) < trace->heap_len) {
+		if (child + 1 < trace->heap_len &&
+				stream_seq(trace, heap[child + 1]) <
+				stream_seq(trace, heap[child]))
+			child++;
+		if (stream_seq(trace, heap[pos]) <= stream_seq(trace, heap[child]))
+			break;
+
+		tmp = heap[pos];
+		heap[pos] = heap[child];
+		heap[child] = tmp;
+		pos = child;
+	}
+}
+
+/* Read the next chunk of a stream; returns false at the end */
+static bool read_pending(struct trace *trace, struct trace_pending *pend)
+{
+	unsigned long hdr[3];
+	size_t nr;
+
+again:
+	nr = input_read(trace, hdr, sizeof(hdr));
+	if (!nr)
+		return false;
+	if (nr != sizeof(hdr) || ENTRY_TYPE(hdr[0]) != TYPE_CHUNK)
+		sim_error("Invalid chunk header");
+
+	pend->seq = hdr[1];
+	pend->tid = CHUNK_TID(hdr[0]);
+	pend->flags = CHUNK_FLAGS(hdr[0]);
+	pend->len = hdr[2];
+	pend->data = malloc(pend->len ? pend->len : 1);
+	if (!pend->data)
+		sim_error("Failed to read the chunk");
+
+	if (input_read(trace, pend->data, pend->len) != pend->len)
+		sim_error("Invalid chunk length");
+
+	if (pend->flags & CHUNK_SNAPSHOT) {
+		free(pend->data);
+		goto again;
+	}
+
+	/* the index ends the trace; drain the trailer */
+	if (pend->flags & CHUNK_INDEX) {
+		free(pend->data);
+		input_read(trace, hdr, 2 * sizeof(unsigned long));
+		return false;
+	}
+
+	return true;
+}
+
+static void window_swap(struct trace *trace, int a, int b)
+{
+	struct trace_pending tmp = trace->window[a];
+
+	trace->window[a] = trace->window[b];
+	trace->window[b] = tmp;
+}
+
+static void window_push(struct trace *trace, struct trace_pending *pend)
+{
+	struct trace_pending *window = trace->window;
+	int pos = trace->window_len++;
+
+	window[pos] = *pend;
+	while (pos && window[(pos - 1) / 2].seq > window[pos].seq) {
+		window_swap(trace, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+}
+
+static void window_pop(struct trace *trace, struct trace_pending *pend)
+{
+	struct trace_pending *window = trace->window;
+	int pos = 0, child;
+
+	*pend = window[0];
+	window[0] = window[--trace->window_len];
+
+	while ((child = 2 * pos + 1) < trace->window_len) {
+		if (child + 1 < trace->window_len &&
+				window[child + 1].seq < window[child].seq)
+			child++;
+		if (window[pos].seq <= window[child].seq)
+			break;
+
+		window_swap(trace, pos, child);
+		pos = child;
+	}
+}
+
+/* Move to the chunk with the smallest sequence number in the window */
+static bool next_chunk_stream(struct trace *trace)
+{
+	struct trace_pending pend;
+
+	while (!trace->input_eof && trace->window_len < STREAM_WINDOW) {
+		if (!read_pending(trace, &pend)) {
+			trace->input_eof = true;
+			break;
+		}
+		window_push(trace, &pend);
+	}
+
+	if (!trace->window_len)
+		return false;
+
+	window_pop(trace, &pend);
+
+	if (debug)
+		printf("chunk tid %lu seq %lu len %lu flags %#lx\n",
+				pend.tid, pend.seq, pend.len, pend.flags);
+
+	free(trace->buf);
+	trace->buf = pend.data;
+	trace->buf_size = pend.len;
+	start_chunk(trace, trace->buf, pend.flags, pend.tid, pend.len);
+
+	return true;
+}
+
+/* Move to the chunk with the smallest sequence number among the streams */
+static bool next_chunk(struct trace *trace)
+{
+	struct trace_stream *stream;
+	struct trace_chunk *chunk;
+
+	if (trace->stream)
+		return next_chunk_stream(trace);
+
+	if (!trace->heap_len)
+		return false;
+
+	stream = &trace->streams[trace->heap[0]];
+	chunk = &stream->chunks[stream->cur];
+
+	if (debug)
+		printf("chunk tid %lu seq %lu len %lu flags %#lx\n",
+				chunk->tid, chunk->seq, chunk->len, chunk->flags);
+
+	load_chunk(trace, chunk);
+
+	if (++stream->cur == stream->nr_chunks)
+		trace->heap[0] = trace->heap[--trace->heap_len];
+	heap_down(trace, 0);
+
+	return true;
+}
+
+/*
+ * Take the chunks in [from, to) of the index (in order of the file) whose
+ * seq is in [seq_lo, seq_hi), and split them into per-thread streams
+ */
+static void select_chunks(struct trace *trace, int from, int to,
+		unsigned long seq_lo, unsigned long seq_hi)
+{
+	struct trace_index_entry *ent;
+	struct trace_chunk *chunk;
+	int i;
+
+	free(trace->streams);
+	free(trace->heap);
+	trace->streams = NULL;
+	trace->heap = NULL;
+	trace->nr_streams = 0;
+	trace->nr_chunks = 0;
+
+	for (i = from; i < to; i++) {
+		ent = &trace->index[i];
+		if (ent->seq < seq_lo || ent->seq >= seq_hi)
+			continue;
+
+		chunk = &trace->chunks[trace->nr_chunks++];
+		chunk->off = ent->off + 3 * sizeof(unsigned long);
+		chunk->len = ent->len;
+		chunk->seq = ent->seq;
+		chunk->tid = ent->tid;
+		chunk->flags = ent->flags;
+	}
+
+	split_streams(trace);
+}
+
+/* Streams with chunks left to read */
+static void init_heap(struct trace *trace)
+{
+	int i;
+
+	trace->heap_len = 0;
+	for (i = 0; i < trace->nr_streams; i++) {
+		if (trace->streams[i].cur < trace->streams[i].nr_chunks)
+			trace->heap[trace->heap_len++] = i;
+	}
+	for (i = trace->heap_len / 2 - 1; i >= 0; i--)
+		heap_down(trace, i);
+}
+
+/* Read the header of a v2 trace, after the magic */
+static void read_header(struct trace *trace)
+{
+	struct trace_header *header = &trace->header;
+	size_t len;
+
+	if (input_read(trace, header, sizeof(*header)) != sizeof(*header) ||
+			header->size < sizeof(*header))
+		sim_error("Invalid trace header");
+	if (header->version != TRACE_VERSION)
+		sim_error("Unsupported trace version");
+	if (header->page_size != PAGE_SIZE)
+		fprintf(stderr, "The trace was recorded with %u B pages\n",
+				header->page_size);
+
+	len = header->size - sizeof(*header);
+	trace->cmdline = calloc(1, len + 1);
+	if (!trace->cmdline || input_read(trace, trace->cmdline, len) != len)
+		sim_error("Invalid trace header");
+}
+
+/* Load the chunks from the index at the tail; returns false without it */
+static bool load_index(struct trace *trace)
+{
+	unsigned long trailer[2], hdr[3];
+
+	if (fseek(trace->file, -(long)sizeof(trailer), SEEK_END) ||
+			fread(trailer, sizeof(trailer), 1, trace->file) != 1 ||
+			trailer[1] != TRACE_INDEX_MAGIC)
+		return false;
+
+	if (fseek(trace->file, trailer[0], SEEK_SET) ||
+			fread(hdr, sizeof(hdr), 1, trace->file) != 1 ||
+			ENTRY_TYPE(hdr[0]) != TYPE_CHUNK ||
+			!(CHUNK_FLAGS(hdr[0]) & CHUNK_INDEX) ||
+			hdr[2] != hdr[1] * sizeof(struct trace_index_entry))
+		sim_error("Invalid trace index");
+
+	trace->nr_index = hdr[1];
+	trace->index = malloc(hdr[2] ? hdr[2] : 1);
+	trace->chunks = malloc(trace->nr_index * sizeof(struct trace_chunk) + 1);
+	if (!trace->index || !trace->chunks)
+		sim_error("Failed to index the trace");
+	if (fread(trace->index, 1, hdr[2], trace->file) != hdr[2])
+		sim_error("Invalid trace index");
+
+	select_chunks(trace, 0, trace->nr_index, 0, ~0UL);
+
+	return true;
+}
+
+/*
+ * Map a trace file to decode the entries in place instead of through stdio,
+ * which is kept for the streams and as the fallback
+ */
+static void map_trace(struct trace *trace)
+{
+	long nr_pages = sysconf(_SC_PHYS_PAGES);
+	int flags = MAP_PRIVATE;
+	struct stat st;
+	void *map;
+
+	if (fstat(fileno(trace->file), &st) || !S_ISREG(st.st_mode) ||
+			!st.st_size)
+		return;
+
+	/* prefault the whole trace unless it would take much of the memory */
+	if (nr_pages > 0 &&
+			(unsigned long)st.st_size / PAGE_SIZE < (unsigned long)nr_pages / 2)
+		flags |= MAP_POPULATE;
+
+	map = mmap(NULL, st.st_size, PROT_READ, flags, fileno(trace->file), 0);
+	if (map == MAP_FAILED)
+		return;
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	/* huge pages of the page cache, where the file system supports it */
+	madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+
+	trace->map = map;
+	trace->map_size = st.st_size;
+}
+
+/* Read the page table of a page trace, and point to the records */
+static void open_pages(struct trace *trace)
+{
+	struct pages_header hdr;
+	unsigned long len;
+
+	if (fread(&hdr, sizeof(hdr), 1, trace->file) != 1 ||
+			hdr.version != PAGES_VERSION ||
+			hdr.table_off < sizeof(hdr) ||
+			fseek(trace->file, hdr.table_off, SEEK_SET))
+		sim_error("Invalid page trace");
+
+	trace->nr_pages = hdr.nr_pages;
+	trace->vpns = malloc(hdr.nr_pages * sizeof(unsigned long) + 1);
+	if (!trace->vpns)
+		sim_error("Failed to open the trace");
+	if (fread(trace->vpns, sizeof(unsigned long), hdr.nr_pages,
+				trace->file) != hdr.nr_pages)
+		sim_error("Invalid page trace");
+
+	len = hdr.table_off - sizeof(hdr);
+	if (trace->map) {
+		trace->pos = trace->map + sizeof(hdr);
+	} else {
+		/* not mapped; the records are read at once */
+		trace->buf = malloc(len + 1);
+		if (!trace->buf)
+			sim_error("Failed to open the trace");
+		if (fseek(trace->file, sizeof(hdr), SEEK_SET) ||
+				fread(trace->buf, 1, len, trace->file) != len)
+			sim_error("Invalid page trace");
+		trace->pos = trace->buf;
+	}
+	trace->start = trace->pos;
+	trace->end = trace->pos + len;
+	trace->pages = true;
+}
+
+struct trace *trace_open(const char *path)
+{
+	struct trace *trace;
+	unsigned long word = 0;
+
+	trace = calloc(1, sizeof(struct trace));
+	if (!trace)
+		sim_error("Failed to open the trace");
+
+	if (!strncmp(path, "shm:", 4)) {
+		trace->ring = ring_attach(path + 4);
+	} else if (!strcmp(path, "-")) {
+		trace->file = stdin;
+	} else {
+		trace->file = fopen(path, "rb");
+		if (!trace->file) {
+			perror(path);
+			exit(1);
+		}
+	}
+
+	/* rings, pipes and stdin */
+	trace->stream = !trace->file || fseek(trace->file, 0, SEEK_CUR);
+
+	/* chunked traces start with a chunk header, or the header of v2 */
+	trace->peek_len = input_read(trace, trace->peek, sizeof(trace->peek));
+	if (trace->peek_len == sizeof(unsigned long)) {
+		memcpy(&word, trace->peek, sizeof(unsigned long));
+		if (ENTRY_TYPE(word) == TYPE_CHUNK || word == TRACE_MAGIC)
+			trace->chunked = true;
+	}
+
+	if (!trace->stream) {
+		trace->peek_len = 0;
+		rewind(trace->file);
+	}
+
+	if (trace->chunked && word == TRACE_MAGIC)
+		read_header(trace);
+
+	if (word == PAGES_MAGIC) {
+		if (trace->stream)
+			sim_error("A page trace must be read from a file");
+		map_trace(trace);
+		open_pages(trace);
+		return trace;
+	}
+
+	if (trace->stream) {
+		if (trace->chunked) {
+			trace->window = malloc(STREAM_WINDOW *
+					sizeof(struct trace_pending));
+			if (!trace->window)
+				sim_error("Failed to open the trace");
+		}
+		return trace;
+	}
+
+	map_trace(trace);
+
+	if (!trace->chunked) {
+		if (trace->map) {
+			trace->start = trace->map;
+			trace->pos = trace->map;
+			trace->end = trace->map + trace->map_size;
+		}
+		return trace;
+	}
+
+	if (!trace->header.version || !load_index(trace)) {
+		if (trace->header.version)
+			fseek(trace->file, trace->header.size, SEEK_SET);
+		build_index(trace);
+	}
+
+	init_heap(trace);
+
+	return trace;
+}
+
+/*
+ * Read only the chunks in [from, to) of the index whose seq is in
+ * [seq_lo, seq_hi), from the first of them; the current chunk is dropped
+ */
+void trace_select(struct trace *trace, int from, int to,
+		unsigned long seq_lo, unsigned long seq_hi)
+{
+	if (!trace->index)
+		sim_error("The trace has no index");
+
+	select_chunks(trace, from, to, seq_lo, seq_hi);
+	init_heap(trace);
+
+	trace->pos = NULL;
+	trace->end = NULL;
+}
+
+/*
+ * Start decoding the snapshot chunk at off (from the index); its objects
+ * are read as malloc entries before the chunks selected
+ */
+void trace_start_snapshot(struct trace *trace, unsigned long off)
+{
+	struct trace_chunk chunk;
+	unsigned long hdr[3];
+
+	if (fseek(trace->file, off, SEEK_SET) ||
+			fread(hdr, sizeof(hdr), 1, trace->file) != 1 ||
+			ENTRY_TYPE(hdr[0]) != TYPE_CHUNK ||
+			!(CHUNK_FLAGS(hdr[0]) & CHUNK_SNAPSHOT))
+		sim_error("Invalid snapshot");
+
+	chunk.off = off + sizeof(hdr);
+	chunk.len = hdr[2];
+	chunk.seq = hdr[1];
+	chunk.tid = 0;
+	chunk.flags = CHUNK_FLAGS(hdr[0]);
+	load_chunk(trace, &chunk);
+}
+
+/* Position of the next entry, which is read next after trace_seek() */
+void trace_tell(struct trace *trace, struct trace_pos *tpos)
+{
+	long off;
+
+	if (trace->stream)
+		sim_error("A stream cannot be seeked");
+
+	memset(tpos, 0, sizeof(*tpos));
+	if (trace->pos) {
+		tpos->off = trace->pos - trace->start;
+	} else if (!trace->chunked) {
+		off = ftell(trace->file);
+		if (off < 0)
+			sim_error("Failed to tell the trace position");
+		tpos->off = off;
+	}
+
+	if (trace->chunked && trace->pos) {
+		tpos->seq = trace->seq;
+		tpos->started = true;
+		memcpy(tpos->pred, trace->pred, sizeof(tpos->pred));
+	}
+}
+
+/*
+ * Move to a position of trace_tell() in the same trace. The chunks of every
+ * thread up to the current one are consumed, since the sequence numbers are
+ * unique and taken in order.
+ */
+void trace_seek(struct trace *trace, const struct trace_pos *tpos)
+{
+	struct trace_stream *stream;
+	struct trace_chunk *chunk = NULL;
+	int i;
+
+	if (trace->stream)
+		sim_error("A stream cannot be seeked");
+
+	if (!trace->chunked) {
+		if (trace->pos) {
+			if (tpos->off > (unsigned long)(trace->end - trace->start))
+				sim_error("Invalid trace position");
+			trace->pos = trace->start + tpos->off;
+		} else if (fseek(trace->file, tpos->off, SEEK_SET)) {
+			sim_error("Invalid trace position");
+		}
+		return;
+	}
+
+	for (i = 0; i < trace->nr_streams; i++) {
+		stream = &trace->streams[i];
+		stream->cur = 0;
+		if (!tpos->started)
+			continue;
+
+		while (stream->cur < stream->nr_chunks &&
+				stream->chunks[stream->cur].seq <= tpos->seq)
+			stream->cur++;
+		if (stream->cur && stream->chunks[stream->cur - 1].seq == tpos->seq)
+			chunk = &stream->chunks[stream->cur - 1];
+	}
+	init_heap(trace);
+
+	trace->pos = NULL;
+	trace->end = NULL;
+	if (!tpos->started)
+		return;
+
+	if (!chunk)
+		sim_error("Invalid trace position");
+	load_chunk(trace, chunk);
+	if (tpos->off > (unsigned long)(trace->end - trace->start))
+		sim_error("Invalid trace position");
+	trace->pos = trace->start + tpos->off;
+	memcpy(trace->pred, tpos->pred, sizeof(trace->pred));
+}
+
+static void decode_entry(struct trace *trace, struct trace_entry *ent,
+		unsigned long word)
+{
+	int ref_size;
+
+	ent->type = ENTRY_TYPE(word);
+	ent->addr = ENTRY_ADDR(word);
+	ent->tid = trace->tid;
+	ent->tag = 0;
+
+	switch (ent->type) {
+		case TYPE_REF:
+			trace_read(trace, &ref_size, sizeof(int), true);
+			ent->arg1 = ref_size;
+			break;
+
+		case TYPE_MALLOC:
+			ent->tag = ALLOC_TAG(ent->addr);
+			ent->addr = ALLOC_ADDR(ent->addr);
+			trace_read(trace, &ent->arg1, sizeof(unsigned long), true);
+			break;
+
+		case TYPE_PHASE:
+		case TYPE_HITS:
+			trace_read(trace, &ent->arg1, sizeof(unsigned long), true);
+			break;
+
+		case TYPE_RANGE:
+			trace_read(trace, &ent->arg1, sizeof(unsigned long), true);
+			ent->arg2 = !!(ent->arg1 & RANGE_WRITE);
+			ent->arg1 &= RANGE_LEN_MASK;
+			break;
+
+		case TYPE_CALLOC:
+		case TYPE_REALLOC:
+			ent->tag = ALLOC_TAG(ent->addr);
+			ent->addr = ALLOC_ADDR(ent->addr);
+			trace_read(trace, &ent->arg1, sizeof(unsigned long), true);
+			trace_read(trace, &ent->arg2, sizeof(unsigned long), true);
+			break;
+
+		case TYPE_MMAP:
+			trace_read(trace, &ent->arg1, sizeof(unsigned long), true);
+			trace_read(trace, &ent->arg2, sizeof(unsigned long), true);
+			trace_read(trace, &ent->arg3, sizeof(unsigned long), true);
+			trace_read(trace, &ent->arg4, sizeof(unsigned long), true);
+			break;
+
+		case TYPE_FREE:
+			ent->tag = ALLOC_TAG(ent->addr);
+			ent->addr = ALLOC_ADDR(ent->addr);
+			break;
+
+		case TYPE_ICOUNT:
+			break;
+
+		default:
+			/* wrong path */
+			sim_error("Wrong trace entry type..");
+	}
+}
+
+static void decode_delta(struct trace *trace, struct trace_entry *ent)
+{
+	struct trace_pred *pred;
+	unsigned long word, delta, code;
+	unsigned char token;
+
+	token = *trace->pos++;
+	if (token & DELTA_RAW) {
+		trace_read(trace, &word, sizeof(unsigned long), true);
+		decode_entry(trace, ent, word);
+		return;
+	}
+
+	if (((token >> DELTA_PRED_SHIFT) & DELTA_PRED_MASK) >= NR_PRED)
+		sim_error("Invalid delta token");
+	pred = &trace->pred[(token >> DELTA_PRED_SHIFT) & DELTA_PRED_MASK];
+
+	ent->type = TYPE_REF;
+	ent->tid = trace->tid;
+	ent->tag = 0;
+	if (token & DELTA_HIT) {
+		ent->addr = pred->last + pred->stride;
+	} else {
+		delta = read_varint(trace);
+		ent->addr = pred->last + ((delta >> 1) ^ -(delta & 1));
+	}
+
+	code = token & DELTA_SIZE_MASK;
+	if (code == DELTA_SIZE_VARINT)
+		ent->arg1 = read_varint(trace);
+	else
+		ent->arg1 = 1UL << code;
+
+	pred->stride = ent->addr - pred->last;
+	pred->last = ent->addr;
+}
+
+static bool next_page_run(struct trace *trace, struct trace_entry *ent)
+{
+	unsigned long word, id;
+
+	if (trace->pos == trace->end)
+		return false;
+
+	trace_read(trace, &word, sizeof(unsigned long), true);
+	if (word & PAGES_ENTRY) {
+		trace_read(trace, ent, sizeof(*ent), true);
+		return true;
+	}
+
+	id = word & PAGES_ID_MASK;
+	if (id >= trace->nr_pages)
+		sim_error("Invalid page id");
+
+	ent->type = ENTRY_PAGE_RUN;
+	ent->addr = trace->vpns[id];
+	ent->arg1 = word >> PAGES_RUN_SHIFT;
+	ent->tid = 0;
+	ent->tag = 0;
+
+	return true;
+}
+
+bool trace_next(struct trace *trace, struct trace_entry *ent)
+{
+	unsigned long word;
+
+	if (trace->pages)
+		return next_page_run(trace, ent);
+
+	if (!trace->chunked) {
+		if (trace_read(trace, &word, sizeof(unsigned long), false)
+				!= sizeof(unsigned long))
+			return false;
+		decode_entry(trace, ent, word);
+		return true;
+	}
+
+	while (trace->pos == trace->end) {
+		if (!next_chunk(trace))
+			return false;
+	}
+
+	if (trace->flags & CHUNK_DELTA) {
+		decode_delta(trace, ent);
+	} else {
+		trace_read(trace, &word, sizeof(unsigned long), true);
+		decode_entry(trace, ent, word);
+	}
+
+	return true;
+}
+
+/*
+ * Decode the vpns of the run of references at the current position while
+ * they are in memory in the legacy format; returns 0 when the next entry is
+ * to be read by trace_next()
+ */
+int trace_next_vpns(struct trace *trace, unsigned long *vpns, int max)
+{
+	if (trace->pages)
+		return 0;
+
+	if (trace->chunked) {
+		while (trace->pos == trace->end) {
+			if (!next_chunk(trace))
+				return 0;
+		}
+		if (trace->flags & CHUNK_DELTA)
+			return 0;
+	} else if (!trace->map) {
+		return 0;
+	}
+
+	return decode_refs(&trace->pos, trace->end, vpns, max);
+}
+
+void trace_close(struct trace *trace)
+{
+	while (trace->window_len)
+		free(trace->window[--trace->window_len].data);
+	free(trace->window);
+
+	if (trace->map)
+		munmap(trace->map, trace->map_size);
+	if (trace->ring)
+		ring_detach(trace->ring);
+	else if (trace->file != stdin)
+		fclose(trace->file);
+
+	free(trace->raw);
+	free(trace->buf);
+	free(trace->heap);
+	free(trace->streams);
+	free(trace->chunks);
+	free(trace->index);
+	free(trace->cmdline);
+	free(trace->vpns);
+	free(trace);
+}
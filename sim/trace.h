@@ -0,0 +1,242 @@
+/* vim: set shiftwidth=4 softtabstop=4 tabstop=4 : */
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/*
+ * Trace reader
+ *
+ * A trace is either a legacy stream of entries, or a sequence of chunks
+ * written by the multithreaded posetrace. Each chunk holds the entries of
+ * a trace buffer of a thread:
+ *
+ * word 0: TYPE_CHUNK | flags << 32 | tid
+ * word 1: sequence number taken when the buffer started filling
+ * word 2: payload length (bytes)
+ * payload: entries of the legacy format, or compressed as in flags
+ *
+ * Chunks of a thread are in order of their sequence numbers, so the global
+ * interleaving is rebuilt by a k-way merge of the per-thread streams.
+ *
+ * A trace that cannot be seeked (a ring of posetrace -ring, a named pipe or
+ * stdin) is read as a stream: the chunks are kept in a window of
+ * STREAM_WINDOW chunks, and the one with the smallest sequence number is
+ * taken whenever the window is full. The interleaving is the same as of
+ * a trace file unless a chunk is written more than STREAM_WINDOW chunks
+ * later than its sequence number.
+ *
+ * CHUNK_DELTA: a reference is a token byte followed by varints:
+ *   bit 7:     0 (reference)
+ *   bit 6:     stride hit; the address is last + stride of the predictor
+ *   bits 5-3:  predictor
+ *   bits 2-0:  log2 of the ref size, or 7 if a varint size follows
+ * and the zigzag varint delta from the last address of the predictor follows
+ * unless hit. The predictors are reset at every chunk. Other entries are
+ * a DELTA_RAW token followed by the entry in the legacy format.
+ *
+ * CHUNK_LZ: the payload is the uncompressed length (8B) followed by an LZ4
+ * block of the payload.
+ *
+ * Format v2 wraps the chunks with a header and an index:
+ *
+ * header:  struct trace_header + the command line of posetrace (NUL-padded
+ *          to 8B)
+ * chunks:  as above, and CHUNK_SNAPSHOT chunks of the areas mapped and the
+ *          objects live after the chunks before them (mmap and malloc
+ *          entries)
+ * index:   a CHUNK_INDEX chunk of struct trace_index_entry, one per chunk
+ *          other than the snapshots, in the order of the file
+ * trailer: offset of the index chunk + TRACE_INDEX_MAGIC
+ *
+ * A trace file is read through the index; without it (e.g., posetrace was
+ * killed), the chunks are scanned as in the older traces.
+ */
+
+/*
+ * Page trace of sim convert
+ *
+ * header:  struct pages_header
+ * records: a word per run of the references to a page, id | run << 32, or
+ *          PAGES_ENTRY followed by a struct trace_entry of another entry
+ * table:   vpn of each page id (nr_pages words) at table_off
+ *
+ * Page ids are dense, in the order of the first reference. A run is the
+ * consecutive accesses to a page after the references are split into pages.
+ * It is read as an ENTRY_PAGE_RUN entry of the vpn and the run length.
+ */
+#define PAGES_MAGIC				0x4547415045534f50UL	/* "POSEPAGE" */
+#define PAGES_VERSION			1
+#define PAGES_ENTRY				(1UL << 63)
+#define PAGES_RUN_SHIFT			32
+#define PAGES_MAX_RUN			0x7fffffffUL
+#define PAGES_ID_MASK			0xffffffffUL
+
+#define ENTRY_PAGE_RUN			0x10UL	/* not a type of the trace */
+
+#define STREAM_WINDOW			64
+
+#define CHUNK_DELTA				0x1UL
+#define CHUNK_LZ				0x2UL
+#define CHUNK_SNAPSHOT			0x4UL
+#define CHUNK_INDEX				0x8UL
+
+#define TRACE_MAGIC				0x3243525445534f50UL	/* "POSETRC2" */
+#define TRACE_INDEX_MAGIC		0x3258444945534f50UL	/* "POSEIDX2" */
+#define TRACE_VERSION			2
+#define TRACE_FILTERED			0x100UL	/* the low bits are CHUNK_* */
+#define TRACE_SAMPLED			0x200UL
+
+#define NR_PRED					4
+#define DELTA_RAW				0x80
+#define DELTA_HIT				0x40
+#define DELTA_PRED_SHIFT		3
+#define DELTA_PRED_MASK			0x7
+#define DELTA_SIZE_MASK			0x7
+#define DELTA_SIZE_VARINT		0x7
+
+struct trace_header {
+	unsigned long magic;
+	unsigned int version;
+	unsigned int size;				/* including the command line */
+	unsigned int page_size;
+	unsigned int addr_bits;
+	unsigned long flags;			/* CHUNK_* of the chunks + TRACE_* */
+	unsigned long block_records;	/* records of a trace buffer */
+};
+
+struct pages_header {
+	unsigned long magic;
+	unsigned int version;
+	unsigned int flags;
+	unsigned long nr_pages;
+	unsigned long nr_records;
+	unsigned long table_off;
+};
+
+struct trace_index_entry {
+	unsigned long off;				/* of the chunk header */
+	unsigned long len;				/* of the payload */
+	unsigned long seq;
+	unsigned long tid;
+	unsigned long flags;
+	unsigned long ref;				/* references before it in order of seq */
+	unsigned long icount;			/* of the thread at the start */
+	unsigned long snapshot;			/* offset of the last snapshot, or 0 */
+};
+
+struct trace_pred {
+	unsigned long last;
+	unsigned long stride;
+};
+
+struct trace_chunk {
+	long off;						/* file offset of the payload */
+	unsigned long len;
+	unsigned long seq;
+	unsigned long tid;
+	unsigned long flags;			/* CHUNK_* */
+};
+
+/* chunk read from a stream, in the window */
+struct trace_pending {
+	unsigned long seq;
+	unsigned long tid;
+	unsigned long flags;
+	unsigned long len;
+	unsigned char *data;
+};
+
+/* chunks of a thread */
+struct trace_stream {
+	struct trace_chunk *chunks;
+	int nr_chunks;
+	int cur;
+};
+
+struct trace {
+	FILE *file;
+	unsigned char *map;				/* trace file decoded in place */
+	size_t map_size;
+	struct ring *ring;				/* posetrace -ring */
+	bool stream;					/* cannot be seeked */
+	bool chunked;
+
+	/* format v2 */
+	struct trace_header header;		/* version is 0 in the older formats */
+	char *cmdline;					/* of posetrace */
+	struct trace_index_entry *index;
+	int nr_index;
+
+	/* page trace of sim convert */
+	bool pages;
+	unsigned long *vpns;			/* by page id */
+	unsigned long nr_pages;
+
+	/* the first word of a stream, read to tell the format */
+	unsigned char peek[sizeof(unsigned long)];
+	int peek_pos;
+	int peek_len;
+
+	struct trace_pending *window;	/* heap by seq */
+	int window_len;
+	bool input_eof;
+
+	struct trace_chunk *chunks;		/* sorted by (tid, seq) */
+	int nr_chunks;
+	struct trace_stream *streams;
+	int nr_streams;
+	int *heap;						/* streams by the seq of the next chunk */
+	int heap_len;
+
+	/* current chunk of a chunked trace, or the whole of a mapped legacy one */
+	unsigned char *buf;				/* payload as read */
+	unsigned long buf_size;
+	unsigned char *raw;				/* payload decompressed */
+	unsigned long raw_size;
+	const unsigned char *start;		/* of the payload decoded */
+	const unsigned char *pos;
+	const unsigned char *end;
+	unsigned long flags;
+	unsigned long tid;
+	unsigned long seq;
+	struct trace_pred pred[NR_PRED];
+};
+
+/*
+ * Position in a trace file (of a checkpoint): the offset in the payload of
+ * the current chunk and the predictors of a chunked trace, or the offset of
+ * the entries of the others
+ */
+struct trace_pos {
+	unsigned long seq;				/* of the current chunk */
+	unsigned long off;
+	bool started;					/* a chunk is current */
+	struct trace_pred pred[NR_PRED];
+};
+
+struct trace_entry {
+	unsigned long type;
+	unsigned long addr;
+	unsigned long arg1;				/* ref size, alloc size, nmemb, ptr, run or
+									   range length */
+	unsigned long arg2;				/* size of calloc() or realloc(), or write
+									   of a range */
+	unsigned long arg3;				/* mmap entries only */
+	unsigned long arg4;
+	unsigned long tag;				/* ALLOC_TAG_* of allocator entries */
+	unsigned long tid;				/* 0 in a legacy trace */
+};
+
+struct trace *trace_open(const char *path);
+bool trace_next(struct trace *trace, struct trace_entry *ent);
+int trace_next_vpns(struct trace *trace, unsigned long *vpns, int max);
+void trace_close(struct trace *trace);
+void trace_select(struct trace *trace, int from, int to,
+		unsigned long seq_lo, unsigned long seq_hi);
+void trace_start_snapshot(struct trace *trace, unsigned long off);
+void trace_tell(struct trace *trace, struct trace_pos *tpos);
+void trace_seek(struct trace *trace, const struct trace_pos *tpos);
+
+#endif
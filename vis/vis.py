@@ -8,12 +8,33 @@ from tqdm import tqdm
 
 TYPE_SHIFT = 60
 TYPE_REF = 0x0
+TYPE_RANGE = 0x1
+TYPE_HITS = 0x7
 TYPE_MALLOC = 0x8
 TYPE_CALLOC = 0x9
 TYPE_REALLOC = 0xa
 TYPE_FREE = 0xb
+TYPE_MMAP = 0xc
+TYPE_CHUNK = 0xd
+TYPE_PHASE = 0xe
 TYPE_ICOUNT = 0xf
 ADDR_MASK = (0x1 << TYPE_SHIFT) - 1
+# allocator entries carry the tag of the allocator function at bits 48-55
+ALLOC_ADDR_MASK = (0x1 << 48) - 1
+ALLOC_TYPES = (TYPE_MALLOC, TYPE_CALLOC, TYPE_REALLOC, TYPE_FREE)
+# the length word of a range entry has the write bit at the top
+RANGE_LEN_MASK = (0x1 << 63) - 1
+
+CHUNK_DELTA = 0x1
+CHUNK_LZ = 0x2
+CHUNK_SNAPSHOT = 0x4
+CHUNK_INDEX = 0x8
+TRACE_MAGIC = 0x3243525445534f50  # "POSETRC2"
+NR_PRED = 4
+DELTA_RAW = 0x80
+DELTA_HIT = 0x40
+DELTA_PRED_SHIFT = 3
+DELTA_SIZE_VARINT = 0x7
 
 PAGE_SHIFT = 12
 PAGE_SIZE = 0x1 << PAGE_SHIFT
@@ -38,6 +59,139 @@ def addr_to_vpn(addr):
     return addr >> PAGE_SHIFT
 
 
+def CHUNK_FLAGS(hdr):
+    return ENTRY_ADDR(hdr) >> 32
+
+
+ENTRY_LEN = {TYPE_REF: 12, TYPE_RANGE: 16, TYPE_HITS: 16, TYPE_MALLOC: 16,
+        TYPE_CALLOC: 24, TYPE_REALLOC: 24, TYPE_FREE: 8, TYPE_MMAP: 40, TYPE_PHASE: 16,
+        TYPE_ICOUNT: 8}
+
+
+def lz_decompress(src, raw_len):
+    dst = bytearray()
+    pos = 0
+    end = len(src)
+    while pos < end:
+        token = src[pos]
+        pos = pos + 1
+        lit = token >> 4
+        if lit == 15:
+            while True:
+                lit = lit + src[pos]
+                pos = pos + 1
+                if src[pos - 1] != 255:
+                    break
+        dst += src[pos:pos+lit]
+        pos = pos + lit
+        if pos == end:
+            break
+
+        off = src[pos] | (src[pos+1] << 8)
+        pos = pos + 2
+        mlen = token & 0xf
+        if mlen == 15:
+            while True:
+                mlen = mlen + src[pos]
+                pos = pos + 1
+                if src[pos - 1] != 255:
+                    break
+        mlen = mlen + 4
+        start = len(dst) - off
+        if off >= mlen:
+            dst += dst[start:start+mlen]
+        else:
+            # overlapping match
+            for i in range(mlen):
+                dst.append(dst[start + i])
+
+    if len(dst) != raw_len:
+        print("Wrong LZ block..\n")
+        sys.exit(1)
+    return bytes(dst)
+
+
+def read_varint(data, pos):
+    val = 0
+    shift = 0
+    while True:
+        b = data[pos]
+        pos = pos + 1
+        val = val | ((b & 0x7f) << shift)
+        shift = shift + 7
+        if not b & 0x80:
+            return val, pos
+
+
+def delta_decode(data):
+    # Rebuild the plain entries from the predicted tokens
+    out = bytearray()
+    last = [0] * NR_PRED
+    stride = [0] * NR_PRED
+    pos = 0
+    end = len(data)
+    while pos < end:
+        token = data[pos]
+        pos = pos + 1
+        if token & DELTA_RAW:
+            length = ENTRY_LEN[ENTRY_TYPE(struct.unpack("L", data[pos:pos+8])[0])]
+            out += data[pos:pos+length]
+            pos = pos + length
+            continue
+
+        p = (token >> DELTA_PRED_SHIFT) & 0x7
+        if token & DELTA_HIT:
+            addr = (last[p] + stride[p]) & 0xffffffffffffffff
+        else:
+            delta, pos = read_varint(data, pos)
+            delta = (delta >> 1) ^ -(delta & 1)
+            addr = (last[p] + delta) & 0xffffffffffffffff
+
+        code = token & 0x7
+        if code == DELTA_SIZE_VARINT:
+            size, pos = read_varint(data, pos)
+        else:
+            size = 1 << code
+
+        stride[p] = (addr - last[p]) & 0xffffffffffffffff
+        last[p] = addr
+        out += struct.pack("Li", addr, size)
+
+    return bytes(out)
+
+
+def decode_chunk(payload, flags):
+    if flags & CHUNK_LZ:
+        raw_len = struct.unpack("L", payload[0:8])[0]
+        payload = lz_decompress(payload[8:], raw_len)
+    if flags & CHUNK_DELTA:
+        payload = delta_decode(payload)
+    return payload
+
+
+def merge_chunks(trace_data, pos):
+    # Multithreaded traces are sequences of chunks; concatenating the payloads
+    # in order of the sequence numbers gives the global interleaving
+    chunks = []
+    end_pos = len(trace_data)
+    while pos < end_pos:
+        hdr, seq, length = struct.unpack("LLL", trace_data[pos:pos+24])
+        pos = pos + 24
+        if ENTRY_TYPE(hdr) != TYPE_CHUNK:
+            print("Wrong chunk header..\n")
+            sys.exit(1)
+        if CHUNK_FLAGS(hdr) & CHUNK_INDEX:
+            # the index and the trailer end the trace
+            break
+        if not CHUNK_FLAGS(hdr) & CHUNK_SNAPSHOT:
+            chunks.append((seq, pos, length, CHUNK_FLAGS(hdr)))
+        pos = pos + length
+
+    chunks.sort()
+    return b''.join(decode_chunk(trace_data[pos:pos+length], flags)
+            for _, pos, length, flags in chunks)
+
+
 def parse_args(argv):
     argc = len(argv)
     if argc != 2:
@@ -116,6 +270,14 @@ def extract(trace_file, object_only):
     with open(trace_file, 'rb') as f:
         trace_data = f.read()
 
+    first = struct.unpack("L", trace_data[0:8])[0] if trace_data else 0
+    if first == TRACE_MAGIC:
+        # trace format v2; the chunks follow the header
+        trace_data = merge_chunks(trace_data,
+                struct.unpack("I", trace_data[12:16])[0])
+    elif ENTRY_TYPE(first) == TYPE_CHUNK:
+        trace_data = merge_chunks(trace_data, 0)
+
     pos_prev = 0
     pos = 0
     end_pos = len(trace_data)
@@ -125,12 +287,23 @@ def extract(trace_file, object_only):
         pos = pos + 8
         trace_type = ENTRY_TYPE(addr)
         addr = ENTRY_ADDR(addr)
+        if trace_type in ALLOC_TYPES:
+            addr = addr & ALLOC_ADDR_MASK
 
         if trace_type == TYPE_REF:
             ref_size = struct.unpack("i", trace_data[pos:pos+4])[0]
             pos = pos + 4
             reg_ref(addr, ref_size)
 
+        elif trace_type == TYPE_RANGE:
+            # a page at a time, as the references
+            r_len = struct.unpack("L", trace_data[pos:pos+8])[0] & RANGE_LEN_MASK
+            pos = pos + 8
+            if r_len:
+                for vpn in range(addr_to_vpn(addr),
+                        addr_to_vpn(addr + r_len - 1) + 1):
+                    reg_ref(vpn << PAGE_SHIFT, 1)
+
         elif trace_type == TYPE_MALLOC:
             r_size = struct.unpack("L", trace_data[pos:pos+8])[0]
             pos = pos + 8
@@ -153,6 +326,18 @@ def extract(trace_file, object_only):
         elif trace_type == TYPE_FREE:
             free_object(addr)
 
+        elif trace_type == TYPE_MMAP:
+            # mappings are not drawn; objects come from the allocator entries
+            pos = pos + 32
+
+        elif trace_type == TYPE_HITS:
+            # hits of the cache filter are not drawn
+            pos = pos + 8
+
+        elif trace_type == TYPE_PHASE:
+            # sampling phases are not drawn
+            pos = pos + 8
+
         elif trace_type != TYPE_ICOUNT:
             # wrong path
             print("Wrong trace format..\n")